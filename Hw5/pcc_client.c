@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -9,37 +11,201 @@
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
+#include <endian.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <threads.h>
+#include <sys/mman.h>
+#include <linux/errqueue.h>
+#include "pcc_proto.h"
+#include "pcc_pool.h"
+#include "pcc_count.h"
+#include "pcc_net.h"
+#include "pcc_local.h"
+#include "pcc_lz.h"
 
 #define BUFFER_SIZE 1048576 // 1MB buffer size
+#define SEND_CHUNK (8 * BUFFER_SIZE) // bytes of a mapped file sent per write
+#define REPLY_WORDS (PCC_MAX_REPLY_SIZE / sizeof(uint64_t))
+#define CONTROL_BUFFER_SIZE 128
+#define COMPRESS_SLOTS 8 // frames the compressor may run ahead of the sender
+
+// ========== Types ==========
+
+/**
+ * Command-line configuration of the client.
+ *
+ * @param server_ip IP address of the server.
+ * @param server_port Port number of the server.
+ * @param file_path Path of the file to send.
+ * @param mode Counting mode (PCC_MODE_*).
+ * @param huge_pages Back the send buffer with huge pages if available.
+ * @param use_mmap Send from a mapping of the file rather than through a buffer.
+ * @param zerocopy Send the mapping with MSG_ZEROCOPY.
+ * @param compress Send the content as LZ-compressed frames.
+ * @param verify Count the file locally as well and check the server's reply.
+ * @param local Count the file locally only, with no server.
+ * @param threads Counting threads for local mode, 0 for one per CPU.
+ */
+typedef struct {
+    struct in_addr server_ip;
+    uint16_t server_port;
+    const char *file_path;
+    int mode;
+    int huge_pages;
+    int use_mmap;
+    int zerocopy;
+    int compress;
+    int verify;
+    int local;
+    int threads;
+} client_config;
+
+/**
+ * Progress of the upload, for sizing the send buffer once enough has been sent.
+ *
+ * @param start_ns When the first content byte was sent.
+ * @param sent Content bytes sent so far.
+ * @param autosized Whether the send buffer has been sized yet.
+ */
+typedef struct {
+    uint64_t start_ns;
+    uint64_t sent;
+    int autosized;
+} send_progress;
+
+/**
+ * MSG_ZEROCOPY bookkeeping. The kernel numbers zerocopy sends from 0 and
+ * reports finished ranges of them on the socket's error queue.
+ *
+ * @param issued Number of zerocopy sends made.
+ * @param completed Number of sends the kernel has reported done.
+ * @param copied Set if the kernel copied the data after all (it does on loopback).
+ */
+typedef struct {
+    uint32_t issued;
+    uint32_t completed;
+    int copied;
+} zerocopy_state;
+
+/**
+ * Counts of the file computed on the client side, in the server's modes.
+ *
+ * @param mode Counting mode; the UTF-8 decoder only runs for PCC_MODE_UTF8.
+ * @param histogram Per-byte-value counts.
+ * @param utf8 UTF-8 decoder state.
+ * @param multibyte Well-formed multibyte UTF-8 sequences.
+ * @param invalid Invalid UTF-8 bytes.
+ */
+typedef struct {
+    int mode;
+    uint64_t histogram[256];
+    pcc_utf8_state utf8;
+    uint64_t multibyte;
+    uint64_t invalid;
+} local_counts;
+
+/**
+ * A frame ready to send: the raw and stored lengths, then the block.
+ *
+ * @param data The encoded frame.
+ * @param length Length of the encoded frame.
+ */
+typedef struct {
+    unsigned char data[PCC_FRAME_HEADER_SIZE + PCC_LZ_BOUND(PCC_LZ_BLOCK_SIZE)];
+    size_t length;
+} compressed_frame;
+
+/**
+ * Ring of frames between the compressor thread and the sender. The
+ * compressor fills the slot after the last full one and the sender drains
+ * from head, so a slot is only ever touched by one side at a time.
+ *
+ * @param fd The file being compressed.
+ * @param file_size Bytes of the file to compress.
+ * @param local Counts to update with the file's bytes, or NULL.
+ * @param block The raw block being compressed.
+ * @param slots The frames.
+ * @param head Next frame to send.
+ * @param full Number of frames ready to send.
+ * @param done Set by the compressor after its last frame.
+ * @param lock Protects head, full and done.
+ * @param changed Signaled whenever a frame is filled or sent.
+ */
+typedef struct {
+    int fd;
+    uint64_t file_size;
+    local_counts *local;
+    unsigned char block[PCC_LZ_BLOCK_SIZE];
+    compressed_frame slots[COMPRESS_SLOTS];
+    int head;
+    int full;
+    int done;
+    mtx_t lock;
+    cnd_t changed;
+} compress_pipeline;
 
 // ========== Function Declarations ==========
 
-void parse_arguments(int argc, char *argv[], struct in_addr *server_ip, uint16_t *server_port, char **file_path);
-int open_and_get_file_size(const char *file_path, uint32_t *file_size);
+void parse_arguments(int argc, char *argv[], client_config *config);
+int parse_mode(const char *name);
+int open_and_get_file_size(const char *file_path, uint64_t *file_size);
 int connect_to_server(struct in_addr server_ip, uint16_t server_port);
-void send_file(int sockfd, int fd, uint32_t file_size);
-uint32_t receive_printable_count(int sockfd);
+void send_header(int sockfd, uint64_t file_size, uint32_t mode_flags, int extended);
+void write_all(int sockfd, const char *data, size_t length, send_progress *progress);
+int send_mapped_file(int sockfd, int fd, uint64_t file_size, int zerocopy, local_counts *local);
+void send_file(int sockfd, int fd, int huge_pages, local_counts *local);
+void send_compressed(int sockfd, int fd, uint64_t file_size, local_counts *local);
+int compressor_main(void *arg);
+void note_sent(int sockfd, send_progress *progress, size_t length);
+void send_zerocopy(int sockfd, const char *data, size_t length, zerocopy_state *zc, send_progress *progress);
+void reap_completions(int sockfd, zerocopy_state *zc, int wait);
+uint64_t now_ns(void);
+void count_locally(local_counts *local, const unsigned char *data, size_t length);
+void receive_all(int sockfd, void *buffer, size_t length);
+void receive_reply(int sockfd, int mode, int extended, uint64_t reply[REPLY_WORDS]);
+void print_reply(int mode, const uint64_t reply[REPLY_WORDS]);
+size_t build_values(int mode, int extended, const uint64_t histogram[256], uint64_t multibyte, uint64_t invalid,
+                    uint64_t values[REPLY_WORDS]);
+int verify_reply(int mode, int extended, local_counts *local, const uint64_t reply[REPLY_WORDS]);
+int count_local_file(const client_config *config);
 
 // ========== Function Definitions ==========
 
 int main(int argc, char *argv[]) {
-    struct in_addr server_ip;
-    uint16_t server_port;
-    char *file_path;
-    uint32_t file_size;
+    client_config config;
+    uint64_t file_size;
+    uint64_t reply[REPLY_WORDS];
+    local_counts local = {0};
     int fd, sockfd;
-    uint32_t printable_chars;
 
-    parse_arguments(argc, argv, &server_ip, &server_port, &file_path);
-    fd = open_and_get_file_size(file_path, &file_size);
-    sockfd = connect_to_server(server_ip, server_port);
-    send_file(sockfd, fd, file_size);
-    printable_chars = receive_printable_count(sockfd);
+    parse_arguments(argc, argv, &config);
+    if (config.local) {
+        return count_local_file(&config);
+    }
+    fd = open_and_get_file_size(config.file_path, &file_size);
+    sockfd = connect_to_server(config.server_ip, config.server_port);
+    local.mode = config.mode;
+    pcc_utf8_init(&local.utf8);
 
-    printf("# of printable characters: %u\n", printable_chars);
+    // Plain printable counts of small files keep the legacy protocol, so old servers still work
+    int extended = config.mode != PCC_MODE_PRINTABLE || file_size >= PCC_EXTENDED_MAGIC || config.compress;
+    send_header(sockfd, file_size, config.mode | (config.compress ? PCC_FLAG_LZ : 0), extended);
+    if (config.compress) {
+        send_compressed(sockfd, fd, file_size, config.verify ? &local : NULL);
+    } else if (!config.use_mmap ||
+        send_mapped_file(sockfd, fd, file_size, config.zerocopy, config.verify ? &local : NULL) < 0) {
+        send_file(sockfd, fd, config.huge_pages, config.verify ? &local : NULL);
+    }
+    receive_reply(sockfd, config.mode, extended, reply);
+    print_reply(config.mode, reply);
 
     close(fd);
     close(sockfd);
+    if (config.verify && verify_reply(config.mode, extended, &local, reply) < 0) {
+        return 1;
+    }
     return 0;
 }
 
@@ -48,23 +214,107 @@ int main(int argc, char *argv[]) {
  *
  * @param argc The number of command-line arguments.
  * @param argv The array of argument strings.
- * @param server_ip Output parameter to hold parsed server IP.
- * @param server_port Output parameter to hold parsed port number.
- * @param file_path Output parameter to hold file path string.
+ * @param config Output parameter filled with the parsed configuration.
  */
-void parse_arguments(int argc, char *argv[], struct in_addr *server_ip, uint16_t *server_port, char **file_path) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <server_ip> <server_port> <file_path>\n", argv[0]);
+void parse_arguments(int argc, char *argv[], client_config *config) {
+    static const struct option long_options[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"huge-pages", no_argument, NULL, 'H'},
+        {"read", no_argument, NULL, 'R'},
+        {"zerocopy", no_argument, NULL, 'z'},
+        {"compress", no_argument, NULL, 'c'},
+        {"verify", no_argument, NULL, 'v'},
+        {"local", no_argument, NULL, 'l'},
+        {"threads", required_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    config->mode = PCC_MODE_PRINTABLE;
+    config->huge_pages = 0;
+    config->use_mmap = 1;
+    config->zerocopy = 0;
+    config->compress = 0;
+    config->verify = 0;
+    config->local = 0;
+    config->threads = 0;
+    while ((opt = getopt_long(argc, argv, "m:HRzcvlj:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            config->mode = parse_mode(optarg);
+            break;
+        case 'H':
+            config->huge_pages = 1;
+            break;
+        case 'R':
+            config->use_mmap = 0;
+            break;
+        case 'z':
+            config->zerocopy = 1;
+            break;
+        case 'c':
+            config->compress = 1;
+            break;
+        case 'v':
+            config->verify = 1;
+            break;
+        case 'l':
+            config->local = 1;
+            break;
+        case 'j':
+            config->threads = atoi(optarg);
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    if (config->local && argc - optind == 1 && config->threads >= 0) {
+        config->file_path = argv[optind];
+        return;
+    }
+    if (config->local || argc - optind != 3) {
+        fprintf(stderr, "Usage: %s [-m printable|bytes|utf8] [-H] [-R] [-z] [-c] [-v] <server_ip> <server_port> <file_path>\n"
+                        "       %s --local [-m printable|bytes|utf8] [-j threads] <file_path>\n"
+                        "  -H, --huge-pages  use huge pages for the send buffer\n"
+                        "  -R, --read        send with read() instead of mapping the file\n"
+                        "  -z, --zerocopy    send the mapped file with MSG_ZEROCOPY\n"
+                        "  -c, --compress    compress the content while sending it\n"
+                        "  -v, --verify      count the file locally too and verify the server's reply\n"
+                        "  -l, --local       count the file locally on all cores, without a server\n"
+                        "  -j, --threads     counting threads for --local (default: one per CPU)\n",
+                argv[0], argv[0]);
         exit(1);
     }
 
-    if (inet_pton(AF_INET, argv[1], server_ip) != 1) {
+    if (inet_pton(AF_INET, argv[optind], &config->server_ip) != 1) {
         perror("Invalid server IP address");
         exit(1);
     }
 
-    *server_port = (uint16_t)atoi(argv[2]);
-    *file_path = argv[3];
+    config->server_port = (uint16_t)atoi(argv[optind + 1]);
+    config->file_path = argv[optind + 2];
+}
+
+/**
+ * Parses a counting mode name.
+ *
+ * @param name One of "printable", "bytes" or "utf8".
+ * @return The matching PCC_MODE_* value.
+ */
+int parse_mode(const char *name) {
+    if (strcmp(name, "printable") == 0) {
+        return PCC_MODE_PRINTABLE;
+    }
+    if (strcmp(name, "bytes") == 0) {
+        return PCC_MODE_BYTES;
+    }
+    if (strcmp(name, "utf8") == 0) {
+        return PCC_MODE_UTF8;
+    }
+    fprintf(stderr, "Unknown counting mode: %s\n", name);
+    exit(1);
 }
 
 /**
@@ -74,7 +324,7 @@ void parse_arguments(int argc, char *argv[], struct in_addr *server_ip, uint16_t
  * @param file_size Output parameter to hold the file size.
  * @return File descriptor of the opened file.
  */
-int open_and_get_file_size(const char *file_path, uint32_t *file_size) {
+int open_and_get_file_size(const char *file_path, uint64_t *file_size) {
     int fd = open(file_path, O_RDONLY);
     if (fd == -1) {
         perror("Error opening file");
@@ -92,7 +342,7 @@ int open_and_get_file_size(const char *file_path, uint32_t *file_size) {
         exit(1);
     }
 
-    *file_size = (uint32_t)size;
+    *file_size = (uint64_t)size;
     return fd;
 }
 
@@ -125,47 +375,538 @@ int connect_to_server(struct in_addr server_ip, uint16_t server_port) {
 }
 
 /**
- * Sends the file size and file contents to the server.
+ * Sends the request header: the legacy 4-byte file size, or the extended
+ * magic followed by the mode and flags and the 8-byte file size.
  *
  * @param sockfd The socket file descriptor connected to the server.
- * @param fd The file descriptor of the file to send.
  * @param file_size The size of the file in bytes.
+ * @param mode_flags The counting mode (PCC_MODE_*) ored with any PCC_FLAG_*.
+ * @param extended Whether to send an extended header.
  */
-void send_file(int sockfd, int fd, uint32_t file_size) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read, bytes_written;
+void send_header(int sockfd, uint64_t file_size, uint32_t mode_flags, int extended) {
+    unsigned char header[sizeof(uint32_t) + PCC_EXTENDED_HEADER_SIZE];
+    uint32_t net_word;
+    uint64_t net_size;
+    size_t length;
+
+    if (extended) {
+        net_word = htonl(PCC_EXTENDED_MAGIC);
+        memcpy(header, &net_word, sizeof(net_word));
+        net_word = htonl(mode_flags);
+        memcpy(header + 4, &net_word, sizeof(net_word));
+        net_size = htobe64(file_size);
+        memcpy(header + 8, &net_size, sizeof(net_size));
+        length = sizeof(header);
+    } else {
+        net_word = htonl((uint32_t)file_size);
+        memcpy(header, &net_word, sizeof(net_word));
+        length = sizeof(net_word);
+    }
 
-    uint32_t net_file_size = htonl(file_size);
-    if (write(sockfd, &net_file_size, sizeof(net_file_size)) != sizeof(net_file_size)) {
+    if (write(sockfd, header, length) != (ssize_t)length) {
         perror("Error sending file size to server");
         exit(1);
     }
+}
 
-    while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
-        bytes_written = write(sockfd, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
+/**
+ * Writes a whole buffer to the server, across as many writes as it takes.
+ *
+ * @param sockfd The socket file descriptor connected to the server.
+ * @param data The bytes to send.
+ * @param length Number of bytes to send.
+ * @param progress Upload progress, updated with the bytes sent.
+ */
+void write_all(int sockfd, const char *data, size_t length, send_progress *progress) {
+    while (length > 0) {
+        ssize_t bytes_written = write(sockfd, data, length);
+        if (bytes_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written <= 0) {
             perror("Error sending file contents to server");
             exit(1);
         }
+        data += bytes_written;
+        length -= bytes_written;
+        note_sent(sockfd, progress, bytes_written);
+    }
+}
+
+/**
+ * Sends the file contents straight from a read-only mapping of the file,
+ * in large writes with no copy into a user buffer. The mapping is marked
+ * sequential so the kernel reads ahead aggressively, and the next chunk is
+ * requested while the current one is being sent. Sent chunks are dropped
+ * from the mapping to keep the resident set small on huge files; pages
+ * still pinned by a zerocopy send stay referenced by the kernel until the
+ * send completes, and the file is never written, so that is safe.
+ *
+ * @param sockfd The socket file descriptor connected to the server.
+ * @param fd The file descriptor of the file to send.
+ * @param file_size The size of the file in bytes.
+ * @param zerocopy Whether to send with MSG_ZEROCOPY.
+ * @param local Counts to update with the sent bytes, or NULL.
+ * @return 0 on success, -1 if the file cannot be mapped (nothing was sent).
+ */
+int send_mapped_file(int sockfd, int fd, uint64_t file_size, int zerocopy, local_counts *local) {
+    send_progress progress = { .start_ns = now_ns() };
+    zerocopy_state zc = {0};
+    int one = 1;
+
+    if (file_size == 0) {
+        return 0;
+    }
+    if (zerocopy && setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        perror("MSG_ZEROCOPY unavailable, sending with copies");
+        zerocopy = 0;
+    }
+
+    char *data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    madvise(data, file_size, MADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t offset = 0;
+    while (offset < file_size) {
+        size_t chunk = file_size - offset < SEND_CHUNK ? file_size - offset : SEND_CHUNK;
+        if (offset + chunk < file_size) {
+            size_t next = file_size - offset - chunk < SEND_CHUNK ? file_size - offset - chunk : SEND_CHUNK;
+            madvise(data + offset + chunk, next, MADV_WILLNEED);
+        }
+        if (local != NULL) {
+            count_locally(local, (unsigned char *)data + offset, chunk);
+        }
+        if (zerocopy) {
+            send_zerocopy(sockfd, data + offset, chunk, &zc, &progress);
+        } else {
+            write_all(sockfd, data + offset, chunk, &progress);
+        }
+        madvise(data + offset, chunk, MADV_DONTNEED);
+        offset += chunk;
+    }
+
+    while (zc.completed != zc.issued) {
+        reap_completions(sockfd, &zc, 1);
+    }
+    munmap(data, file_size);
+    return 0;
+}
+
+/**
+ * Sends the file contents to the server through a buffer, for files that
+ * cannot be mapped (pipes, character devices).
+ *
+ * @param sockfd The socket file descriptor connected to the server.
+ * @param fd The file descriptor of the file to send.
+ * @param huge_pages Whether to back the send buffer with huge pages.
+ * @param local Counts to update with the sent bytes, or NULL.
+ */
+void send_file(int sockfd, int fd, int huge_pages, local_counts *local) {
+    send_progress progress = { .start_ns = now_ns() };
+    pcc_pool pool;
+    ssize_t bytes_read;
+
+    if (pcc_pool_init(&pool, 1, BUFFER_SIZE, huge_pages ? PCC_POOL_HUGE : 0) < 0) {
+        perror("Buffer allocation failed");
+        exit(1);
+    }
+    char *buffer = pcc_pool_get(&pool);
+
+    while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
+        if (local != NULL) {
+            count_locally(local, (unsigned char *)buffer, bytes_read);
+        }
+        write_all(sockfd, buffer, bytes_read, &progress);
     }
 
     if (bytes_read == -1) {
         perror("Error reading file");
         exit(1);
     }
+    pcc_pool_put(&pool, buffer);
+    pcc_pool_destroy(&pool);
 }
 
 /**
- * Receives the number of printable characters reported by the server.
+ * Sends the file contents as LZ frames. A compressor thread reads and
+ * compresses blocks into a ring of frames while this thread sends the
+ * ones already done, so compression overlaps with the network instead of
+ * adding to it. Blocks that do not shrink are sent stored.
  *
  * @param sockfd The socket file descriptor connected to the server.
- * @return The number of printable characters.
+ * @param fd The file descriptor of the file to send.
+ * @param file_size The size of the file in bytes.
+ * @param local Counts to update with the file's bytes, or NULL.
  */
-uint32_t receive_printable_count(int sockfd) {
-    uint32_t net_count;
-    if (read(sockfd, &net_count, sizeof(net_count)) != sizeof(net_count)) {
-        perror("Error receiving number of printable characters from server");
+void send_compressed(int sockfd, int fd, uint64_t file_size, local_counts *local) {
+    send_progress progress = { .start_ns = now_ns() };
+    compress_pipeline *pipeline = calloc(1, sizeof(compress_pipeline));
+    thrd_t compressor;
+
+    if (pipeline == NULL) {
+        perror("Frame buffer allocation failed");
+        exit(1);
+    }
+    pipeline->fd = fd;
+    pipeline->file_size = file_size;
+    pipeline->local = local;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (mtx_init(&pipeline->lock, mtx_plain) != thrd_success || cnd_init(&pipeline->changed) != thrd_success ||
+        thrd_create(&compressor, compressor_main, pipeline) != thrd_success) {
+        fprintf(stderr, "Error starting compressor thread\n");
         exit(1);
     }
-    return ntohl(net_count);
+
+    mtx_lock(&pipeline->lock);
+    for (;;) {
+        while (pipeline->full == 0 && !pipeline->done) {
+            cnd_wait(&pipeline->changed, &pipeline->lock);
+        }
+        if (pipeline->full == 0) {
+            break;
+        }
+        compressed_frame *frame = &pipeline->slots[pipeline->head];
+        mtx_unlock(&pipeline->lock);
+
+        write_all(sockfd, (char *)frame->data, frame->length, &progress);
+
+        mtx_lock(&pipeline->lock);
+        pipeline->head = (pipeline->head + 1) % COMPRESS_SLOTS;
+        pipeline->full--;
+        cnd_signal(&pipeline->changed);
+    }
+    mtx_unlock(&pipeline->lock);
+
+    thrd_join(compressor, NULL);
+    cnd_destroy(&pipeline->changed);
+    mtx_destroy(&pipeline->lock);
+    free(pipeline);
+}
+
+/**
+ * Compressor thread of send_compressed: reads the file a block at a time
+ * and encodes each block into the next free frame.
+ *
+ * @param arg The compress_pipeline.
+ * @return 0.
+ */
+int compressor_main(void *arg) {
+    compress_pipeline *pipeline = arg;
+    unsigned char *block = pipeline->block;
+    uint64_t remaining = pipeline->file_size;
+
+    while (remaining > 0) {
+        size_t length = remaining < PCC_LZ_BLOCK_SIZE ? remaining : PCC_LZ_BLOCK_SIZE;
+        for (size_t filled = 0; filled < length;) {
+            ssize_t bytes_read = read(pipeline->fd, block + filled, length - filled);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read < 0) {
+                perror("Error reading file");
+                exit(1);
+            }
+            if (bytes_read == 0) {
+                fprintf(stderr, "Error reading file: file shrank while being sent\n");
+                exit(1);
+            }
+            filled += bytes_read;
+        }
+        if (pipeline->local != NULL) {
+            count_locally(pipeline->local, block, length);
+        }
+
+        mtx_lock(&pipeline->lock);
+        while (pipeline->full == COMPRESS_SLOTS) {
+            cnd_wait(&pipeline->changed, &pipeline->lock);
+        }
+        compressed_frame *frame = &pipeline->slots[(pipeline->head + pipeline->full) % COMPRESS_SLOTS];
+        mtx_unlock(&pipeline->lock);
+
+        unsigned char *payload = frame->data + PCC_FRAME_HEADER_SIZE;
+        size_t stored = pcc_lz_compress(block, length, payload);
+        if (stored >= length) {
+            memcpy(payload, block, length);
+            stored = length;
+        }
+        uint32_t lengths[2] = { htonl((uint32_t)length), htonl((uint32_t)stored) };
+        memcpy(frame->data, lengths, sizeof(lengths));
+        frame->length = PCC_FRAME_HEADER_SIZE + stored;
+        remaining -= length;
+
+        mtx_lock(&pipeline->lock);
+        pipeline->full++;
+        cnd_signal(&pipeline->changed);
+        mtx_unlock(&pipeline->lock);
+    }
+
+    mtx_lock(&pipeline->lock);
+    pipeline->done = 1;
+    cnd_signal(&pipeline->changed);
+    mtx_unlock(&pipeline->lock);
+    return 0;
+}
+
+/**
+ * Records sent content bytes, and once enough have gone out, sizes the
+ * send buffer from the observed bandwidth and round-trip time.
+ *
+ * @param sockfd The socket file descriptor connected to the server.
+ * @param progress Upload progress.
+ * @param length Bytes just sent.
+ */
+void note_sent(int sockfd, send_progress *progress, size_t length) {
+    progress->sent += length;
+    if (!progress->autosized && progress->sent >= PCC_AUTOSIZE_AFTER) {
+        pcc_autosize_buffer(sockfd, SO_SNDBUF, progress->sent, now_ns() - progress->start_ns);
+        progress->autosized = 1;
+    }
+}
+
+/**
+ * Sends a chunk with MSG_ZEROCOPY: the kernel pins the pages and sends
+ * them without copying, then reports on the error queue when it is done
+ * with them. When too many notifications are outstanding the send fails
+ * with ENOBUFS, so completions are reaped and the send retried.
+ *
+ * @param sockfd The socket file descriptor connected to the server, with SO_ZEROCOPY set.
+ * @param data The bytes to send.
+ * @param length Number of bytes to send.
+ * @param zc Zerocopy bookkeeping.
+ * @param progress Upload progress, updated with the bytes sent.
+ */
+void send_zerocopy(int sockfd, const char *data, size_t length, zerocopy_state *zc, send_progress *progress) {
+    while (length > 0) {
+        ssize_t bytes_sent = send(sockfd, data, length, MSG_ZEROCOPY);
+        if (bytes_sent < 0 && errno == ENOBUFS) {
+            reap_completions(sockfd, zc, 1);
+            continue;
+        }
+        if (bytes_sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_sent <= 0) {
+            perror("Error sending file contents to server");
+            exit(1);
+        }
+        zc->issued++;
+        data += bytes_sent;
+        length -= bytes_sent;
+        note_sent(sockfd, progress, bytes_sent);
+        reap_completions(sockfd, zc, 0);
+    }
+}
+
+/**
+ * Reads zerocopy completion notifications off the socket's error queue.
+ *
+ * @param sockfd The socket file descriptor connected to the server.
+ * @param zc Zerocopy bookkeeping, updated with the completed sends.
+ * @param wait Whether to block until at least one notification arrives.
+ */
+void reap_completions(int sockfd, zerocopy_state *zc, int wait) {
+    char control[CONTROL_BUFFER_SIZE];
+
+    for (;;) {
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN && wait) {
+                // Error queue activity is reported as POLLERR whatever the requested events
+                struct pollfd pfd = { .fd = sockfd, .events = 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (errno == EAGAIN || errno == EINTR) {
+                return;
+            }
+            perror("Error reading zerocopy completions");
+            exit(1);
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // ee_info..ee_data is the inclusive range of completed send numbers
+            zc->completed += err->ee_data - err->ee_info + 1;
+            zc->copied |= (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+        }
+        wait = 0;
+    }
+}
+
+/**
+ * Counts a chunk of the file the way the server does, for -v.
+ *
+ * @param local The running counts.
+ * @param data The chunk.
+ * @param length Length of the chunk in bytes.
+ */
+void count_locally(local_counts *local, const unsigned char *data, size_t length) {
+    pcc_count_bytes(data, length, local->histogram);
+    if (local->mode == PCC_MODE_UTF8) {
+        pcc_utf8_scan(&local->utf8, data, length, &local->multibyte, &local->invalid);
+    }
+}
+
+/**
+ * Reads exactly length bytes of the server's reply.
+ *
+ * @param sockfd The socket file descriptor connected to the server.
+ * @param buffer Where to store the reply.
+ * @param length Number of bytes to read.
+ */
+void receive_all(int sockfd, void *buffer, size_t length) {
+    size_t received = 0;
+    while (received < length) {
+        ssize_t cur = read(sockfd, (char *)buffer + received, length - received);
+        if (cur < 0 && errno == EINTR) {
+            continue;
+        }
+        if (cur <= 0) {
+            perror("Error receiving number of printable characters from server");
+            exit(1);
+        }
+        received += cur;
+    }
+}
+
+/**
+ * Receives the server's reply: the legacy 4-byte printable count, or an
+ * extended reply of 8-byte values, in host order.
+ *
+ * @param sockfd The socket file descriptor connected to the server.
+ * @param mode The counting mode the request was sent with.
+ * @param extended Whether the request used the extended header.
+ * @param reply Output: the printable count, followed by the mode's byte or class counts.
+ */
+void receive_reply(int sockfd, int mode, int extended, uint64_t reply[REPLY_WORDS]) {
+    if (!extended) {
+        uint32_t net_count;
+        receive_all(sockfd, &net_count, sizeof(net_count));
+        reply[0] = ntohl(net_count);
+        return;
+    }
+
+    receive_all(sockfd, reply, PCC_REPLY_SIZE(mode));
+    for (size_t i = 0; i < PCC_REPLY_SIZE(mode) / sizeof(uint64_t); i++) {
+        reply[i] = be64toh(reply[i]);
+    }
+}
+
+/**
+ * Prints the printable count, followed by the nonzero byte counts
+ * (PCC_MODE_BYTES) or the UTF-8 classes (PCC_MODE_UTF8).
+ *
+ * @param mode The counting mode the request was sent with.
+ * @param reply The reply, as returned by receive_reply.
+ */
+void print_reply(int mode, const uint64_t reply[REPLY_WORDS]) {
+    static const char *class_names[PCC_UTF8_CLASSES] = {
+        [PCC_UTF8_PRINTABLE] = "printable",
+        [PCC_UTF8_CONTROL] = "control",
+        [PCC_UTF8_MULTIBYTE] = "multibyte",
+        [PCC_UTF8_INVALID] = "invalid"
+    };
+
+    printf("# of printable characters: %" PRIu64 "\n", reply[0]);
+    if (mode == PCC_MODE_BYTES) {
+        for (int b = 0; b < 256; b++) {
+            if (reply[b + 1] > 0) {
+                printf("byte 0x%02x : %" PRIu64 " times\n", b, reply[b + 1]);
+            }
+        }
+    } else if (mode == PCC_MODE_UTF8) {
+        for (int c = 0; c < PCC_UTF8_CLASSES; c++) {
+            printf("%s : %" PRIu64 "\n", class_names[c], reply[c + 1]);
+        }
+    }
+}
+
+/**
+ * Builds the values of a reply from counts: the printable count, followed
+ * by the mode's byte or class counts.
+ *
+ * @param mode The counting mode.
+ * @param extended Whether the reply is extended (a legacy count is 32-bit).
+ * @param histogram Per-byte-value counts.
+ * @param multibyte Well-formed multibyte UTF-8 sequences.
+ * @param invalid Invalid UTF-8 bytes.
+ * @param values Output: the reply values.
+ * @return Number of values.
+ */
+size_t build_values(int mode, int extended, const uint64_t histogram[256], uint64_t multibyte, uint64_t invalid,
+                    uint64_t values[REPLY_WORDS]) {
+    values[0] = pcc_printable_count(histogram);
+    if (!extended) {
+        values[0] = (uint32_t)values[0];
+        return 1;
+    }
+    if (mode == PCC_MODE_BYTES) {
+        memcpy(&values[1], histogram, 256 * sizeof(uint64_t));
+        return 1 + 256;
+    }
+    if (mode == PCC_MODE_UTF8) {
+        pcc_utf8_classes(histogram, multibyte, invalid, &values[1]);
+        return 1 + PCC_UTF8_CLASSES;
+    }
+    return 1;
+}
+
+/**
+ * Compares the server's reply with the counts computed locally.
+ *
+ * @param mode The counting mode the request was sent with.
+ * @param extended Whether the request used the extended header.
+ * @param local The local counts of the whole file.
+ * @param reply The server's reply.
+ * @return 0 if they agree, -1 (after reporting the first difference) otherwise.
+ */
+int verify_reply(int mode, int extended, local_counts *local, const uint64_t reply[REPLY_WORDS]) {
+    uint64_t expected[REPLY_WORDS];
+
+    pcc_utf8_finish(&local->utf8, &local->invalid);
+    size_t num_values = build_values(mode, extended, local->histogram, local->multibyte, local->invalid, expected);
+    for (size_t i = 0; i < num_values; i++) {
+        if (reply[i] != expected[i]) {
+            fprintf(stderr, "Verification failed: reply value %zu is %" PRIu64 ", counted %" PRIu64 " locally\n",
+                    i, reply[i], expected[i]);
+            return -1;
+        }
+    }
+    printf("verified against local count\n");
+    return 0;
+}
+
+/**
+ * --local: counts the file on all cores with no server involved, and
+ * prints the result as an upload in the same mode would.
+ *
+ * @param config The parsed configuration.
+ * @return The process exit status.
+ */
+int count_local_file(const client_config *config) {
+    pcc_local_result result;
+    uint64_t values[REPLY_WORDS];
+
+    if (pcc_count_file(config->file_path, config->mode, config->threads, &result) < 0) {
+        perror("Error counting file");
+        return 1;
+    }
+    build_values(config->mode, 1, result.histogram, result.multibyte, result.invalid, values);
+    print_reply(config->mode, values);
+    return 0;
+}
+
+/**
+ * @return The current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
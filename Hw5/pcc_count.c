@@ -0,0 +1,272 @@
+#include <string.h>
+#include "pcc_count.h"
+#include "pcc_proto.h"
+
+// Partial counts are 32-bit; flush them well before they could overflow
+#define FLUSH_BYTES (1UL << 30)
+
+#define HIGH_BITS 0x8080808080808080ULL
+
+// Bytes decoded by the UTF-8 DFA between attempts to skip ASCII
+#define DFA_STRETCH 16
+
+// ========== Byte Histogram ==========
+
+/**
+ * Adds the byte histogram of a buffer to histogram.
+ * Eight bytes are loaded at a time and spread over four interleaved
+ * sub-histograms, so that runs of the same byte do not serialize on a
+ * single counter. There is no data-dependent branch, so the speed does not
+ * depend on how printable the input is.
+ *
+ * @param data The buffer to count.
+ * @param length Length of the buffer in bytes.
+ * @param histogram Per-byte-value counts, added to.
+ */
+void pcc_count_bytes(const unsigned char *data, size_t length, uint64_t histogram[256]) {
+    pcc_partial_histogram partial;
+
+    while (length > 0) {
+        size_t chunk = length < FLUSH_BYTES ? length : FLUSH_BYTES;
+
+        memset(partial, 0, sizeof(partial));
+        pcc_count_partial(data, chunk, partial);
+        pcc_flush_partial(partial, histogram);
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+/**
+ * Adds a buffer to 32-bit interleaved sub-histograms, for callers that
+ * count many short pieces and flush once at the end. The caller must
+ * flush before 2^32 bytes have been added.
+ *
+ * @param data The buffer to count.
+ * @param length Length of the buffer in bytes.
+ * @param partial The sub-histograms, added to.
+ */
+void pcc_count_partial(const unsigned char *data, size_t length, pcc_partial_histogram partial) {
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        partial[0][word & 0xff]++;
+        partial[1][(word >> 8) & 0xff]++;
+        partial[2][(word >> 16) & 0xff]++;
+        partial[3][(word >> 24) & 0xff]++;
+        partial[0][(word >> 32) & 0xff]++;
+        partial[1][(word >> 40) & 0xff]++;
+        partial[2][(word >> 48) & 0xff]++;
+        partial[3][word >> 56]++;
+    }
+    for (; i < length; i++) {
+        partial[0][data[i]]++;
+    }
+}
+
+/**
+ * Adds sub-histograms to a histogram.
+ *
+ * @param partial The sub-histograms.
+ * @param histogram Per-byte-value counts, added to.
+ */
+void pcc_flush_partial(const pcc_partial_histogram partial, uint64_t histogram[256]) {
+    for (int b = 0; b < 256; b++) {
+        histogram[b] += (uint64_t)partial[0][b] + partial[1][b] + partial[2][b] + partial[3][b];
+    }
+}
+
+/**
+ * @param histogram Per-byte-value counts.
+ * @return The number of printable characters (ASCII 32-126) in the histogram.
+ */
+uint64_t pcc_printable_count(const uint64_t histogram[256]) {
+    uint64_t count = 0;
+    for (int b = 32; b <= 126; b++) {
+        count += histogram[b];
+    }
+    return count;
+}
+
+// ========== UTF-8 Classification ==========
+
+// UTF-8 byte classes, by the ranges of Unicode table 3-7
+enum {
+    C_ASCII,    // 00..7F
+    C_CONT_LO,  // 80..8F
+    C_CONT_MID, // 90..9F
+    C_CONT_HI,  // A0..BF
+    C_BAD,      // C0..C1, F5..FF
+    C_LEAD2,    // C2..DF
+    C_E0,       // E0
+    C_LEAD3,    // E1..EC, EE..EF
+    C_ED,       // ED
+    C_F0,       // F0
+    C_LEAD4,    // F1..F3
+    C_F4,       // F4
+    NUM_CLASSES
+};
+
+// Decoder states; S_ACCEPT is between sequences
+enum {
+    S_ACCEPT,
+    S_NEED1,    // one 80..BF to go
+    S_NEED2,    // two 80..BF to go
+    S_E0,       // A0..BF, then one more
+    S_ED,       // 80..9F, then one more
+    S_F0,       // 90..BF, then two more
+    S_NEED3,    // three 80..BF to go
+    S_F4,       // 80..8F, then two more
+    NUM_STATES
+};
+
+// Flags next to the new state in a transition
+#define STATE_MASK 0x0f
+#define BROKEN     0x10  // the sequence in progress is invalid, and this byte starts over
+#define BAD_BYTE   0x20  // this byte is invalid on its own
+#define COMPLETE   0x40  // this byte completes a multibyte sequence
+
+static const unsigned char utf8_class[256] = {
+#define R16(c) c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c
+    R16(C_ASCII), R16(C_ASCII), R16(C_ASCII), R16(C_ASCII),
+    R16(C_ASCII), R16(C_ASCII), R16(C_ASCII), R16(C_ASCII),
+    R16(C_CONT_LO), R16(C_CONT_MID), R16(C_CONT_HI), R16(C_CONT_HI),
+    C_BAD, C_BAD, C_LEAD2, C_LEAD2, C_LEAD2, C_LEAD2, C_LEAD2, C_LEAD2,
+    C_LEAD2, C_LEAD2, C_LEAD2, C_LEAD2, C_LEAD2, C_LEAD2, C_LEAD2, C_LEAD2,
+    R16(C_LEAD2),
+    C_E0, C_LEAD3, C_LEAD3, C_LEAD3, C_LEAD3, C_LEAD3, C_LEAD3, C_LEAD3,
+    C_LEAD3, C_LEAD3, C_LEAD3, C_LEAD3, C_LEAD3, C_ED, C_LEAD3, C_LEAD3,
+    C_F0, C_LEAD4, C_LEAD4, C_LEAD4, C_F4, C_BAD, C_BAD, C_BAD,
+    C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD
+#undef R16
+};
+
+/*
+ * Transitions by state and byte class. A byte that breaks a sequence is
+ * folded into the transition as if decoded again from S_ACCEPT, so the
+ * scan loop never has to step back.
+ */
+#define INVALID (S_ACCEPT | BAD_BYTE)
+#define DONE    (S_ACCEPT | COMPLETE)
+#define BROKEN_LEADS \
+    BROKEN | INVALID, BROKEN | S_NEED1, BROKEN | S_E0, BROKEN | S_NEED2, \
+    BROKEN | S_ED, BROKEN | S_F0, BROKEN | S_NEED3, BROKEN | S_F4
+static const unsigned char utf8_step[NUM_STATES][NUM_CLASSES] = {
+    //           ASCII                80..8F             90..9F             A0..BF             bad..F4
+    [S_ACCEPT] = {S_ACCEPT,           INVALID,           INVALID,           INVALID,
+                  INVALID, S_NEED1, S_E0, S_NEED2, S_ED, S_F0, S_NEED3, S_F4},
+    [S_NEED1]  = {BROKEN | S_ACCEPT,  DONE,              DONE,              DONE,              BROKEN_LEADS},
+    [S_NEED2]  = {BROKEN | S_ACCEPT,  S_NEED1,           S_NEED1,           S_NEED1,           BROKEN_LEADS},
+    [S_E0]     = {BROKEN | S_ACCEPT,  BROKEN | INVALID,  BROKEN | INVALID,  S_NEED1,           BROKEN_LEADS},
+    [S_ED]     = {BROKEN | S_ACCEPT,  S_NEED1,           S_NEED1,           BROKEN | INVALID,  BROKEN_LEADS},
+    [S_F0]     = {BROKEN | S_ACCEPT,  BROKEN | INVALID,  S_NEED2,           S_NEED2,           BROKEN_LEADS},
+    [S_NEED3]  = {BROKEN | S_ACCEPT,  S_NEED2,           S_NEED2,           S_NEED2,           BROKEN_LEADS},
+    [S_F4]     = {BROKEN | S_ACCEPT,  S_NEED2,           BROKEN | INVALID,  BROKEN | INVALID,  BROKEN_LEADS},
+};
+#undef BROKEN_LEADS
+#undef DONE
+#undef INVALID
+
+/**
+ * Resets a streaming UTF-8 decoder.
+ *
+ * @param state The decoder state.
+ */
+void pcc_utf8_init(pcc_utf8_state *state) {
+    state->state = S_ACCEPT;
+    state->length = 0;
+}
+
+/**
+ * Scans a buffer for well-formed multibyte UTF-8 sequences and invalid bytes.
+ * Runs of ASCII are skipped 32 and then 8 bytes at a time by testing the
+ * high bits of whole words, so ASCII-heavy text costs little more than a
+ * memory read. Everything else goes through a table-driven DFA without
+ * data-dependent branches, so binary input does not pay for mispredictions.
+ * A broken sequence counts all of its bytes so far as invalid, and the byte
+ * that broke it is treated as a possible new lead byte.
+ *
+ * @param state The decoder state, carried over from the previous buffer.
+ * @param data The buffer to scan.
+ * @param length Length of the buffer in bytes.
+ * @param multibyte Count of well-formed multibyte sequences, added to.
+ * @param invalid Count of invalid bytes, added to.
+ */
+void pcc_utf8_scan(pcc_utf8_state *state, const unsigned char *data, size_t length,
+                   uint64_t *multibyte, uint64_t *invalid) {
+    unsigned int cur = state->state, seq = state->length;
+    uint64_t found = 0, bad = 0;
+    size_t i = 0;
+
+    while (i < length) {
+        if (cur == S_ACCEPT) {
+            uint64_t words[4];
+            while (i + 32 <= length) {
+                memcpy(words, data + i, sizeof(words));
+                if ((words[0] | words[1] | words[2] | words[3]) & HIGH_BITS) {
+                    break;
+                }
+                i += 32;
+            }
+            while (i + 8 <= length) {
+                memcpy(words, data + i, sizeof(words[0]));
+                if (words[0] & HIGH_BITS) {
+                    break;
+                }
+                i += 8;
+            }
+        }
+
+        // Decode a short stretch before trying to skip ASCII again
+        size_t stop = length - i < DFA_STRETCH ? length : i + DFA_STRETCH;
+        for (; i < stop; i++) {
+            unsigned int step = utf8_step[cur][utf8_class[data[i]]];
+            unsigned int broken = (step >> 4) & 1;
+
+            found += step >> 6;
+            bad += broken * seq + ((step >> 5) & 1);
+            cur = step & STATE_MASK;
+            seq = (seq * (1 - broken) + 1) * (cur != S_ACCEPT);
+        }
+    }
+
+    state->state = cur;
+    state->length = seq;
+    *multibyte += found;
+    *invalid += bad;
+}
+
+/**
+ * Ends a stream: a sequence still in progress is truncated, so its bytes are invalid.
+ *
+ * @param state The decoder state.
+ * @param invalid Count of invalid bytes, added to.
+ */
+void pcc_utf8_finish(pcc_utf8_state *state, uint64_t *invalid) {
+    if (state->state != S_ACCEPT) {
+        *invalid += state->length;
+    }
+    pcc_utf8_init(state);
+}
+
+/**
+ * Builds the UTF-8 class counts of a PCC_MODE_UTF8 reply. The ASCII classes
+ * come straight from the byte histogram.
+ *
+ * @param histogram Per-byte-value counts of the stream.
+ * @param multibyte Well-formed multibyte sequences found by pcc_utf8_scan.
+ * @param invalid Invalid bytes found by pcc_utf8_scan and pcc_utf8_finish.
+ * @param classes Output: counts indexed by PCC_UTF8_* class.
+ */
+void pcc_utf8_classes(const uint64_t histogram[256], uint64_t multibyte, uint64_t invalid,
+                      uint64_t classes[4]) {
+    classes[PCC_UTF8_PRINTABLE] = pcc_printable_count(histogram);
+    classes[PCC_UTF8_CONTROL] = histogram[127];
+    for (int b = 0; b < 32; b++) {
+        classes[PCC_UTF8_CONTROL] += histogram[b];
+    }
+    classes[PCC_UTF8_MULTIBYTE] = multibyte;
+    classes[PCC_UTF8_INVALID] = invalid;
+}
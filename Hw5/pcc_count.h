@@ -0,0 +1,33 @@
+#ifndef PCC_COUNT_H
+#define PCC_COUNT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Streaming UTF-8 decoder state, carried across buffers so that a
+ * sequence split between two reads is still recognized.
+ *
+ * @param state DFA state; 0 between sequences.
+ * @param length Bytes of the current sequence seen so far.
+ */
+typedef struct {
+    unsigned int state;
+    unsigned int length;
+} pcc_utf8_state;
+
+// Four interleaved 32-bit sub-histograms, see pcc_count_partial
+typedef uint32_t pcc_partial_histogram[4][256];
+
+void     pcc_count_bytes(const unsigned char *data, size_t length, uint64_t histogram[256]);
+void     pcc_count_partial(const unsigned char *data, size_t length, pcc_partial_histogram partial);
+void     pcc_flush_partial(const pcc_partial_histogram partial, uint64_t histogram[256]);
+uint64_t pcc_printable_count(const uint64_t histogram[256]);
+void     pcc_utf8_init(pcc_utf8_state *state);
+void     pcc_utf8_scan(pcc_utf8_state *state, const unsigned char *data, size_t length,
+                       uint64_t *multibyte, uint64_t *invalid);
+void     pcc_utf8_finish(pcc_utf8_state *state, uint64_t *invalid);
+void     pcc_utf8_classes(const uint64_t histogram[256], uint64_t multibyte, uint64_t invalid,
+                          uint64_t classes[4]);
+
+#endif
@@ -0,0 +1,557 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <endian.h>
+#include "pcc_proto.h"
+
+#define BUFFER_SIZE 1048576          // 1MB send chunk
+#define POOL_SIZE (64 * BUFFER_SIZE)  // synthetic payload pool shared by all connections
+#define MAX_FILE_SIZE 0xFFFFFFFEULL   // largest size the 4-byte header can carry
+#define PREFIX_STRIDE 4096            // pool bytes per printable prefix sum
+#define FAILED_LATENCY UINT64_MAX     // latency slot of a request that failed
+
+// ========== Types ==========
+
+/**
+ * Shape of the payload size distribution.
+ */
+typedef enum {
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_EXP
+} size_dist;
+
+/**
+ * Load generator configuration.
+ *
+ * @param server_addr Address of the pcc_server under test.
+ * @param connections Number of concurrent connections (one thread each).
+ * @param requests Total number of requests across all connections.
+ * @param dist Payload size distribution.
+ * @param size_a Fixed size, uniform minimum, or exponential mean.
+ * @param size_b Uniform maximum (unused otherwise).
+ * @param printable_ratio Fraction of payload bytes that are printable.
+ * @param mode Counting mode to request; anything but PCC_MODE_PRINTABLE uses the extended header.
+ */
+typedef struct {
+    struct sockaddr_in server_addr;
+    int connections;
+    uint64_t requests;
+    size_dist dist;
+    uint64_t size_a;
+    uint64_t size_b;
+    double printable_ratio;
+    int mode;
+} load_config;
+
+/**
+ * Per-connection worker state and results.
+ *
+ * @param id Worker index, used to seed its random generator.
+ * @param completed Number of requests completed successfully.
+ * @param errors Number of requests that failed at the socket level.
+ * @param mismatches Number of replies that disagreed with the expected count.
+ * @param bytes Payload bytes sent by completed requests.
+ */
+typedef struct {
+    int id;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t mismatches;
+    uint64_t bytes;
+} load_worker;
+
+// ========== Function Declarations ==========
+
+void parse_arguments(int argc, char *argv[], load_config *config);
+uint64_t parse_size(const char *str);
+void parse_distribution(const char *str, load_config *config);
+void build_payload_pool(double printable_ratio);
+uint64_t expected_printable(uint64_t offset, uint64_t size);
+uint64_t printable_before(uint64_t offset);
+uint64_t next_random(uint64_t *state);
+uint64_t pick_size(uint64_t *rng);
+int run_request(uint64_t size, uint64_t offset, uint64_t *latency_ns, int *mismatch);
+int worker_main(void *arg);
+int compare_u64(const void *a, const void *b);
+void report(load_worker *workers, double elapsed);
+uint64_t now_ns(void);
+
+// ========== Global Variables ==========
+
+load_config config;
+char *payload_pool;
+uint64_t *latencies_ns;      // latencies_ns[i] = latency of request i, or FAILED_LATENCY
+uint32_t *printable_prefix;  // printable_prefix[i] = printable bytes in payload_pool[0, i * PREFIX_STRIDE)
+atomic_uint_fast64_t next_request = 0;
+
+// ========== Function Definitions ==========
+
+int main(int argc, char *argv[]) {
+    parse_arguments(argc, argv, &config);
+    build_payload_pool(config.printable_ratio);
+
+    load_worker *workers = calloc(config.connections, sizeof(load_worker));
+    thrd_t *threads = calloc(config.connections, sizeof(thrd_t));
+    if (workers == NULL || threads == NULL) {
+        perror("Error allocating workers");
+        exit(1);
+    }
+    // One slot per request, filled by whichever worker claims it
+    latencies_ns = malloc(config.requests * sizeof(uint64_t));
+    if (latencies_ns == NULL) {
+        perror("Error allocating latency buffer");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < config.connections; i++) {
+        workers[i].id = i;
+        if (thrd_create(&threads[i], worker_main, &workers[i]) != thrd_success) {
+            fprintf(stderr, "Error creating worker thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < config.connections; i++) {
+        thrd_join(threads[i], NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    report(workers, elapsed);
+
+    int failed = 0;
+    for (int i = 0; i < config.connections; i++) {
+        failed |= workers[i].errors != 0 || workers[i].mismatches != 0;
+    }
+    free(latencies_ns);
+    free(workers);
+    free(threads);
+    free(payload_pool);
+    free(printable_prefix);
+    return failed ? 1 : 0;
+}
+
+/**
+ * Parses and validates the command-line arguments.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of argument strings.
+ * @param config Output parameter filled with the parsed configuration.
+ */
+void parse_arguments(int argc, char *argv[], load_config *config) {
+    int opt;
+
+    config->connections = 16;
+    config->requests = 1000;
+    config->dist = DIST_UNIFORM;
+    config->size_a = 1024;
+    config->size_b = BUFFER_SIZE;
+    config->printable_ratio = 0.9;
+    config->mode = PCC_MODE_PRINTABLE;
+
+    while ((opt = getopt(argc, argv, "c:n:s:p:m:")) != -1) {
+        switch (opt) {
+        case 'c':
+            config->connections = atoi(optarg);
+            break;
+        case 'n':
+            config->requests = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            parse_distribution(optarg, config);
+            break;
+        case 'p':
+            config->printable_ratio = atof(optarg);
+            break;
+        case 'm':
+            config->mode = strcmp(optarg, "bytes") == 0 ? PCC_MODE_BYTES :
+                           strcmp(optarg, "utf8") == 0 ? PCC_MODE_UTF8 :
+                           strcmp(optarg, "printable") == 0 ? PCC_MODE_PRINTABLE : -1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (argc - optind != 2 || config->connections <= 0 || config->requests == 0 || config->mode < 0 ||
+        config->printable_ratio < 0 || config->printable_ratio > 1) {
+        goto usage;
+    }
+
+    memset(&config->server_addr, 0, sizeof(config->server_addr));
+    config->server_addr.sin_family = AF_INET;
+    config->server_addr.sin_port = htons((uint16_t)atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &config->server_addr.sin_addr) != 1) {
+        perror("Invalid server IP address");
+        exit(1);
+    }
+    return;
+
+usage:
+    fprintf(stderr,
+            "Usage: %s [-c connections] [-n requests] [-s size_dist] [-p printable_ratio] [-m mode] <server_ip> <server_port>\n"
+            "  size_dist: fixed:N | uniform:MIN:MAX | exp:MEAN (sizes accept K/M/G suffixes)\n"
+            "  mode: printable | bytes | utf8\n",
+            argv[0]);
+    exit(1);
+}
+
+/**
+ * Parses a byte count with an optional K/M/G (binary) suffix.
+ *
+ * @param str The string to parse.
+ * @return The size in bytes.
+ */
+uint64_t parse_size(const char *str) {
+    char *end;
+    uint64_t size = strtoull(str, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g': size <<= 10; // fall through
+    case 'M': case 'm': size <<= 10; // fall through
+    case 'K': case 'k': size <<= 10; break;
+    default: break;
+    }
+    if (size > MAX_FILE_SIZE) {
+        fprintf(stderr, "Size %s exceeds the protocol limit\n", str);
+        exit(1);
+    }
+    return size;
+}
+
+/**
+ * Parses a size distribution specification (fixed:N, uniform:MIN:MAX or exp:MEAN).
+ *
+ * @param str The specification string.
+ * @param config Configuration to store the distribution in.
+ */
+void parse_distribution(const char *str, load_config *config) {
+    const char *arg = strchr(str, ':');
+    if (arg == NULL) {
+        fprintf(stderr, "Invalid size distribution: %s\n", str);
+        exit(1);
+    }
+    arg++;
+
+    if (strncmp(str, "fixed:", 6) == 0) {
+        config->dist = DIST_FIXED;
+        config->size_a = parse_size(arg);
+    } else if (strncmp(str, "uniform:", 8) == 0) {
+        const char *max = strchr(arg, ':');
+        if (max == NULL) {
+            fprintf(stderr, "Invalid size distribution: %s\n", str);
+            exit(1);
+        }
+        config->dist = DIST_UNIFORM;
+        config->size_a = parse_size(arg);
+        config->size_b = parse_size(max + 1);
+        if (config->size_b < config->size_a) {
+            fprintf(stderr, "Invalid size distribution: %s\n", str);
+            exit(1);
+        }
+    } else if (strncmp(str, "exp:", 4) == 0) {
+        config->dist = DIST_EXP;
+        config->size_a = parse_size(arg);
+    } else {
+        fprintf(stderr, "Invalid size distribution: %s\n", str);
+        exit(1);
+    }
+}
+
+/**
+ * Fills the shared payload pool with random bytes, of which roughly
+ * printable_ratio are printable, and precomputes printable prefix sums
+ * at every PREFIX_STRIDE bytes, so the expected reply for any slice costs
+ * at most two partial pages of scanning.
+ *
+ * @param printable_ratio Fraction of bytes drawn from ASCII 32-126.
+ */
+void build_payload_pool(double printable_ratio) {
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    uint64_t threshold = (uint64_t)(printable_ratio * (double)UINT32_MAX);
+
+    payload_pool = malloc(POOL_SIZE);
+    printable_prefix = malloc((POOL_SIZE / PREFIX_STRIDE + 1) * sizeof(uint32_t));
+    if (payload_pool == NULL || printable_prefix == NULL) {
+        perror("Error allocating payload pool");
+        exit(1);
+    }
+
+    printable_prefix[0] = 0;
+    uint32_t printable = 0;
+    for (uint64_t i = 0; i < POOL_SIZE; i++) {
+        uint64_t r = next_random(&rng);
+        unsigned char c;
+        if ((r & UINT32_MAX) < threshold) {
+            c = 32 + (r >> 32) % 95;
+        } else {
+            // Non-printable: control characters, DEL, or high bytes
+            c = (r >> 32) % 161;
+            c = c < 32 ? c : c + 95;
+        }
+        payload_pool[i] = (char)c;
+        printable += c >= 32 && c <= 126;
+        if ((i + 1) % PREFIX_STRIDE == 0) {
+            printable_prefix[(i + 1) / PREFIX_STRIDE] = printable;
+        }
+    }
+}
+
+/**
+ * @param offset Offset in the pool, at most POOL_SIZE.
+ * @return Number of printable bytes in payload_pool[0, offset).
+ */
+uint64_t printable_before(uint64_t offset) {
+    uint64_t count = printable_prefix[offset / PREFIX_STRIDE];
+
+    for (uint64_t i = offset - offset % PREFIX_STRIDE; i < offset; i++) {
+        unsigned char c = (unsigned char)payload_pool[i];
+        count += c >= 32 && c <= 126;
+    }
+    return count;
+}
+
+/**
+ * Computes the printable count of a payload that starts at offset in the
+ * pool and wraps around it as many times as needed.
+ *
+ * @param offset Starting offset in the pool.
+ * @param size Payload size in bytes.
+ * @return Number of printable characters the server should report.
+ */
+uint64_t expected_printable(uint64_t offset, uint64_t size) {
+    uint64_t count = 0;
+
+    while (size > 0) {
+        uint64_t chunk = POOL_SIZE - offset < size ? POOL_SIZE - offset : size;
+        count += printable_before(offset + chunk) - printable_before(offset);
+        size -= chunk;
+        offset = 0;
+    }
+    return count;
+}
+
+/**
+ * xorshift64* pseudo random generator.
+ *
+ * @param state Generator state, updated in place.
+ * @return The next pseudo random value.
+ */
+uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Draws a payload size from the configured distribution.
+ *
+ * @param rng Random generator state.
+ * @return The payload size in bytes.
+ */
+uint64_t pick_size(uint64_t *rng) {
+    uint64_t size;
+    double u;
+
+    switch (config.dist) {
+    case DIST_FIXED:
+        return config.size_a;
+    case DIST_UNIFORM:
+        return config.size_a + next_random(rng) % (config.size_b - config.size_a + 1);
+    case DIST_EXP:
+    default:
+        u = ((next_random(rng) >> 11) + 1) * (1.0 / 9007199254740993.0);
+        size = (uint64_t)(-(double)config.size_a * log(u));
+        return size > MAX_FILE_SIZE ? MAX_FILE_SIZE : size;
+    }
+}
+
+/**
+ * Runs one request: connects, sends a payload slice from the pool and
+ * waits for the printable count.
+ *
+ * @param size Payload size in bytes.
+ * @param offset Starting offset of the payload in the pool.
+ * @param latency_ns Output: time from connect to reply.
+ * @param mismatch Output: set to 1 if the reply differs from the expected count.
+ * @return 0 on success, -1 on socket error.
+ */
+int run_request(uint64_t size, uint64_t offset, uint64_t *latency_ns, int *mismatch) {
+    uint64_t start = now_ns();
+    uint64_t expected = expected_printable(offset, size);
+    unsigned char header[sizeof(uint32_t) + PCC_EXTENDED_HEADER_SIZE];
+    unsigned char reply[PCC_MAX_REPLY_SIZE];
+    size_t header_length, reply_length;
+    uint32_t net_value;
+    uint64_t net_size;
+    ssize_t cur;
+    size_t done;
+
+    if (config.mode == PCC_MODE_PRINTABLE) {
+        net_value = htonl((uint32_t)size);
+        memcpy(header, &net_value, sizeof(net_value));
+        header_length = sizeof(net_value);
+        reply_length = sizeof(net_value);
+    } else {
+        net_value = htonl(PCC_EXTENDED_MAGIC);
+        memcpy(header, &net_value, sizeof(net_value));
+        net_value = htonl((uint32_t)config.mode);
+        memcpy(header + 4, &net_value, sizeof(net_value));
+        net_size = htobe64(size);
+        memcpy(header + 8, &net_size, sizeof(net_size));
+        header_length = sizeof(header);
+        reply_length = PCC_REPLY_SIZE(config.mode);
+    }
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+    if (connect(sockfd, (struct sockaddr *)&config.server_addr, sizeof(config.server_addr)) < 0) {
+        perror("Error connecting to server");
+        close(sockfd);
+        return -1;
+    }
+
+    if (write(sockfd, header, header_length) != (ssize_t)header_length) {
+        perror("Error sending file size to server");
+        close(sockfd);
+        return -1;
+    }
+
+    while (size > 0) {
+        size_t chunk = POOL_SIZE - offset;
+        chunk = chunk < BUFFER_SIZE ? chunk : BUFFER_SIZE;
+        chunk = chunk < size ? chunk : size;
+        cur = write(sockfd, payload_pool + offset, chunk);
+        if (cur <= 0) {
+            perror("Error sending file contents to server");
+            close(sockfd);
+            return -1;
+        }
+        size -= cur;
+        offset = (offset + cur) % POOL_SIZE;
+    }
+
+    for (done = 0; done < reply_length; done += cur) {
+        cur = read(sockfd, reply + done, reply_length - done);
+        if (cur <= 0) {
+            perror("Error receiving number of printable characters from server");
+            close(sockfd);
+            return -1;
+        }
+    }
+    close(sockfd);
+
+    *latency_ns = now_ns() - start;
+    if (config.mode == PCC_MODE_PRINTABLE) {
+        memcpy(&net_value, reply, sizeof(net_value));
+        *mismatch = ntohl(net_value) != expected;
+    } else {
+        memcpy(&net_size, reply, sizeof(net_size));
+        *mismatch = be64toh(net_size) != expected;
+    }
+    return 0;
+}
+
+/**
+ * Worker thread: claims requests from the shared counter until the
+ * configured total has been issued, and records each one's latency in
+ * the slot of the index it claimed.
+ *
+ * @param arg Pointer to this worker's load_worker.
+ * @return 0 always.
+ */
+int worker_main(void *arg) {
+    load_worker *worker = arg;
+    uint64_t rng = 0x2545f4914f6cdd1dULL * (worker->id + 1);
+    uint64_t request;
+
+    while ((request = atomic_fetch_add(&next_request, 1)) < config.requests) {
+        uint64_t size = pick_size(&rng);
+        uint64_t offset = next_random(&rng) % POOL_SIZE;
+        uint64_t latency;
+        int mismatch;
+
+        if (run_request(size, offset, &latency, &mismatch) != 0) {
+            worker->errors++;
+            latencies_ns[request] = FAILED_LATENCY;
+            continue;
+        }
+        latencies_ns[request] = latency;
+        worker->completed++;
+        worker->mismatches += mismatch;
+        worker->bytes += size;
+    }
+    return 0;
+}
+
+/**
+ * qsort comparator for uint64_t values.
+ */
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Merges worker results and prints throughput and latency percentiles.
+ *
+ * @param workers Array of finished workers.
+ * @param elapsed Wall-clock duration of the run in seconds.
+ */
+void report(load_worker *workers, double elapsed) {
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    uint64_t completed = 0, errors = 0, mismatches = 0, bytes = 0;
+
+    for (int i = 0; i < config.connections; i++) {
+        completed += workers[i].completed;
+        errors += workers[i].errors;
+        mismatches += workers[i].mismatches;
+        bytes += workers[i].bytes;
+    }
+
+    // Drop the failed requests' slots, then sort in place
+    for (uint64_t i = 0, n = 0; i < config.requests; i++) {
+        if (latencies_ns[i] != FAILED_LATENCY) {
+            latencies_ns[n++] = latencies_ns[i];
+        }
+    }
+    qsort(latencies_ns, completed, sizeof(uint64_t), compare_u64);
+
+    printf("requests:   %llu completed, %llu errors, %llu mismatches\n",
+           (unsigned long long)completed, (unsigned long long)errors, (unsigned long long)mismatches);
+    printf("elapsed:    %.3f s\n", elapsed);
+    printf("throughput: %.1f req/s, %.3f GB/s\n", completed / elapsed, bytes / elapsed / 1e9);
+    if (completed > 0) {
+        printf("latency:   ");
+        for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+            uint64_t idx = (uint64_t)(percentiles[i] / 100.0 * (completed - 1));
+            printf(" p%g=%.3fms", percentiles[i], latencies_ns[idx] / 1e6);
+        }
+        printf(" max=%.3fms\n", latencies_ns[completed - 1] / 1e6);
+    }
+}
+
+/**
+ * @return The current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pcc_count.h"
+#include "pcc_local.h"
+#include "pcc_proto.h"
+
+// Bytes a thread histograms and then UTF-8 scans while they are still in cache
+#define LOCAL_CHUNK (256UL << 10)
+
+// Ranges are cut at multiples of this, so threads never share a cache line
+#define RANGE_ALIGNMENT 64
+
+// Longest run of UTF-8 continuation bytes that can belong to one sequence
+#define MAX_CONTINUATION 3
+
+/**
+ * One thread's share of the file.
+ *
+ * @param data Start of the range.
+ * @param length Length of the range in bytes.
+ * @param mode Counting mode (PCC_MODE_*).
+ * @param thread The thread counting the range.
+ * @param started Whether thread was started (otherwise the caller counted the range).
+ * @param result This thread's counts, merged by the caller.
+ */
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    int mode;
+    thrd_t thread;
+    int started;
+    pcc_local_result result;
+} count_range;
+
+/**
+ * Moves a range boundary forward past UTF-8 continuation bytes, so that no
+ * sequence is split between two threads. After three continuation bytes the
+ * decoder is between sequences whatever came before, so a boundary there is
+ * safe as well.
+ *
+ * @param data The whole mapping.
+ * @param length Length of the mapping.
+ * @param offset The proposed boundary.
+ * @return The adjusted boundary.
+ */
+static size_t utf8_boundary(const unsigned char *data, size_t length, size_t offset) {
+    for (int i = 0; i < MAX_CONTINUATION && offset < length && (data[offset] & 0xC0) == 0x80; i++) {
+        offset++;
+    }
+    return offset;
+}
+
+/**
+ * Counting thread: histograms its range (and decodes it as UTF-8 in
+ * PCC_MODE_UTF8) a cache-sized chunk at a time.
+ *
+ * @param arg The thread's count_range.
+ * @return 0.
+ */
+static int count_range_main(void *arg) {
+    count_range *range = arg;
+    pcc_utf8_state utf8;
+    size_t offset = 0;
+
+    uintptr_t page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t first_page = (uintptr_t)range->data & ~page_mask;
+
+    pcc_utf8_init(&utf8);
+    madvise((void *)first_page, range->length + ((uintptr_t)range->data - first_page), MADV_WILLNEED);
+    while (offset < range->length) {
+        size_t chunk = range->length - offset < LOCAL_CHUNK ? range->length - offset : LOCAL_CHUNK;
+        pcc_count_bytes(range->data + offset, chunk, range->result.histogram);
+        if (range->mode == PCC_MODE_UTF8) {
+            pcc_utf8_scan(&utf8, range->data + offset, chunk, &range->result.multibyte, &range->result.invalid);
+        }
+        offset += chunk;
+    }
+    pcc_utf8_finish(&utf8, &range->result.invalid);
+    return 0;
+}
+
+/**
+ * Counts a local file without a server: maps it, splits it into one range
+ * per thread and merges the per-thread counts. The counting is the same as
+ * pcc_server's, so the results match what an upload would report.
+ *
+ * @param path Path of the file.
+ * @param mode Counting mode (PCC_MODE_*).
+ * @param threads Number of counting threads, 0 for one per online CPU.
+ * @param result Output: the merged counts.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int pcc_count_file(const char *path, int mode, int threads, pcc_local_result *result) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->size = st.st_size;
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    const unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    size_t per_thread = ((size_t)st.st_size / threads + RANGE_ALIGNMENT - 1) & ~(size_t)(RANGE_ALIGNMENT - 1);
+    if (per_thread < LOCAL_CHUNK) {
+        per_thread = LOCAL_CHUNK;
+    }
+    if ((size_t)threads > ((size_t)st.st_size + per_thread - 1) / per_thread) {
+        threads = ((size_t)st.st_size + per_thread - 1) / per_thread;
+    }
+
+    count_range *ranges = calloc(threads, sizeof(count_range));
+    if (ranges == NULL) {
+        munmap((void *)data, st.st_size);
+        return -1;
+    }
+
+    size_t start = 0;
+    for (int i = 0; i < threads; i++) {
+        size_t end = i == threads - 1 ? (size_t)st.st_size : start + per_thread;
+        end = end > (size_t)st.st_size ? (size_t)st.st_size : end;
+        if (mode == PCC_MODE_UTF8) {
+            end = utf8_boundary(data, st.st_size, end);
+        }
+        ranges[i].data = data + start;
+        ranges[i].length = end - start;
+        ranges[i].mode = mode;
+        start = end;
+    }
+
+    // The calling thread counts the first range itself, and any range it could not start a thread for
+    for (int i = 1; i < threads; i++) {
+        ranges[i].started = thrd_create(&ranges[i].thread, count_range_main, &ranges[i]) == thrd_success;
+        if (!ranges[i].started) {
+            count_range_main(&ranges[i]);
+        }
+    }
+    count_range_main(&ranges[0]);
+
+    for (int i = 0; i < threads; i++) {
+        if (ranges[i].started) {
+            thrd_join(ranges[i].thread, NULL);
+        }
+        for (int b = 0; b < 256; b++) {
+            result->histogram[b] += ranges[i].result.histogram[b];
+        }
+        result->multibyte += ranges[i].result.multibyte;
+        result->invalid += ranges[i].result.invalid;
+    }
+
+    free(ranges);
+    munmap((void *)data, st.st_size);
+    return 0;
+}
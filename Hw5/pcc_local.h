@@ -0,0 +1,23 @@
+#ifndef PCC_LOCAL_H
+#define PCC_LOCAL_H
+
+#include <stdint.h>
+
+/**
+ * Counts of a local file, merged over all counting threads.
+ *
+ * @param histogram Per-byte-value counts.
+ * @param multibyte Well-formed multibyte UTF-8 sequences (PCC_MODE_UTF8 only).
+ * @param invalid Invalid UTF-8 bytes (PCC_MODE_UTF8 only).
+ * @param size Size of the file in bytes.
+ */
+typedef struct {
+    uint64_t histogram[256];
+    uint64_t multibyte;
+    uint64_t invalid;
+    uint64_t size;
+} pcc_local_result;
+
+int pcc_count_file(const char *path, int mode, int threads, pcc_local_result *result);
+
+#endif
@@ -0,0 +1,294 @@
+#include <string.h>
+#include "pcc_count.h"
+#include "pcc_lz.h"
+
+/*
+ * LZ4-style block format: a sequence of
+ *   token        high nibble literal length, low nibble match length - 4
+ *                (15 in either nibble means extension bytes follow:
+ *                 each adds its value, and a byte below 255 ends them)
+ *   literals
+ *   offset       2 bytes little-endian, distance back into the output
+ *   match length extension
+ * The last sequence carries only literals.
+ */
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5   // a block always ends with at least this many literals
+#define MATCH_LIMIT 12    // no match may start within this many bytes of the end
+#define HASH_LOG 14
+#define SKIP_SHIFT 6      // step faster through input that keeps failing to match
+#define RUN_MASK 15
+
+// Output is counted in strides of about this many bytes, while still in L1
+#define COUNT_STRIDE 4096
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash32(uint32_t value) {
+    return (value * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/**
+ * Measures how far two byte strings agree, a word at a time.
+ *
+ * @param a The earlier string.
+ * @param b The later string.
+ * @param limit Most bytes to compare.
+ * @return Length of the common prefix.
+ */
+static size_t common_length(const unsigned char *a, const unsigned char *b, size_t limit) {
+    size_t length = 0;
+
+    while (length + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + length, sizeof(x));
+        memcpy(&y, b + length, sizeof(y));
+        if (x != y) {
+            return length + (__builtin_ctzll(x ^ y) >> 3);  // little-endian: lowest set bit is the first difference
+        }
+        length += 8;
+    }
+    while (length < limit && a[length] == b[length]) {
+        length++;
+    }
+    return length;
+}
+
+/**
+ * Writes a length that overflowed its token nibble as extension bytes.
+ *
+ * @param dst Where to write.
+ * @param length The length minus RUN_MASK.
+ * @return Position after the extension bytes.
+ */
+static unsigned char *write_length(unsigned char *dst, size_t length) {
+    while (length >= 255) {
+        *dst++ = 255;
+        length -= 255;
+    }
+    *dst++ = (unsigned char)length;
+    return dst;
+}
+
+/**
+ * Writes one sequence: literals, then (unless this is the last sequence)
+ * a match.
+ *
+ * @param dst Where to write.
+ * @param literals Start of the literals.
+ * @param num_literals Number of literals.
+ * @param offset Match distance, or 0 for the last sequence.
+ * @param match_length Match length (at least MIN_MATCH when offset is set).
+ * @return Position after the sequence.
+ */
+static unsigned char *write_sequence(unsigned char *dst, const unsigned char *literals, size_t num_literals,
+                                     size_t offset, size_t match_length) {
+    unsigned char *token = dst++;
+    size_t match_code = offset != 0 ? match_length - MIN_MATCH : 0;
+
+    *token = (unsigned char)(((num_literals < RUN_MASK ? num_literals : RUN_MASK) << 4) |
+                             (match_code < RUN_MASK ? match_code : RUN_MASK));
+    if (num_literals >= RUN_MASK) {
+        dst = write_length(dst, num_literals - RUN_MASK);
+    }
+    memcpy(dst, literals, num_literals);
+    dst += num_literals;
+
+    if (offset != 0) {
+        *dst++ = (unsigned char)(offset & 0xff);
+        *dst++ = (unsigned char)(offset >> 8);
+        if (match_code >= RUN_MASK) {
+            dst = write_length(dst, match_code - RUN_MASK);
+        }
+    }
+    return dst;
+}
+
+/**
+ * Compresses one block with greedy hash-chain-free matching: every
+ * position hashes its next four bytes into a table of last positions and
+ * takes the match if the bytes agree. Cheap enough to keep ahead of a
+ * fast network on one core.
+ *
+ * @param src The block.
+ * @param length Length of the block, at most PCC_LZ_BLOCK_SIZE.
+ * @param dst Output, at least PCC_LZ_BOUND(length) bytes.
+ * @return Compressed length.
+ */
+size_t pcc_lz_compress(const unsigned char *src, size_t length, unsigned char *dst) {
+    uint16_t table[1 << HASH_LOG];
+    unsigned char *out = dst;
+    size_t pos = 0, anchor = 0;
+
+    memset(table, 0, sizeof(table));
+    if (length > MATCH_LIMIT) {
+        size_t match_end = length - LAST_LITERALS;
+        while (pos < length - MATCH_LIMIT) {
+            uint32_t sequence = read32(src + pos);
+            uint32_t h = hash32(sequence);
+            size_t candidate = table[h];
+            table[h] = (uint16_t)pos;
+
+            if (candidate >= pos || read32(src + candidate) != sequence) {
+                pos += 1 + ((pos - anchor) >> SKIP_SHIFT);
+                continue;
+            }
+
+            size_t match_length = MIN_MATCH + common_length(src + candidate + MIN_MATCH, src + pos + MIN_MATCH,
+                                                            match_end - pos - MIN_MATCH);
+            out = write_sequence(out, src + anchor, pos - anchor, pos - candidate, match_length);
+            pos += match_length;
+            anchor = pos;
+        }
+    }
+    out = write_sequence(out, src + anchor, length - anchor, 0, 0);
+    return out - dst;
+}
+
+/**
+ * Copies a match from earlier in the output. When the match overlaps its
+ * own source it repeats the last offset bytes; eight-byte steps are still
+ * exact as long as each step reads only bytes already written.
+ *
+ * @param dst Where the match goes.
+ * @param offset Distance back to the source.
+ * @param length Length of the match.
+ */
+static void copy_match(unsigned char *dst, size_t offset, size_t length) {
+    const unsigned char *src = dst - offset;
+    size_t i = 0;
+
+    if (offset >= length) {
+        memcpy(dst, src, length);
+        return;
+    }
+    if (offset == 1) {
+        memset(dst, *src, length);
+        return;
+    }
+    if (offset >= 8) {
+        for (; i + 8 <= length; i += 8) {
+            memcpy(dst + i, src + i, 8);
+        }
+    }
+    for (; i < length; i++) {
+        dst[i] = src[i];
+    }
+}
+
+/**
+ * Reads a length extension.
+ *
+ * @param src The compressed block.
+ * @param src_length Length of the compressed block.
+ * @param pos Read position, advanced past the extension.
+ * @param length The length so far, added to.
+ * @param limit Largest acceptable length.
+ * @return 0, or -1 if the input ends early or the length passes limit.
+ */
+static int read_length(const unsigned char *src, size_t src_length, size_t *pos, size_t *length, size_t limit) {
+    unsigned char byte;
+    do {
+        if (*pos >= src_length) {
+            return -1;
+        }
+        byte = src[(*pos)++];
+        *length += byte;
+        if (*length > limit) {
+            return -1;
+        }
+    } while (byte == 255);
+    return 0;
+}
+
+/**
+ * The decoding loop of pcc_lz_decompress_count.
+ *
+ * @param src The compressed block.
+ * @param src_length Length of the compressed block.
+ * @param dst Output buffer.
+ * @param dst_length Size of the output buffer.
+ * @param partial Sub-histograms, added to.
+ * @return Decompressed length, or -1 if the block is malformed.
+ */
+static long decode_block(const unsigned char *src, size_t src_length,
+                         unsigned char *dst, size_t dst_length, pcc_partial_histogram partial) {
+    size_t in = 0, out = 0, counted = 0;
+
+    for (;;) {
+        if (in >= src_length) {
+            return -1;
+        }
+        unsigned char token = src[in++];
+
+        size_t num_literals = token >> 4;
+        if (num_literals == RUN_MASK && read_length(src, src_length, &in, &num_literals, dst_length) < 0) {
+            return -1;
+        }
+        if (num_literals > src_length - in || num_literals > dst_length - out) {
+            return -1;
+        }
+        memcpy(dst + out, src + in, num_literals);
+        in += num_literals;
+        out += num_literals;
+        if (in == src_length) {
+            pcc_count_partial(dst + counted, out - counted, partial);
+            return (long)out;
+        }
+
+        if (src_length - in < 2) {
+            return -1;
+        }
+        size_t offset = src[in] | ((size_t)src[in + 1] << 8);
+        in += 2;
+        if (offset == 0 || offset > out) {
+            return -1;
+        }
+
+        size_t match_length = token & RUN_MASK;
+        if (match_length == RUN_MASK && read_length(src, src_length, &in, &match_length, dst_length) < 0) {
+            return -1;
+        }
+        match_length += MIN_MATCH;
+        if (match_length > dst_length - out) {
+            return -1;
+        }
+
+        copy_match(dst + out, offset, match_length);
+        out += match_length;
+        if (out - counted >= COUNT_STRIDE) {
+            pcc_count_partial(dst + counted, out - counted, partial);
+            counted = out;
+        }
+    }
+}
+
+/**
+ * Decompresses one block and counts its bytes in the same pass: every
+ * literal run and every match is counted into block-local sub-histograms
+ * right after it is written, while it is still in L1, and the
+ * sub-histograms are flushed once per block. The input comes from the
+ * network, so every length and offset is checked.
+ *
+ * @param src The compressed block.
+ * @param src_length Length of the compressed block.
+ * @param dst Output buffer.
+ * @param dst_length Size of the output buffer.
+ * @param histogram Per-byte-value counts, added to.
+ * @return Decompressed length, or -1 if the block is malformed.
+ */
+long pcc_lz_decompress_count(const unsigned char *src, size_t src_length,
+                             unsigned char *dst, size_t dst_length, uint64_t histogram[256]) {
+    pcc_partial_histogram partial;
+
+    memset(partial, 0, sizeof(partial));
+    long result = decode_block(src, src_length, dst, dst_length, partial);
+    // A malformed block may have been partly counted; the caller drops the connection anyway
+    pcc_flush_partial(partial, histogram);
+    return result;
+}
@@ -0,0 +1,17 @@
+#ifndef PCC_LZ_H
+#define PCC_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Uncompressed bytes per block; offsets and the hash table rely on blocks of at most 64 KiB
+#define PCC_LZ_BLOCK_SIZE 65536
+
+// Worst-case compressed size of a block of n bytes
+#define PCC_LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+size_t pcc_lz_compress(const unsigned char *src, size_t length, unsigned char *dst);
+long   pcc_lz_decompress_count(const unsigned char *src, size_t src_length,
+                               unsigned char *dst, size_t dst_length, uint64_t histogram[256]);
+
+#endif
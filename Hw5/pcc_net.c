@@ -0,0 +1,51 @@
+#define _GNU_SOURCE
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "pcc_net.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define US_PER_SEC 1000000ULL
+
+/**
+ * Sizes a socket buffer from the connection's observed bandwidth and
+ * round-trip time. The target is twice the bandwidth-delay product, so a
+ * full window stays in flight while the peer drains the previous one.
+ * The buffer is only ever raised: setting it turns off the kernel's own
+ * autotuning, which is better left alone when it already has enough.
+ *
+ * @param fd A connected TCP socket.
+ * @param optname SO_SNDBUF for the sending side, SO_RCVBUF for the receiving side.
+ * @param bytes Bytes transferred so far.
+ * @param elapsed_ns Time taken to transfer them.
+ * @return The buffer size in effect afterwards, or -1 if it could not be read.
+ */
+int pcc_autosize_buffer(int fd, int optname, uint64_t bytes, uint64_t elapsed_ns) {
+    struct tcp_info info;
+    socklen_t info_length = sizeof(info);
+    int current;
+    socklen_t current_length = sizeof(current);
+
+    if (getsockopt(fd, SOL_SOCKET, optname, &current, &current_length) < 0) {
+        return -1;
+    }
+    if (elapsed_ns == 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_length) < 0) {
+        return current;
+    }
+
+    // The receiver's own RTT estimate tracks the sender's window better than the ACK-based one
+    uint64_t rtt_us = optname == SO_RCVBUF && info.tcpi_rcv_rtt > 0 ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+    uint64_t rate = bytes * NS_PER_SEC / elapsed_ns;
+    uint64_t target = 2 * rate * rtt_us / US_PER_SEC;
+    target = target < PCC_MIN_SOCKET_BUFFER ? PCC_MIN_SOCKET_BUFFER : target;
+    target = target > PCC_MAX_SOCKET_BUFFER ? PCC_MAX_SOCKET_BUFFER : target;
+
+    // The kernel reports (and grants) twice the requested size
+    if ((uint64_t)current >= 2 * target) {
+        return current;
+    }
+    int requested = (int)target;
+    setsockopt(fd, SOL_SOCKET, optname, &requested, sizeof(requested));
+    getsockopt(fd, SOL_SOCKET, optname, &current, &current_length);
+    return current;
+}
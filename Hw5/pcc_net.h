@@ -0,0 +1,15 @@
+#ifndef PCC_NET_H
+#define PCC_NET_H
+
+#include <stdint.h>
+
+// Bytes to transfer before a connection's socket buffer is sized from what was observed
+#define PCC_AUTOSIZE_AFTER (4UL << 20)
+
+// Bounds of an automatically sized socket buffer
+#define PCC_MIN_SOCKET_BUFFER (256UL << 10)
+#define PCC_MAX_SOCKET_BUFFER (64UL << 20)
+
+int pcc_autosize_buffer(int fd, int optname, uint64_t bytes, uint64_t elapsed_ns);
+
+#endif
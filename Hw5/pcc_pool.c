@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "pcc_pool.h"
+
+#define CACHE_LINE_SIZE 64
+#define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+/**
+ * @param value The value to round.
+ * @param alignment A power of two.
+ * @return value rounded up to a multiple of alignment.
+ */
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * Maps and pre-faults the pool's buffers. With PCC_POOL_HUGE, explicit huge
+ * pages are tried first; without them (or when none are reserved) the
+ * mapping uses normal pages and asks for transparent huge pages instead.
+ * Every buffer starts on a cache line, so buffers never share one.
+ *
+ * @param pool The pool to initialize.
+ * @param count Number of buffers.
+ * @param buffer_size Usable bytes per buffer.
+ * @param flags PCC_POOL_* flags.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int pcc_pool_init(pcc_pool *pool, size_t count, size_t buffer_size, int flags) {
+    size_t stride = align_up(buffer_size, CACHE_LINE_SIZE);
+
+    pool->buffer_size = buffer_size;
+    pool->region_size = align_up(count * stride, HUGE_PAGE_SIZE);
+    pool->huge = 0;
+    pool->region = MAP_FAILED;
+    if (flags & PCC_POOL_HUGE) {
+        pool->region = mmap(NULL, pool->region_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        pool->huge = pool->region != MAP_FAILED;
+    }
+    if (pool->region == MAP_FAILED) {
+        pool->region = mmap(NULL, pool->region_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool->region == MAP_FAILED) {
+            return -1;
+        }
+        if (flags & PCC_POOL_HUGE) {
+            madvise(pool->region, pool->region_size, MADV_HUGEPAGE);
+        }
+        // Fault the pages in now rather than on the first receive; older kernels need a touch per page
+        if (madvise(pool->region, pool->region_size, MADV_POPULATE_WRITE) < 0) {
+            for (size_t offset = 0; offset < pool->region_size; offset += PAGE_SIZE) {
+                ((volatile char *)pool->region)[offset] = 0;
+            }
+        }
+    }
+
+    pool->free_list = malloc(count * sizeof(char *));
+    if (pool->free_list == NULL) {
+        munmap(pool->region, pool->region_size);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        pool->free_list[i] = pool->region + i * stride;
+    }
+    pool->num_free = count;
+    mtx_init(&pool->lock, mtx_plain);
+    cnd_init(&pool->available);
+    return 0;
+}
+
+/**
+ * Releases the pool's mapping. All buffers must have been returned.
+ *
+ * @param pool The pool to destroy.
+ */
+void pcc_pool_destroy(pcc_pool *pool) {
+    munmap(pool->region, pool->region_size);
+    free(pool->free_list);
+    mtx_destroy(&pool->lock);
+    cnd_destroy(&pool->available);
+}
+
+/**
+ * Borrows a buffer, waiting until one is returned if all are out.
+ *
+ * @param pool The pool to borrow from.
+ * @return A buffer of pool->buffer_size bytes.
+ */
+void *pcc_pool_get(pcc_pool *pool) {
+    mtx_lock(&pool->lock);
+    while (pool->num_free == 0) {
+        cnd_wait(&pool->available, &pool->lock);
+    }
+    char *buffer = pool->free_list[--pool->num_free];
+    mtx_unlock(&pool->lock);
+    return buffer;
+}
+
+/**
+ * Returns a borrowed buffer to its pool.
+ *
+ * @param pool The pool the buffer came from.
+ * @param buffer The buffer.
+ */
+void pcc_pool_put(pcc_pool *pool, void *buffer) {
+    mtx_lock(&pool->lock);
+    pool->free_list[pool->num_free++] = buffer;
+    cnd_signal(&pool->available);
+    mtx_unlock(&pool->lock);
+}
@@ -0,0 +1,40 @@
+#ifndef PCC_POOL_H
+#define PCC_POOL_H
+
+#include <stddef.h>
+#include <threads.h>
+
+// Back the pool with explicit huge pages when the system has them reserved
+#define PCC_POOL_HUGE 0x1
+
+/**
+ * A fixed set of equally sized I/O buffers carved out of one pre-faulted
+ * mapping. Buffers are borrowed and returned; a borrower waits while all
+ * of them are out.
+ *
+ * @param region Start of the mapping.
+ * @param region_size Length of the mapping in bytes.
+ * @param buffer_size Usable bytes per buffer.
+ * @param huge Whether the mapping got explicit huge pages.
+ * @param free_list Buffers not currently borrowed.
+ * @param num_free Number of entries in free_list.
+ * @param lock Protects free_list and num_free.
+ * @param available Signalled when a buffer is returned.
+ */
+typedef struct {
+    char *region;
+    size_t region_size;
+    size_t buffer_size;
+    int huge;
+    char **free_list;
+    size_t num_free;
+    mtx_t lock;
+    cnd_t available;
+} pcc_pool;
+
+int   pcc_pool_init(pcc_pool *pool, size_t count, size_t buffer_size, int flags);
+void  pcc_pool_destroy(pcc_pool *pool);
+void *pcc_pool_get(pcc_pool *pool);
+void  pcc_pool_put(pcc_pool *pool, void *buffer);
+
+#endif
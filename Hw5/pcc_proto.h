@@ -0,0 +1,69 @@
+#ifndef PCC_PROTO_H
+#define PCC_PROTO_H
+
+#include <stdint.h>
+
+/*
+ * Wire protocol shared by pcc_client, pcc_server and pcc_load.
+ *
+ * Legacy request:   4-byte file size N (N != PCC_EXTENDED_MAGIC), N bytes.
+ * Legacy reply:     4-byte printable character count.
+ *
+ * Extended request: 4-byte PCC_EXTENDED_MAGIC, 4-byte mode and flags,
+ *                   8-byte file size N, N bytes.
+ * With PCC_FLAG_LZ the N bytes are sent as a series of frames instead:
+ *                   4-byte raw length R (1..PCC_LZ_BLOCK_SIZE), 4-byte
+ *                   stored length S, then S bytes: the LZ-compressed block,
+ *                   or the R raw bytes when S == R. The raw lengths add up to N.
+ *
+ * Extended reply:   8-byte printable character count, followed by
+ *                   256 8-byte byte counts    (PCC_MODE_BYTES) or
+ *                   4 8-byte UTF-8 class counts (PCC_MODE_UTF8).
+ *
+ * All integers are big-endian.
+ */
+
+/*
+ * A legacy file size with this value announces an extended header.
+ * Compatibility break: every 4-byte value is a valid legacy size, so no
+ * escape is free. A legacy client sending a file of exactly 4 GiB - 1
+ * bytes is now misparsed and dropped with a protocol error. Current
+ * clients send such files with an extended header instead.
+ */
+#define PCC_EXTENDED_MAGIC 0xFFFFFFFFU
+
+// Extended header bytes following the magic
+#define PCC_EXTENDED_HEADER_SIZE 12
+
+// Low byte of the mode and flags word is the mode, the rest are flags
+#define PCC_MODE_MASK 0xffU
+
+// Request flags
+#define PCC_FLAG_LZ 0x100U  // content is sent as LZ-compressed frames
+
+// Flags this implementation understands
+#define PCC_SUPPORTED_FLAGS PCC_FLAG_LZ
+
+// Length of the raw and stored length words in front of each frame
+#define PCC_FRAME_HEADER_SIZE 8
+
+// Counting modes
+#define PCC_MODE_PRINTABLE 0
+#define PCC_MODE_BYTES     1
+#define PCC_MODE_UTF8      2
+#define PCC_NUM_MODES      3
+
+// UTF-8 class indices in a PCC_MODE_UTF8 reply
+#define PCC_UTF8_PRINTABLE 0  // ASCII 32-126
+#define PCC_UTF8_CONTROL   1  // ASCII 0-31 and 127
+#define PCC_UTF8_MULTIBYTE 2  // well-formed 2-4 byte sequences
+#define PCC_UTF8_INVALID   3  // bytes not part of a well-formed sequence
+#define PCC_UTF8_CLASSES   4
+
+// Size of an extended reply in the given mode
+#define PCC_REPLY_SIZE(mode) \
+    (8 + 8 * ((mode) == PCC_MODE_BYTES ? 256 : (mode) == PCC_MODE_UTF8 ? PCC_UTF8_CLASSES : 0))
+
+#define PCC_MAX_REPLY_SIZE PCC_REPLY_SIZE(PCC_MODE_BYTES)
+
+#endif
@@ -1,50 +1,976 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <signal.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <threads.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <endian.h>
+#include "pcc_proto.h"
+#include "pcc_count.h"
+#include "pcc_pool.h"
+#include "pcc_lz.h"
+#include "pcc_net.h"
+#include "../hw4/queue.h"
+#include <arpa/inet.h>
 
 #define BUFFER_SIZE 1048576 // 1MB buffer size
+#define CACHE_LINE_SIZE 64
+#define LISTEN_BACKLOG 128
+#define MAX_EVENTS 64
+#define DEFAULT_IDLE_TIMEOUT_MS 10000
+#define DEFAULT_QUANTUM 65536 // 64KB read budget per connection per round
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+#define LATENCY_BUCKETS 32     // log2 microsecond buckets, the last one is unbounded
+#define METRICS_BUFFER_SIZE 8192
+#define DEFAULT_CHECKPOINT_INTERVAL_MS 1000
+#define CHECKPOINT_MAGIC 0x31544b4843434350ULL // "PCCCHKT1"
+#define CHECKPOINT_SLOT_SIZE 4096
+#define COUNTER_WORDS (sizeof(counter_block) / sizeof(atomic_uint_least64_t))
+#define WINDOW_SLOTS 60                  // intervals of history kept per counter block
+#define DEFAULT_WINDOW_INTERVAL_SEC 60
+#define WINDOW_REQUEST_TIMEOUT_MS 20     // how long a scraper has to send an optional query line
+
+// ========== Types ==========
+
+/**
+ * Printable character and service counters owned by a single serving process
+ * (or, in worker pool mode, a single thread). Blocks live in a shared
+ * anonymous mapping and are cache-line aligned, so every worker writes only
+ * its own lines and the parent can sum them all.
+ *
+ * @param pcc_total Per-character counts for ASCII 32-126.
+ * @param accepted Client connections accepted.
+ * @param closed Client connections closed, whether served or dropped.
+ * @param completed Client connections served to the end.
+ * @param timed_out Client connections dropped by a deadline.
+ * @param bytes_received Bytes read from clients, headers included.
+ * @param bytes_counted File content bytes run through the counting loop.
+ * @param count_ns Time spent in the counting loop.
+ * @param latency_sum_ns Sum of accept-to-reply latencies of completed requests.
+ * @param latency Completed requests by latency, bucket i holding those under 2^i us.
+ * @param dequeued Connections taken off the worker pool queue.
+ * @param queue_wait_ns Sum of the time dequeued connections spent in the queue.
+ * @param queue_wait Dequeued connections by queue wait, bucket i holding those under 2^i us.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_least64_t pcc_total[95];
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_least64_t accepted;
+    atomic_uint_least64_t closed;
+    atomic_uint_least64_t completed;
+    atomic_uint_least64_t timed_out;
+    atomic_uint_least64_t bytes_received;
+    atomic_uint_least64_t bytes_counted;
+    atomic_uint_least64_t count_ns;
+    atomic_uint_least64_t latency_sum_ns;
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_least64_t latency[LATENCY_BUCKETS];
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_least64_t dequeued;
+    atomic_uint_least64_t queue_wait_ns;
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_least64_t queue_wait[LATENCY_BUCKETS];
+} counter_block;
+
+/**
+ * One half of the double-buffered checkpoint file. Checkpoints alternate
+ * between the two slots, so a crash while one is being written leaves the
+ * other intact; a torn slot fails its checksum and is ignored on restart.
+ *
+ * @param magic CHECKPOINT_MAGIC.
+ * @param words Number of counter words, so a file from another layout is rejected.
+ * @param sequence Checkpoint number, the valid slot with the highest one wins.
+ * @param counters Snapshot of all counter blocks summed, word for word.
+ * @param checksum FNV-1a hash of all preceding fields.
+ */
+typedef struct {
+    uint64_t magic;
+    uint64_t words;
+    uint64_t sequence;
+    uint64_t counters[COUNTER_WORDS];
+    uint64_t checksum;
+} checkpoint_slot;
+
+_Static_assert(sizeof(checkpoint_slot) <= CHECKPOINT_SLOT_SIZE, "checkpoint slot too large");
+
+/**
+ * Counts of the requests completed during one time interval. A slot is
+ * reused for the interval WINDOW_SLOTS later; its single writer stamps it
+ * with the new interval number inside a sequence lock, so a reader that
+ * races with the reset sees an odd or changed sequence and retries, and
+ * ingest never waits for readers. A zeroed slot claims interval 0 but
+ * holds no counts, so it never needs to be told apart.
+ *
+ * @param sequence Odd while the slot is being reset for a new interval.
+ * @param interval Interval number (monotonic time / interval length) the counts belong to.
+ * @param completed Requests completed in the interval.
+ * @param bytes_counted File content bytes of those requests.
+ * @param pcc Per-character counts for ASCII 32-126.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_least64_t sequence;
+    atomic_uint_least64_t interval;
+    atomic_uint_least64_t completed;
+    atomic_uint_least64_t bytes_counted;
+    atomic_uint_least64_t pcc[95];
+} window_slot;
+
+/**
+ * Ring of the most recent intervals, one per counter block and written only
+ * by that block's owner. Slot i holds the latest interval congruent to i.
+ */
+typedef struct {
+    window_slot slots[WINDOW_SLOTS];
+} window_ring;
+
+/**
+ * Counts summed over a window of recent intervals.
+ *
+ * @param seconds Length of the window actually covered.
+ * @param completed Requests completed in the window.
+ * @param bytes_counted File content bytes of those requests.
+ * @param pcc Per-character counts for ASCII 32-126.
+ */
+typedef struct {
+    uint64_t seconds;
+    uint64_t completed;
+    uint64_t bytes_counted;
+    uint64_t pcc[95];
+} window_totals;
+
+/**
+ * Command-line configuration of the server.
+ *
+ * @param port String representation of the port to listen on.
+ * @param workers Number of prefork worker processes (0 serves in-process).
+ * @param pool_workers Number of worker pool threads (0 uses the event loop).
+ * @param idle_timeout_ms Drop a client that makes no progress for this long (0 disables).
+ * @param total_timeout_ms Drop a client whose whole transfer takes longer (0 disables).
+ * @param quantum Bytes a connection may read per scheduling round.
+ * @param rate_limit Per-client cap on content bytes per second (0 disables).
+ * @param metrics_address Port (on loopback) or Unix socket path of the metrics endpoint, or NULL.
+ * @param checkpoint_path File to checkpoint the counters to, or NULL.
+ * @param checkpoint_interval_ms Time between checkpoints.
+ * @param huge_pages Back the receive buffers with huge pages if available.
+ * @param window_interval_sec Length of one interval of the windowed histograms.
+ */
+typedef struct {
+    const char *port;
+    int workers;
+    int pool_workers;
+    uint64_t idle_timeout_ms;
+    uint64_t total_timeout_ms;
+    uint64_t quantum;
+    uint64_t rate_limit;
+    const char *metrics_address;
+    const char *checkpoint_path;
+    uint64_t checkpoint_interval_ms;
+    int huge_pages;
+    uint64_t window_interval_sec;
+} server_config;
+
+/**
+ * Protocol state of a client connection.
+ */
+typedef enum {
+    CONN_READ_SIZE,
+    CONN_READ_EXTENDED,
+    CONN_READ_DATA,
+    CONN_WRITE_COUNT
+} conn_state;
+
+/**
+ * The intrusive lists a connection can be linked into.
+ */
+typedef enum {
+    LINK_IDLE,
+    LINK_AGE,
+    LINK_THROTTLE,
+    NUM_LINKS
+} conn_link;
+
+/**
+ * Doubly linked list of connections ordered by a deadline.
+ *
+ * @param head First (earliest) connection.
+ * @param tail Last (latest) connection.
+ * @param link Which of the connection's links this list threads through.
+ */
+typedef struct conn_list {
+    struct connection *head;
+    struct connection *tail;
+    conn_link link;
+} conn_list;
+
+/**
+ * A non-blocking client connection and its partial results.
+ * Each connection sits on two lists: the idle list in order of last
+ * progress and the age list in order of acceptance. Both are therefore
+ * sorted by deadline, and expiry only ever looks at their heads.
+ * A rate-limited connection that has used up its tokens is also parked on
+ * the throttle list until enough tokens have been refilled.
+ *
+ * @param fd The client socket file descriptor.
+ * @param state Current protocol state.
+ * @param io Bytes of the current header received or of the reply sent so far.
+ * @param net_value The 4-byte legacy file size or extended magic, network order.
+ * @param header The extended header, once net_value holds PCC_EXTENDED_MAGIC.
+ * @param extended Whether the client sent an extended header.
+ * @param mode Counting mode requested by the client (PCC_MODE_*).
+ * @param compressed Whether the content arrives as LZ frames (PCC_FLAG_LZ).
+ * @param frame The frame being received, allocated when compressed is set.
+ * @param frame_io Bytes of the current frame received so far.
+ * @param remaining File content bytes still to receive, counted before compression.
+ * @param received Content bytes received so far, as sent on the wire.
+ * @param histogram Per-byte-value counts, merged into the process totals on success only.
+ * @param utf8 UTF-8 decoder state (PCC_MODE_UTF8 only).
+ * @param multibyte Well-formed multibyte UTF-8 sequences seen (PCC_MODE_UTF8 only).
+ * @param invalid Invalid UTF-8 bytes seen (PCC_MODE_UTF8 only).
+ * @param reply The encoded reply.
+ * @param reply_length Length of the encoded reply.
+ * @param accepted_ns Time the connection was accepted.
+ * @param active_ns Time the connection last made progress.
+ * @param tokens Content bytes the rate limiter currently allows.
+ * @param refill_ns Time tokens were last refilled.
+ * @param wake_ns Time a throttled connection is resumed.
+ * @param throttled Whether the connection is parked on the throttle list.
+ * @param autosized Whether the receive buffer has been sized from the observed transfer.
+ * @param links Prev/next links for each conn_list.
+ */
+typedef struct connection {
+    int fd;
+    conn_state state;
+    size_t io;
+    uint32_t net_value;
+    unsigned char header[PCC_EXTENDED_HEADER_SIZE];
+    int extended;
+    int mode;
+    int compressed;
+    unsigned char *frame;
+    size_t frame_io;
+    uint64_t remaining;
+    uint64_t received;
+    uint64_t histogram[256];
+    pcc_utf8_state utf8;
+    uint64_t multibyte;
+    uint64_t invalid;
+    unsigned char reply[PCC_MAX_REPLY_SIZE];
+    size_t reply_length;
+    uint64_t accepted_ns;
+    uint64_t active_ns;
+    uint64_t tokens;
+    uint64_t refill_ns;
+    uint64_t wake_ns;
+    int throttled;
+    int autosized;
+    struct {
+        struct connection *prev, *next;
+    } links[NUM_LINKS];
+} connection;
 
 // ========== Function Declarations ==========
 
 void handle_SIGINT(int signum);
 void display_statistics();
 void setup_signal_handler();
+void parse_arguments(int argc, char *argv[], server_config *config);
+void setup_counters(int num_blocks);
+void counter_add(atomic_uint_least64_t *counter, uint64_t value);
+uint64_t counter_sum(size_t offset);
+void start_thread(thrd_t *thread, thrd_start_t function, void *arg);
+void start_helper_thread(thrd_start_t function, void *arg);
+void setup_metrics(const char *address);
+int metrics_main(void *arg);
+size_t format_metrics(char *buffer, size_t capacity);
+size_t format_window(char *buffer, size_t capacity, uint64_t seconds);
+void window_record(const connection *conn);
+void window_sum(uint64_t seconds, window_totals *totals);
+void setup_checkpoint(const char *path);
+int checkpoint_main(void *arg);
+void write_checkpoint(void);
+uint64_t checkpoint_checksum(const checkpoint_slot *slot);
 void setup_server(int *server_fd, const char *port);
 void server_loop(int server_fd);
-void handle_client_connection(int client_fd);
-void receive_data(int client_fd, uint32_t *file_size, uint32_t *printable_count, uint32_t temp_pcc_total[95]);
-void send_printable_count(int client_fd, uint32_t printable_count);
+void run_prefork(int server_fd, int workers);
+pid_t spawn_worker(int server_fd, int block);
+void run_worker_pool(int server_fd, int workers);
+void accept_and_enqueue(int server_fd);
+int pool_worker_main(void *arg);
+void serve_connection(connection *conn);
+void record_log2_us(atomic_uint_least64_t *buckets, uint64_t ns);
+void accept_clients(int epoll_fd, int server_fd);
+void handle_connection_event(int epoll_fd, connection *conn, uint32_t events);
+int receive_size(connection *conn);
+int receive_extended_header(connection *conn);
+int receive_content(connection *conn, uint64_t budget);
+int receive_frame(connection *conn, uint64_t budget);
+void note_received(connection *conn, size_t bytes);
+uint64_t bucket_size(void);
+uint64_t read_budget(connection *conn, uint64_t now);
+void throttle_connection(int epoll_fd, connection *conn, uint64_t now);
+int release_throttled(int epoll_fd, uint64_t now);
+void build_reply(connection *conn);
+int send_reply(connection *conn);
+void commit_counts(connection *conn);
+void close_connection(connection *conn);
+int expire_connections(uint64_t now);
+void list_append(conn_list *list, connection *conn);
+void list_remove(conn_list *list, connection *conn);
+uint64_t now_ns(void);
 
 // ========== Global Variables ==========
 
-uint32_t pcc_total[95];
-int client_socket_fd = -1;
-int is_server_running = 1;
+server_config config;
+counter_block *counter_blocks = MAP_FAILED;  // shared mapping, one block per serving process
+int num_counter_blocks = 0;
+window_ring *window_rings = MAP_FAILED;      // shared mapping, one ring per counter block
+_Thread_local counter_block *own_block = NULL;  // block this process (or pool thread) adds its counts to
+atomic_int active_connections = 0;
+volatile sig_atomic_t is_server_running = 1;
+int is_worker_process = 0;
+pid_t *worker_pids = NULL;
+int num_workers = 0;
+checkpoint_slot *checkpoint_slots = NULL;   // the two slots of the mapped checkpoint file
+atomic_uint_least64_t checkpoint_sequence = 0;
+pcc_pool buffer_pool;                         // receive buffers, borrowed by connections while reading
+conn_list idle_list = {.link = LINK_IDLE};
+conn_list age_list = {.link = LINK_AGE};
+conn_list throttle_list = {.link = LINK_THROTTLE};  // FIFO, so also ordered by wake time
 
 // ========== Function Definitions ==========
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        perror("Usage: <server port>\n");
-        exit(EXIT_FAILURE);
-    }
-
     int server_socket_fd;
 
-    setup_server(&server_socket_fd, argv[1]);
+    parse_arguments(argc, argv, &config);
+    // A worker pool has a block per worker thread, plus one for the acceptor
+    setup_counters(config.workers > 0 ? config.workers : config.pool_workers > 0 ? config.pool_workers + 1 : 1);
+    if (config.checkpoint_path != NULL) {
+        setup_checkpoint(config.checkpoint_path);
+    }
+    setup_server(&server_socket_fd, config.port);
     setup_signal_handler();
-    server_loop(server_socket_fd);
+    if (config.metrics_address != NULL) {
+        setup_metrics(config.metrics_address);
+    }
+    if (config.checkpoint_path != NULL) {
+        start_helper_thread(checkpoint_main, NULL);
+    }
+    if (config.workers > 0) {
+        run_prefork(server_socket_fd, config.workers);
+    } else if (config.pool_workers > 0) {
+        run_worker_pool(server_socket_fd, config.pool_workers);
+    } else {
+        own_block = &counter_blocks[0];
+        server_loop(server_socket_fd);
+    }
     display_statistics();
     return 0;
 }
 
+/**
+ * Parses the command-line arguments.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of argument strings.
+ * @param config Output: the parsed configuration.
+ */
+void parse_arguments(int argc, char *argv[], server_config *config) {
+    int opt;
+
+    config->workers = 0;
+    config->pool_workers = 0;
+    config->idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+    config->total_timeout_ms = 0;
+    config->quantum = DEFAULT_QUANTUM;
+    config->rate_limit = 0;
+    config->metrics_address = NULL;
+    config->checkpoint_path = NULL;
+    config->checkpoint_interval_ms = DEFAULT_CHECKPOINT_INTERVAL_MS;
+    config->huge_pages = 0;
+    config->window_interval_sec = DEFAULT_WINDOW_INTERVAL_SEC;
+    while ((opt = getopt(argc, argv, "p:w:i:t:q:r:m:c:C:HW:")) != -1) {
+        switch (opt) {
+        case 'p':
+            config->workers = atoi(optarg);
+            if (config->workers <= 0) {
+                fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            config->pool_workers = atoi(optarg);
+            if (config->pool_workers <= 0) {
+                fprintf(stderr, "Invalid number of pool workers: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'i':
+            config->idle_timeout_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            config->total_timeout_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'q':
+            config->quantum = strtoull(optarg, NULL, 10);
+            if (config->quantum == 0) {
+                fprintf(stderr, "Invalid quantum: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            config->rate_limit = strtoull(optarg, NULL, 10);
+            break;
+        case 'm':
+            config->metrics_address = optarg;
+            break;
+        case 'c':
+            config->checkpoint_path = optarg;
+            break;
+        case 'C':
+            config->checkpoint_interval_ms = strtoull(optarg, NULL, 10);
+            if (config->checkpoint_interval_ms == 0) {
+                fprintf(stderr, "Invalid checkpoint interval: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'H':
+            config->huge_pages = 1;
+            break;
+        case 'W':
+            config->window_interval_sec = strtoull(optarg, NULL, 10);
+            if (config->window_interval_sec == 0) {
+                fprintf(stderr, "Invalid window interval: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (argc - optind != 1 || (config->workers > 0 && config->pool_workers > 0)) {
+        goto usage;
+    }
+    config->port = argv[optind];
+    return;
+
+usage:
+    fprintf(stderr, "Usage: %s [-p workers | -w pool_workers] [-i idle_timeout_ms] [-t total_timeout_ms]"
+            " [-q quantum_bytes] [-r rate_bytes_per_sec] [-m metrics_port|metrics_socket_path]"
+            " [-c checkpoint_file] [-C checkpoint_interval_ms] [-H] [-W window_interval_sec]"
+            " <server port>\n", argv[0]);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Creates the shared anonymous mappings holding one zeroed counter block
+ * and one window ring per serving process. The mappings are inherited
+ * across fork, so the parent sees every worker's counts without any
+ * further communication.
+ *
+ * @param num_blocks Number of counter blocks to allocate.
+ */
+void setup_counters(int num_blocks) {
+    counter_blocks = mmap(NULL, num_blocks * sizeof(counter_block), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    window_rings = mmap(NULL, num_blocks * sizeof(window_ring), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counter_blocks == MAP_FAILED || window_rings == MAP_FAILED) {
+        perror("Counter mapping failed");
+        exit(EXIT_FAILURE);
+    }
+    num_counter_blocks = num_blocks;
+}
+
+/**
+ * Adds to a counter of this process's own block. Every block has a single
+ * writer, so a relaxed load and store is enough and no locked instruction
+ * is needed.
+ *
+ * @param counter The counter to increment.
+ * @param value The amount to add.
+ */
+void counter_add(atomic_uint_least64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+/**
+ * Sums one counter over the blocks of all serving processes.
+ *
+ * @param offset Byte offset of the counter within counter_block.
+ * @return The total.
+ */
+uint64_t counter_sum(size_t offset) {
+    uint64_t total = 0;
+    for (int b = 0; b < num_counter_blocks; b++) {
+        total += atomic_load_explicit((atomic_uint_least64_t *)((char *)&counter_blocks[b] + offset),
+                                      memory_order_relaxed);
+    }
+    return total;
+}
+
+/**
+ * Starts a thread with SIGINT blocked, so that the signal keeps being
+ * delivered to the main thread.
+ *
+ * @param thread Output: the new thread.
+ * @param function The thread function.
+ * @param arg Argument passed to the thread function.
+ */
+void start_thread(thrd_t *thread, thrd_start_t function, void *arg) {
+    sigset_t blocked, previous;
+
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    if (thrd_create(thread, function, arg) != thrd_success) {
+        fprintf(stderr, "Thread creation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+/**
+ * Starts a detached helper thread in the process owning the counter blocks.
+ *
+ * @param function The thread function.
+ * @param arg Argument passed to the thread function.
+ */
+void start_helper_thread(thrd_start_t function, void *arg) {
+    thrd_t thread;
+
+    start_thread(&thread, function, arg);
+    thrd_detach(thread);
+}
+
+/**
+ * Opens the metrics endpoint and starts the thread serving it. An address
+ * containing a '/' is a Unix socket path; otherwise it is a TCP port bound
+ * to loopback only. Each connection receives one snapshot of the counters in
+ * the text exposition format and is then closed, so `nc` or any scraper that
+ * can read a socket will do. The thread runs in the process owning all
+ * counter blocks (the prefork parent), and reading them never stalls the
+ * serving loops.
+ *
+ * @param address Port or Unix socket path to listen on.
+ */
+void setup_metrics(const char *address) {
+    int metrics_fd, enable = 1;
+
+    if (strchr(address, '/') != NULL) {
+        struct sockaddr_un unix_address = {.sun_family = AF_UNIX};
+        if (strlen(address) >= sizeof(unix_address.sun_path)) {
+            fprintf(stderr, "Metrics socket path too long: %s\n", address);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(unix_address.sun_path, address);
+        unlink(address);
+        metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (metrics_fd < 0 || bind(metrics_fd, (struct sockaddr *)&unix_address, sizeof(unix_address)) != 0) {
+            perror("Metrics socket setup failed");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        struct sockaddr_in inet_address = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+            .sin_port = htons(atoi(address))
+        };
+        metrics_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (metrics_fd < 0 ||
+            setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0 ||
+            bind(metrics_fd, (struct sockaddr *)&inet_address, sizeof(inet_address)) != 0) {
+            perror("Metrics socket setup failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (listen(metrics_fd, LISTEN_BACKLOG) != 0) {
+        perror("Metrics listen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    start_helper_thread(metrics_main, (void *)(intptr_t)metrics_fd);
+}
+
+/**
+ * Metrics thread: writes a snapshot to every connecting scraper. A scraper
+ * that sends "window <seconds>" right after connecting gets the
+ * per-character counts of that window instead; one that sends nothing
+ * gets the plain snapshot after a short wait.
+ *
+ * @param arg The listening metrics socket, cast to a pointer.
+ * @return Never returns.
+ */
+int metrics_main(void *arg) {
+    int metrics_fd = (int)(intptr_t)arg;
+    char buffer[METRICS_BUFFER_SIZE];
+    char request[64];
+    unsigned long long seconds;
+
+    while (1) {
+        int scraper_fd = accept(metrics_fd, NULL, NULL);
+        if (scraper_fd < 0) {
+            if (errno != EINTR) {
+                perror("Metrics accept failed");
+            }
+            continue;
+        }
+
+        struct pollfd pfd = { .fd = scraper_fd, .events = POLLIN };
+        ssize_t request_length = 0;
+        if (poll(&pfd, 1, WINDOW_REQUEST_TIMEOUT_MS) > 0) {
+            request_length = recv(scraper_fd, request, sizeof(request) - 1, 0);
+        }
+        request[request_length > 0 ? request_length : 0] = '\0';
+
+        size_t length = sscanf(request, "window %llu", &seconds) == 1
+                            ? format_window(buffer, sizeof(buffer), seconds)
+                            : format_metrics(buffer, sizeof(buffer));
+        for (size_t sent = 0; sent < length;) {
+            ssize_t cur_sent = send(scraper_fd, buffer + sent, length - sent, MSG_NOSIGNAL);
+            if (cur_sent <= 0) {
+                break;
+            }
+            sent += cur_sent;
+        }
+        close(scraper_fd);
+    }
+    return 0;
+}
+
+/**
+ * Formats a snapshot of the counters, summed over all serving processes.
+ *
+ * @param buffer Output buffer.
+ * @param capacity Size of the output buffer.
+ * @return Number of bytes written.
+ */
+size_t format_metrics(char *buffer, size_t capacity) {
+    uint64_t accepted = counter_sum(offsetof(counter_block, accepted));
+    uint64_t closed = counter_sum(offsetof(counter_block, closed));
+    uint64_t completed = counter_sum(offsetof(counter_block, completed));
+    uint64_t bytes_counted = counter_sum(offsetof(counter_block, bytes_counted));
+    uint64_t count_ns = counter_sum(offsetof(counter_block, count_ns));
+    uint64_t cumulative = 0;
+    size_t length = 0;
+
+#define APPEND(...) \
+    length += snprintf(buffer + length, length < capacity ? capacity - length : 0, __VA_ARGS__)
+
+    APPEND("# TYPE pcc_connections_accepted_total counter\n"
+           "pcc_connections_accepted_total %" PRIu64 "\n", accepted);
+    APPEND("# TYPE pcc_connections_active gauge\n"
+           "pcc_connections_active %" PRIu64 "\n", accepted - closed);
+    APPEND("# TYPE pcc_connections_completed_total counter\n"
+           "pcc_connections_completed_total %" PRIu64 "\n", completed);
+    APPEND("# TYPE pcc_connections_timed_out_total counter\n"
+           "pcc_connections_timed_out_total %" PRIu64 "\n",
+           counter_sum(offsetof(counter_block, timed_out)));
+    APPEND("# TYPE pcc_bytes_received_total counter\n"
+           "pcc_bytes_received_total %" PRIu64 "\n",
+           counter_sum(offsetof(counter_block, bytes_received)));
+    APPEND("# TYPE pcc_bytes_counted_total counter\n"
+           "pcc_bytes_counted_total %" PRIu64 "\n", bytes_counted);
+    APPEND("# TYPE pcc_count_ns_per_byte gauge\n"
+           "pcc_count_ns_per_byte %.4f\n", bytes_counted > 0 ? (double)count_ns / bytes_counted : 0.0);
+
+    APPEND("# TYPE pcc_request_latency_seconds histogram\n");
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        cumulative += counter_sum(offsetof(counter_block, latency) + i * sizeof(atomic_uint_least64_t));
+        APPEND("pcc_request_latency_seconds_bucket{le=\"%g\"} %" PRIu64 "\n", (double)(1ULL << i) / 1e6, cumulative);
+    }
+    APPEND("pcc_request_latency_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n", completed);
+    APPEND("pcc_request_latency_seconds_sum %.6f\n",
+           counter_sum(offsetof(counter_block, latency_sum_ns)) / 1e9);
+    APPEND("pcc_request_latency_seconds_count %" PRIu64 "\n", completed);
+
+    if (config.pool_workers > 0) {
+        uint64_t dequeued = counter_sum(offsetof(counter_block, dequeued));
+        APPEND("# TYPE pcc_queue_depth gauge\n"
+               "pcc_queue_depth %zu\n", size());
+        APPEND("# TYPE pcc_queue_idle_workers gauge\n"
+               "pcc_queue_idle_workers %zu\n", waiting());
+        APPEND("# TYPE pcc_queue_wait_seconds histogram\n");
+        cumulative = 0;
+        for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+            cumulative += counter_sum(offsetof(counter_block, queue_wait) + i * sizeof(atomic_uint_least64_t));
+            APPEND("pcc_queue_wait_seconds_bucket{le=\"%g\"} %" PRIu64 "\n", (double)(1ULL << i) / 1e6, cumulative);
+        }
+        APPEND("pcc_queue_wait_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n", dequeued);
+        APPEND("pcc_queue_wait_seconds_sum %.6f\n",
+               counter_sum(offsetof(counter_block, queue_wait_ns)) / 1e9);
+        APPEND("pcc_queue_wait_seconds_count %" PRIu64 "\n", dequeued);
+    }
+
+    static const int window_intervals[] = {1, 5, 15, WINDOW_SLOTS};
+    window_totals totals[sizeof(window_intervals) / sizeof(window_intervals[0])];
+    for (size_t w = 0; w < sizeof(window_intervals) / sizeof(window_intervals[0]); w++) {
+        window_sum(window_intervals[w] * config.window_interval_sec, &totals[w]);
+    }
+    APPEND("# TYPE pcc_window_requests gauge\n");
+    for (size_t w = 0; w < sizeof(window_intervals) / sizeof(window_intervals[0]); w++) {
+        APPEND("pcc_window_requests{window=\"%" PRIu64 "s\"} %" PRIu64 "\n", totals[w].seconds, totals[w].completed);
+    }
+    APPEND("# TYPE pcc_window_bytes_counted gauge\n");
+    for (size_t w = 0; w < sizeof(window_intervals) / sizeof(window_intervals[0]); w++) {
+        APPEND("pcc_window_bytes_counted{window=\"%" PRIu64 "s\"} %" PRIu64 "\n",
+               totals[w].seconds, totals[w].bytes_counted);
+    }
+
+#undef APPEND
+    return length < capacity ? length : capacity - 1;
+}
+
+/**
+ * Formats the per-character counts of a recent window, for a
+ * "window <seconds>" metrics query.
+ *
+ * @param buffer Output buffer.
+ * @param capacity Size of the output buffer.
+ * @param seconds Requested window length, rounded up to whole intervals and
+ *                capped at the history kept.
+ * @return Number of bytes written.
+ */
+size_t format_window(char *buffer, size_t capacity, uint64_t seconds) {
+    window_totals totals;
+    size_t length = 0;
+
+    window_sum(seconds, &totals);
+
+#define APPEND(...) \
+    length += snprintf(buffer + length, length < capacity ? capacity - length : 0, __VA_ARGS__)
+
+    APPEND("# TYPE pcc_window_requests gauge\n"
+           "pcc_window_requests{window=\"%" PRIu64 "s\"} %" PRIu64 "\n", totals.seconds, totals.completed);
+    APPEND("# TYPE pcc_window_bytes_counted gauge\n"
+           "pcc_window_bytes_counted{window=\"%" PRIu64 "s\"} %" PRIu64 "\n", totals.seconds, totals.bytes_counted);
+    APPEND("# TYPE pcc_window_chars gauge\n");
+    for (int i = 0; i < 95; i++) {
+        APPEND("pcc_window_chars{window=\"%" PRIu64 "s\",char=\"%d\"} %" PRIu64 "\n",
+               totals.seconds, i + 32, totals.pcc[i]);
+    }
+
+#undef APPEND
+    return length < capacity ? length : capacity - 1;
+}
+
+/**
+ * Adds a completed request to the current interval of this block's window
+ * ring. The first request of a new interval resets the slot, which last
+ * held the interval WINDOW_SLOTS before; the reset is bracketed by the
+ * slot's sequence number so concurrent readers can detect it.
+ *
+ * @param conn The connection whose reply has been sent.
+ */
+void window_record(const connection *conn) {
+    window_ring *ring = &window_rings[own_block - counter_blocks];
+    uint64_t interval = now_ns() / (config.window_interval_sec * NS_PER_SEC);
+    window_slot *slot = &ring->slots[interval % WINDOW_SLOTS];
+
+    if (atomic_load_explicit(&slot->interval, memory_order_relaxed) != interval) {
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+        atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&slot->interval, interval, memory_order_relaxed);
+        atomic_store_explicit(&slot->completed, 0, memory_order_relaxed);
+        atomic_store_explicit(&slot->bytes_counted, 0, memory_order_relaxed);
+        for (int i = 0; i < 95; i++) {
+            atomic_store_explicit(&slot->pcc[i], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+    }
+
+    uint64_t bytes = 0;
+    for (int b = 0; b < 256; b++) {
+        bytes += conn->histogram[b];
+    }
+    counter_add(&slot->completed, 1);
+    counter_add(&slot->bytes_counted, bytes);
+    for (int i = 0; i < 95; i++) {
+        counter_add(&slot->pcc[i], conn->histogram[i + 32]);
+    }
+}
+
+/**
+ * Sums the window rings of all serving processes over the current interval
+ * and the ones before it, without blocking any writer: a slot read while
+ * its owner resets it is simply read again, and a slot still holding an
+ * older interval (its owner has been idle) contributes nothing.
+ *
+ * @param seconds Window length, rounded up to whole intervals and capped at WINDOW_SLOTS of them.
+ * @param totals Output: the summed counts.
+ */
+void window_sum(uint64_t seconds, window_totals *totals) {
+    uint64_t current = now_ns() / (config.window_interval_sec * NS_PER_SEC);
+    uint64_t intervals = (seconds + config.window_interval_sec - 1) / config.window_interval_sec;
+
+    intervals = intervals == 0 ? 1 : intervals > WINDOW_SLOTS ? WINDOW_SLOTS : intervals;
+    memset(totals, 0, sizeof(*totals));
+    totals->seconds = intervals * config.window_interval_sec;
+
+    // A window longer than the time since the clock's epoch starts at interval 0
+    uint64_t first = current + 1 >= intervals ? current - intervals + 1 : 0;
+
+    for (int b = 0; b < num_counter_blocks; b++) {
+        for (uint64_t interval = first; interval <= current; interval++) {
+            window_slot *slot = &window_rings[b].slots[interval % WINDOW_SLOTS];
+            window_totals snapshot;
+            uint64_t before, after;
+
+            do {
+                before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+                snapshot.completed = 0;
+                if (before % 2 == 0 && atomic_load_explicit(&slot->interval, memory_order_relaxed) == interval) {
+                    snapshot.completed = atomic_load_explicit(&slot->completed, memory_order_relaxed);
+                    snapshot.bytes_counted = atomic_load_explicit(&slot->bytes_counted, memory_order_relaxed);
+                    for (int i = 0; i < 95; i++) {
+                        snapshot.pcc[i] = atomic_load_explicit(&slot->pcc[i], memory_order_relaxed);
+                    }
+                }
+                atomic_thread_fence(memory_order_acquire);
+                after = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+            } while (before % 2 != 0 || before != after);
+
+            if (snapshot.completed > 0) {
+                totals->completed += snapshot.completed;
+                totals->bytes_counted += snapshot.bytes_counted;
+                for (int i = 0; i < 95; i++) {
+                    totals->pcc[i] += snapshot.pcc[i];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Maps the checkpoint file, creating it if needed, and resumes from the
+ * newest valid slot: its counters are loaded into the first counter block
+ * before any client is served, so every later total includes them. Only
+ * the two fixed-size slots are inspected, so restart time does not depend
+ * on how long the server has been running.
+ *
+ * @param path The checkpoint file.
+ */
+void setup_checkpoint(const char *path) {
+    checkpoint_slot *latest = NULL;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Checkpoint file open failed");
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(fd, 2 * CHECKPOINT_SLOT_SIZE) != 0) {
+        perror("Checkpoint file resize failed");
+        exit(EXIT_FAILURE);
+    }
+    checkpoint_slots = mmap(NULL, 2 * CHECKPOINT_SLOT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (checkpoint_slots == MAP_FAILED) {
+        perror("Checkpoint file mapping failed");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    for (int i = 0; i < 2; i++) {
+        checkpoint_slot *slot = (checkpoint_slot *)((char *)checkpoint_slots + i * CHECKPOINT_SLOT_SIZE);
+        if (slot->magic != CHECKPOINT_MAGIC || slot->words != COUNTER_WORDS ||
+            slot->checksum != checkpoint_checksum(slot)) {
+            continue;
+        }
+        if (latest == NULL || slot->sequence > latest->sequence) {
+            latest = slot;
+        }
+    }
+    if (latest == NULL) {
+        return;
+    }
+
+    atomic_uint_least64_t *words = (atomic_uint_least64_t *)&counter_blocks[0];
+    for (size_t i = 0; i < COUNTER_WORDS; i++) {
+        atomic_store_explicit(&words[i], latest->counters[i], memory_order_relaxed);
+    }
+    // Connections open at the time of the checkpoint did not survive it
+    atomic_store_explicit(&counter_blocks[0].closed, latest->counters[offsetof(counter_block, accepted) / sizeof(uint64_t)],
+                          memory_order_relaxed);
+    atomic_store_explicit(&checkpoint_sequence, latest->sequence, memory_order_relaxed);
+}
+
+/**
+ * Checkpoint thread: writes a checkpoint every interval.
+ *
+ * @param arg Unused.
+ * @return Never returns.
+ */
+int checkpoint_main(void *arg) {
+    struct timespec interval = {
+        .tv_sec = config.checkpoint_interval_ms / 1000,
+        .tv_nsec = (config.checkpoint_interval_ms % 1000) * NS_PER_MS
+    };
+
+    while (1) {
+        thrd_sleep(&interval, NULL);
+        write_checkpoint();
+    }
+    return 0;
+}
+
+/**
+ * Writes the summed counters into the older checkpoint slot and flushes it
+ * to disk. Each writer claims its own sequence number, so the periodic
+ * thread and the final checkpoint at shutdown never write the same slot at
+ * the same time.
+ */
+void write_checkpoint(void) {
+    uint64_t sequence = atomic_fetch_add(&checkpoint_sequence, 1) + 1;
+    checkpoint_slot *slot = (checkpoint_slot *)((char *)checkpoint_slots + (sequence % 2) * CHECKPOINT_SLOT_SIZE);
+
+    slot->magic = CHECKPOINT_MAGIC;
+    slot->words = COUNTER_WORDS;
+    slot->sequence = sequence;
+    for (size_t i = 0; i < COUNTER_WORDS; i++) {
+        slot->counters[i] = counter_sum(i * sizeof(atomic_uint_least64_t));
+    }
+    slot->checksum = checkpoint_checksum(slot);
+
+    if (msync(slot, CHECKPOINT_SLOT_SIZE, MS_SYNC) != 0) {
+        perror("Checkpoint flush failed");
+    }
+}
+
+/**
+ * Computes the FNV-1a hash of a checkpoint slot, excluding the checksum itself.
+ *
+ * @param slot The slot to hash.
+ * @return The 64-bit hash.
+ */
+uint64_t checkpoint_checksum(const checkpoint_slot *slot) {
+    const unsigned char *bytes = (const unsigned char *)slot;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < offsetof(checkpoint_slot, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
 /**
  * Sets up signal handling for SIGINT to trigger stats display.
+ * Client sockets are written with MSG_NOSIGNAL, but SIGPIPE is ignored as
+ * well so that a client vanishing mid-reply can never kill the server.
  */
 void setup_signal_handler() {
     struct sigaction sigint_action = {
@@ -55,11 +981,15 @@ void setup_signal_handler() {
         perror("Signal handler registration failed");
         exit(EXIT_FAILURE);
     }
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror("Signal handler registration failed");
+        exit(EXIT_FAILURE);
+    }
 }
 
 /**
- * Initializes the server socket, binds it, listens for connections,
- * and resets the printable character statistics.
+ * Initializes the server socket, binds it and listens for connections.
+ * The socket is non-blocking so that it can be driven by epoll.
  *
  * @param server_fd Pointer to the socket file descriptor to initialize.
  * @param port String representation of the port number to bind to.
@@ -68,7 +998,7 @@ void setup_server(int *server_fd, const char *port) {
     int enable = 1;
     struct sockaddr_in server_address;
 
-    *server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    *server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (*server_fd < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
@@ -89,144 +1019,1054 @@ void setup_server(int *server_fd, const char *port) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(*server_fd, 10) != 0) {
+    if (listen(*server_fd, LISTEN_BACKLOG) != 0) {
         perror("Listen failed");
         exit(EXIT_FAILURE);
     }
-
-    memset(pcc_total, 0, sizeof(pcc_total));
 }
 
 /**
  * Signal handler for SIGINT. If no client is connected,
  * displays the printable character statistics and exits.
+ * Otherwise the server stops accepting and exits once the connected
+ * clients are served. Prefork workers exit silently instead, and the
+ * prefork parent forwards the signal to its workers and prints once they
+ * have all finished.
  *
  * @param signum The signal number received (expected: SIGINT).
  */
 void handle_SIGINT(int signum) {
-    if (client_socket_fd == -1) {
+    if (worker_pids != NULL && !is_worker_process) {
+        for (int i = 0; i < num_workers; i++) {
+            if (worker_pids[i] > 0) {
+                kill(worker_pids[i], SIGINT);
+            }
+        }
+    } else if (active_connections == 0) {
+        if (is_worker_process) {
+            _exit(0);
+        }
         display_statistics();
     }
     is_server_running = 0;
 }
 
 /**
- * Main server loop that accepts and handles client connections
- * until a termination signal is received.
+ * Main server loop: an epoll-driven state machine that serves all
+ * connected clients concurrently with non-blocking I/O. A client that
+ * stalls is dropped when its idle or total deadline passes, and its
+ * partial histogram is discarded, so it can no longer hold up the others.
+ * Runs until a termination signal is received and no clients remain.
  *
  * @param server_fd The listening socket file descriptor.
  */
 void server_loop(int server_fd) {
-    while (is_server_running) {
-        client_socket_fd = accept(server_fd, NULL, NULL);
-        if (client_socket_fd < 0) {
-            perror("Accept failed");
-            continue;
-        }
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event server_event = {
+        .events = EPOLLIN | EPOLLEXCLUSIVE,
+        .data.ptr = NULL
+    };
+    int listening = 1;
 
-        handle_client_connection(client_socket_fd);
+    if (pcc_pool_init(&buffer_pool, 1, BUFFER_SIZE, config.huge_pages ? PCC_POOL_HUGE : 0) < 0) {
+        perror("Buffer allocation failed");
+        exit(EXIT_FAILURE);
+    }
 
-        close(client_socket_fd);
-        client_socket_fd = -1;
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll creation failed");
+        exit(EXIT_FAILURE);
+    }
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &server_event) < 0) {
+        perror("epoll registration failed");
+        exit(EXIT_FAILURE);
     }
-}
 
-/**
- * Processes a single client connection:
- * receives file data, calculates printable characters,
- * sends the result, and updates global statistics.
- *
- * @param client_fd The socket file descriptor for the connected client.
- */
-void handle_client_connection(int client_fd) {
-    uint32_t temp_pcc_total[95] = {0};
-    uint32_t file_size = 0, printable_count = 0;
+    while (is_server_running || active_connections > 0) {
+        if (listening && !is_server_running) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_fd, NULL);
+            listening = 0;
+        }
 
-    receive_data(client_fd, &file_size, &printable_count, temp_pcc_total);
-    send_printable_count(client_fd, printable_count);
+        uint64_t now = now_ns();
+        int timeout = expire_connections(now);
+        int wake = release_throttled(epoll_fd, now);
+        if (wake >= 0 && (timeout < 0 || wake < timeout)) {
+            timeout = wake;
+        }
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
 
-    for (int i = 0; i < 95; i++) {
-        pcc_total[i] += temp_pcc_total[i];
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                if (listening) {
+                    accept_clients(epoll_fd, server_fd);
+                }
+            } else {
+                handle_connection_event(epoll_fd, events[i].data.ptr, events[i].events);
+            }
+        }
     }
+
+    close(epoll_fd);
+    pcc_pool_destroy(&buffer_pool);
 }
 
 /**
- * Receives the file size and contents from the client,
- * counts printable characters, and populates a temporary character count table.
+ * Prefork mode: forks the workers, each of which accepts on the shared
+ * listening socket and serves clients independently, then supervises them.
+ * A worker that dies while the server is running is replaced in the same
+ * counter block, so counts of the clients it completed are kept.
  *
- * @param client_fd The socket file descriptor connected to the client.
- * @param file_size Output: pointer to where the received file size will be stored (host byte order).
- * @param printable_count Output: pointer to store the count of printable characters.
- * @param temp_pcc_total Output: array storing per-character printable counts (for ASCII 32-126).
+ * @param server_fd The listening socket file descriptor.
+ * @param workers Number of worker processes.
  */
-void receive_data(int client_fd, uint32_t *file_size, uint32_t *printable_count, uint32_t temp_pcc_total[95]) {
-    int total_received = 0, remaining = 4, cur_received;
-    char buffer[BUFFER_SIZE];
+void run_prefork(int server_fd, int workers) {
+    int live = 0, status;
+    pid_t pid;
 
-    // Receive 4-byte file size
-    while (remaining > 0) {
-        cur_received = read(client_fd, (char *)file_size + total_received, remaining);
-        if (cur_received <= 0) {
-            perror("Error receiving file size");
-            close(client_fd);
-            exit(EXIT_FAILURE);
+    worker_pids = calloc(workers, sizeof(pid_t));
+    if (worker_pids == NULL) {
+        perror("Worker table allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    num_workers = workers;
+
+    for (int i = 0; i < workers; i++) {
+        worker_pids[i] = spawn_worker(server_fd, i);
+        live++;
+    }
+
+    while (live > 0) {
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid failed");
+            break;
+        }
+
+        for (int i = 0; i < workers; i++) {
+            if (worker_pids[i] != pid) {
+                continue;
+            }
+            if (is_server_running && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+                fprintf(stderr, "Worker %d (pid %d) died, restarting\n", i, (int)pid);
+                worker_pids[i] = spawn_worker(server_fd, i);
+            } else {
+                worker_pids[i] = -1;
+                live--;
+            }
+            break;
         }
-        total_received += cur_received;
-        remaining -= cur_received;
     }
-    *file_size = ntohl(*file_size);
+}
 
-    // Receive file content
-    remaining = *file_size;
-    while (remaining > 0) {
-        int chunk_size = BUFFER_SIZE < remaining ? BUFFER_SIZE : remaining;
-        cur_received = read(client_fd, buffer, chunk_size);
-        if (cur_received <= 0) {
-            perror("Error receiving file content");
-            close(client_fd);
+/**
+ * Forks a worker process that serves clients into its own counter block.
+ *
+ * @param server_fd The listening socket file descriptor.
+ * @param block Index of the counter block owned by the worker.
+ * @return The worker's process ID.
+ */
+pid_t spawn_worker(int server_fd, int block) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        is_worker_process = 1;
+        own_block = &counter_blocks[block];
+        if (is_server_running) {
+            server_loop(server_fd);
+        }
+        _exit(0);
+    }
+    return pid;
+}
+
+/**
+ * Worker pool mode: the main thread only accepts, and hands each client to
+ * a fixed pool of threads through the hw4 FIFO queue. Waiting workers are
+ * woken in arrival order, so no worker starves. A slow upload ties up one
+ * worker, not the acceptor, and clients queue instead of being refused.
+ * On shutdown the acceptor stops, queued clients are still served, and
+ * one NULL per worker is enqueued to stop the pool.
+ *
+ * @param server_fd The listening socket file descriptor.
+ * @param workers Number of worker threads.
+ */
+void run_worker_pool(int server_fd, int workers) {
+    thrd_t *threads = calloc(workers, sizeof(thrd_t));
+    if (threads == NULL) {
+        perror("Worker table allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pcc_pool_init(&buffer_pool, workers, BUFFER_SIZE, config.huge_pages ? PCC_POOL_HUGE : 0) < 0) {
+        perror("Buffer allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    initQueue();
+    for (int i = 0; i < workers; i++) {
+        start_thread(&threads[i], pool_worker_main, &counter_blocks[i + 1]);
+    }
+
+    own_block = &counter_blocks[0];
+    accept_and_enqueue(server_fd);
+
+    for (int i = 0; i < workers; i++) {
+        enqueue(NULL);
+    }
+    for (int i = 0; i < workers; i++) {
+        thrd_join(threads[i], NULL);
+    }
+    destroyQueue();
+    pcc_pool_destroy(&buffer_pool);
+    free(threads);
+}
+
+/**
+ * Acceptor of the worker pool: accepts clients and enqueues them until a
+ * termination signal arrives. SIGINT is only unblocked inside ppoll, so a
+ * signal arriving between the check and the wait is not lost.
+ *
+ * @param server_fd The listening socket file descriptor.
+ */
+void accept_and_enqueue(int server_fd) {
+    struct pollfd server_poll = { .fd = server_fd, .events = POLLIN };
+    sigset_t blocked, unblocked;
+
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &unblocked);
+
+    while (is_server_running) {
+        if (ppoll(&server_poll, 1, NULL, &unblocked) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
             exit(EXIT_FAILURE);
         }
 
-        for (int i = 0; i < cur_received; i++) {
-            if (buffer[i] >= 32 && buffer[i] <= 126) {
-                temp_pcc_total[(int)(buffer[i]) - 32]++;
-                (*printable_count)++;
+        while (1) {
+            // Workers serve with blocking I/O, bounded by socket timeouts
+            int client_fd = accept4(server_fd, NULL, NULL, 0);
+            if (client_fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("Accept failed");
+                }
+                break;
+            }
+
+            connection *conn = calloc(1, sizeof(connection));
+            if (conn == NULL) {
+                perror("Connection allocation failed");
+                close(client_fd);
+                break;
             }
+            conn->fd = client_fd;
+            conn->state = CONN_READ_SIZE;
+            conn->accepted_ns = conn->active_ns = conn->refill_ns = now_ns();
+            conn->tokens = bucket_size();
+
+            active_connections++;
+            counter_add(&own_block->accepted, 1);
+            enqueue(conn);
         }
+    }
 
-        remaining -= cur_received;
+    pthread_sigmask(SIG_SETMASK, &unblocked, NULL);
+}
+
+/**
+ * Worker pool thread: serves queued clients one at a time, recording how
+ * long each waited in the queue, until it dequeues NULL.
+ *
+ * @param arg This worker's counter block.
+ * @return 0.
+ */
+int pool_worker_main(void *arg) {
+    connection *conn;
+
+    own_block = arg;
+    while ((conn = dequeue()) != NULL) {
+        uint64_t wait_ns = now_ns() - conn->accepted_ns;
+        counter_add(&own_block->dequeued, 1);
+        counter_add(&own_block->queue_wait_ns, wait_ns);
+        record_log2_us(own_block->queue_wait, wait_ns);
+        serve_connection(conn);
     }
+    return 0;
+}
+
+/**
+ * Serves one client to the end with blocking I/O, through the same
+ * receive and reply steps as the event loop. The idle deadline becomes a
+ * socket timeout; the total deadline and the rate cap are checked between
+ * reads.
+ *
+ * @param conn The connection, in state CONN_READ_SIZE.
+ */
+void serve_connection(connection *conn) {
+    struct timeval timeout = {
+        .tv_sec = config.idle_timeout_ms / 1000,
+        .tv_usec = (config.idle_timeout_ms % 1000) * 1000
+    };
+    uint64_t budget, now;
+    int result = 0;
+
+    if (config.idle_timeout_ms > 0) {
+        setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    while (conn->state != CONN_WRITE_COUNT || conn->io < conn->reply_length) {
+        now = now_ns();
+        if (config.total_timeout_ms > 0 && now - conn->accepted_ns > config.total_timeout_ms * NS_PER_MS) {
+            result = 0;
+            break;
+        }
+
+        switch (conn->state) {
+        case CONN_READ_SIZE:
+            result = receive_size(conn);
+            break;
+        case CONN_READ_EXTENDED:
+            result = receive_extended_header(conn);
+            break;
+        case CONN_READ_DATA:
+            budget = read_budget(conn, now);
+            if (budget == 0) {
+                uint64_t sleep_ns = (uint64_t)((double)bucket_size() * NS_PER_SEC / config.rate_limit);
+                thrd_sleep(&(struct timespec){ .tv_sec = sleep_ns / NS_PER_SEC, .tv_nsec = sleep_ns % NS_PER_SEC }, NULL);
+                continue;
+            }
+            result = receive_content(conn, budget);
+            if (result > 0 && config.rate_limit > 0) {
+                conn->tokens -= result;
+            }
+            break;
+        case CONN_WRITE_COUNT:
+        default:
+            result = send_reply(conn);
+            break;
+        }
 
-    *printable_count = htonl(*printable_count);
+        // On a blocking socket, nothing read or sent means the idle timeout expired
+        if (result <= 0) {
+            break;
+        }
+        if (conn->state == CONN_WRITE_COUNT && conn->reply_length == 0) {
+            build_reply(conn);
+        }
+    }
+
+    if (conn->state == CONN_WRITE_COUNT && conn->io == conn->reply_length && conn->reply_length > 0) {
+        commit_counts(conn);
+    } else if (result == 0) {
+        counter_add(&own_block->timed_out, 1);
+    }
+    close(conn->fd);
+    free(conn->frame);
+    free(conn);
+    active_connections--;
+    counter_add(&own_block->closed, 1);
 }
 
 /**
- * Sends the number of printable characters back to the client.
+ * Accepts every pending connection and registers it with epoll.
  *
- * @param client_fd The socket file descriptor connected to the client.
- * @param printable_count The printable character count to send (in network byte order).
+ * @param epoll_fd The epoll instance of the server loop.
+ * @param server_fd The listening socket file descriptor.
  */
-void send_printable_count(int client_fd, uint32_t printable_count) {
-    int total_sent = 0, remaining = 4, cur_sent;
+void accept_clients(int epoll_fd, int server_fd) {
+    while (1) {
+        int client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Accept failed");
+            }
+            return;
+        }
 
-    while (remaining > 0) {
-        cur_sent = write(client_fd, (char *)&printable_count + total_sent, remaining);
-        if (cur_sent <= 0) {
-            perror("Error sending printable count");
+        connection *conn = calloc(1, sizeof(connection));
+        if (conn == NULL) {
+            perror("Connection allocation failed");
             close(client_fd);
-            exit(EXIT_FAILURE);
+            return;
+        }
+        conn->fd = client_fd;
+        conn->state = CONN_READ_SIZE;
+        conn->accepted_ns = conn->active_ns = conn->refill_ns = now_ns();
+        conn->tokens = bucket_size();
+
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = conn
+        };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+            perror("epoll registration failed");
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+
+        list_append(&idle_list, conn);
+        list_append(&age_list, conn);
+        active_connections++;
+        counter_add(&own_block->accepted, 1);
+    }
+}
+
+/**
+ * Advances the state machine of a connection that epoll reported ready.
+ * Connections are scheduled deficit round robin: each epoll round a ready
+ * connection reads at most one quantum, further capped by its token bucket
+ * when a rate limit is set. Since reads are byte-granular there is never a
+ * deficit to carry over, so a small upload completes in its first round or
+ * two no matter how many large uploads are streaming alongside it.
+ * A throttled connection is out of the interest set, but epoll still
+ * reports hangups and errors on it; those close it.
+ *
+ * @param epoll_fd The epoll instance of the server loop.
+ * @param conn The ready connection.
+ * @param events The epoll events reported for it.
+ */
+void handle_connection_event(int epoll_fd, connection *conn, uint32_t events) {
+    int was_writing = conn->state == CONN_WRITE_COUNT;
+    uint64_t budget;
+    int result;
+
+    if (conn->throttled) {
+        if (events & (EPOLLHUP | EPOLLERR)) {
+            close_connection(conn);
+        }
+        return;
+    }
+
+    switch (conn->state) {
+    case CONN_READ_SIZE:
+        result = receive_size(conn);
+        break;
+    case CONN_READ_EXTENDED:
+        result = receive_extended_header(conn);
+        break;
+    case CONN_READ_DATA:
+        budget = read_budget(conn, now_ns());
+        if (budget == 0) {
+            throttle_connection(epoll_fd, conn, now_ns());
+            return;
+        }
+        result = receive_content(conn, budget);
+        if (result > 0 && config.rate_limit > 0) {
+            conn->tokens -= result;
+            if (conn->tokens == 0 && conn->state == CONN_READ_DATA) {
+                throttle_connection(epoll_fd, conn, now_ns());
+            }
+        }
+        break;
+    case CONN_WRITE_COUNT:
+    default:
+        result = send_reply(conn);
+        break;
+    }
+
+    if (result < 0) {
+        close_connection(conn);
+        return;
+    }
+
+    if (result > 0) {
+        conn->active_ns = now_ns();
+        list_remove(&idle_list, conn);
+        list_append(&idle_list, conn);
+    }
+
+    if (!was_writing && conn->state == CONN_WRITE_COUNT) {
+        // Usually the reply fits in the socket buffer right away
+        build_reply(conn);
+        result = send_reply(conn);
+        if (result < 0) {
+            close_connection(conn);
+            return;
+        }
+        if (conn->io < conn->reply_length) {
+            struct epoll_event event = {
+                .events = EPOLLOUT,
+                .data.ptr = conn
+            };
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        }
+    }
+
+    if (conn->state == CONN_WRITE_COUNT && conn->io == conn->reply_length) {
+        commit_counts(conn);
+        close_connection(conn);
+    }
+}
+
+/**
+ * Receives (part of) the 4-byte file size. A size of PCC_EXTENDED_MAGIC
+ * means an extended header follows; anything else is a legacy request,
+ * served in PCC_MODE_PRINTABLE with a 4-byte reply. A legacy upload of
+ * exactly PCC_EXTENDED_MAGIC bytes is therefore no longer served; see pcc_proto.h.
+ *
+ * @param conn The connection in state CONN_READ_SIZE.
+ * @return Bytes received, 0 if the socket had nothing to read, -1 if the connection failed.
+ */
+int receive_size(connection *conn) {
+    ssize_t cur_received = read(conn->fd, (char *)&conn->net_value + conn->io, sizeof(conn->net_value) - conn->io);
+    if (cur_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (cur_received == 0) {
+        fprintf(stderr, "Error receiving file size: connection closed by client\n");
+        return -1;
+    }
+    if (cur_received < 0) {
+        perror("Error receiving file size");
+        return -1;
+    }
+
+    counter_add(&own_block->bytes_received, cur_received);
+    conn->io += cur_received;
+    if (conn->io == sizeof(conn->net_value)) {
+        conn->io = 0;
+        if (ntohl(conn->net_value) == PCC_EXTENDED_MAGIC) {
+            conn->state = CONN_READ_EXTENDED;
+            return cur_received;
+        }
+        conn->mode = PCC_MODE_PRINTABLE;
+        conn->remaining = ntohl(conn->net_value);
+        conn->state = conn->remaining > 0 ? CONN_READ_DATA : CONN_WRITE_COUNT;
+    }
+    return cur_received;
+}
+
+/**
+ * Receives (part of) the extended header: the counting mode and flags,
+ * and the 8-byte file size. Unknown modes or flags drop the connection.
+ *
+ * @param conn The connection in state CONN_READ_EXTENDED.
+ * @return Bytes received, 0 if the socket had nothing to read, -1 if the connection failed.
+ */
+int receive_extended_header(connection *conn) {
+    ssize_t cur_received = read(conn->fd, conn->header + conn->io, PCC_EXTENDED_HEADER_SIZE - conn->io);
+    if (cur_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (cur_received == 0) {
+        fprintf(stderr, "Error receiving extended header: connection closed by client\n");
+        return -1;
+    }
+    if (cur_received < 0) {
+        perror("Error receiving extended header");
+        return -1;
+    }
+
+    counter_add(&own_block->bytes_received, cur_received);
+    conn->io += cur_received;
+    if (conn->io < PCC_EXTENDED_HEADER_SIZE) {
+        return cur_received;
+    }
+
+    uint32_t mode_flags;
+    uint64_t size;
+    memcpy(&mode_flags, conn->header, sizeof(mode_flags));
+    memcpy(&size, conn->header + sizeof(mode_flags), sizeof(size));
+    mode_flags = ntohl(mode_flags);
+
+    conn->mode = mode_flags & PCC_MODE_MASK;
+    if (conn->mode >= PCC_NUM_MODES || (mode_flags & ~PCC_MODE_MASK & ~PCC_SUPPORTED_FLAGS) != 0) {
+        fprintf(stderr, "Unsupported counting mode or flags: 0x%08x\n", mode_flags);
+        return -1;
+    }
+    conn->extended = 1;
+    conn->compressed = (mode_flags & PCC_FLAG_LZ) != 0;
+    if (conn->compressed && conn->frame == NULL) {
+        conn->frame = malloc(PCC_FRAME_HEADER_SIZE + PCC_LZ_BOUND(PCC_LZ_BLOCK_SIZE));
+        if (conn->frame == NULL) {
+            perror("Frame buffer allocation failed");
+            return -1;
+        }
+    }
+    conn->remaining = be64toh(size);
+    conn->state = conn->remaining > 0 ? CONN_READ_DATA : CONN_WRITE_COUNT;
+    conn->io = 0;
+    pcc_utf8_init(&conn->utf8);
+    return cur_received;
+}
+
+/**
+ * Receives the next chunk of file content and counts it: the byte
+ * histogram always, which yields the printable counts of every mode, and
+ * the UTF-8 classes when the client asked for them.
+ *
+ * @param conn The connection in state CONN_READ_DATA.
+ * @param budget Maximum number of bytes to read.
+ * @return Bytes received, 0 if the socket had nothing to read, -1 if the connection failed.
+ */
+int receive_content(connection *conn, uint64_t budget) {
+    if (conn->compressed) {
+        return receive_frame(conn, budget);
+    }
+
+    uint64_t chunk_size = BUFFER_SIZE < conn->remaining ? BUFFER_SIZE : conn->remaining;
+    chunk_size = budget < chunk_size ? budget : chunk_size;
+    unsigned char *buffer = pcc_pool_get(&buffer_pool);
+    ssize_t cur_received = read(conn->fd, buffer, chunk_size);
+    if (cur_received <= 0) {
+        int read_errno = errno;
+        pcc_pool_put(&buffer_pool, buffer);
+        errno = read_errno;
+    }
+    if (cur_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (cur_received == 0) {
+        fprintf(stderr, "Error receiving file content: connection closed by client\n");
+        return -1;
+    }
+    if (cur_received < 0) {
+        perror("Error receiving file content");
+        return -1;
+    }
+
+    uint64_t count_start = now_ns();
+    pcc_count_bytes(buffer, cur_received, conn->histogram);
+    if (conn->mode == PCC_MODE_UTF8) {
+        pcc_utf8_scan(&conn->utf8, buffer, cur_received, &conn->multibyte, &conn->invalid);
+    }
+    pcc_pool_put(&buffer_pool, buffer);
+    counter_add(&own_block->count_ns, now_ns() - count_start);
+    counter_add(&own_block->bytes_counted, cur_received);
+    counter_add(&own_block->bytes_received, cur_received);
+
+    note_received(conn, cur_received);
+    conn->remaining -= cur_received;
+    if (conn->remaining == 0) {
+        conn->state = CONN_WRITE_COUNT;
+        conn->io = 0;
+    }
+    return cur_received;
+}
+
+/**
+ * Receives (part of) the next LZ frame. Once a frame is complete it is
+ * decompressed into a pool buffer with the byte histogram counted as the
+ * output is produced, so every block is touched once while still in L1;
+ * a stored frame is counted in place. Frame lengths come from the client
+ * and are checked before anything is read into the frame buffer.
+ *
+ * @param conn The connection in state CONN_READ_DATA, with compressed set.
+ * @param budget Maximum number of bytes to read.
+ * @return Bytes received, 0 if the socket had nothing to read, -1 if the connection failed.
+ */
+int receive_frame(connection *conn, uint64_t budget) {
+    uint32_t lengths[2];
+    size_t raw_length = 0, stored_length = 0;
+
+    if (conn->frame_io >= PCC_FRAME_HEADER_SIZE) {
+        memcpy(lengths, conn->frame, sizeof(lengths));
+        raw_length = ntohl(lengths[0]);
+        stored_length = ntohl(lengths[1]);
+    }
+    size_t wanted = conn->frame_io < PCC_FRAME_HEADER_SIZE ? PCC_FRAME_HEADER_SIZE - conn->frame_io
+                                                           : PCC_FRAME_HEADER_SIZE + stored_length - conn->frame_io;
+    wanted = budget < wanted ? budget : wanted;
+
+    ssize_t cur_received = read(conn->fd, conn->frame + conn->frame_io, wanted);
+    if (cur_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (cur_received == 0) {
+        fprintf(stderr, "Error receiving file content: connection closed by client\n");
+        return -1;
+    }
+    if (cur_received < 0) {
+        perror("Error receiving file content");
+        return -1;
+    }
+    counter_add(&own_block->bytes_received, cur_received);
+    note_received(conn, cur_received);
+    conn->frame_io += cur_received;
+
+    if (conn->frame_io == PCC_FRAME_HEADER_SIZE) {
+        memcpy(lengths, conn->frame, sizeof(lengths));
+        raw_length = ntohl(lengths[0]);
+        stored_length = ntohl(lengths[1]);
+        if (raw_length == 0 || raw_length > PCC_LZ_BLOCK_SIZE || raw_length > conn->remaining ||
+            stored_length == 0 || stored_length > PCC_LZ_BOUND(raw_length)) {
+            fprintf(stderr, "Invalid frame lengths: %zu raw, %zu stored\n", raw_length, stored_length);
+            return -1;
         }
-        total_sent += cur_sent;
-        remaining -= cur_sent;
+    }
+    if (conn->frame_io < PCC_FRAME_HEADER_SIZE + stored_length || stored_length == 0) {
+        return cur_received;
+    }
+
+    uint64_t count_start = now_ns();
+    unsigned char *data = conn->frame + PCC_FRAME_HEADER_SIZE;
+    unsigned char *buffer = NULL;
+    if (stored_length == raw_length) {
+        pcc_count_bytes(data, raw_length, conn->histogram);
+    } else {
+        buffer = pcc_pool_get(&buffer_pool);
+        long decompressed = pcc_lz_decompress_count(data, stored_length, buffer, raw_length, conn->histogram);
+        if (decompressed != (long)raw_length) {
+            pcc_pool_put(&buffer_pool, buffer);
+            fprintf(stderr, "Error decompressing file content: malformed frame\n");
+            return -1;
+        }
+        data = buffer;
+    }
+    if (conn->mode == PCC_MODE_UTF8) {
+        pcc_utf8_scan(&conn->utf8, data, raw_length, &conn->multibyte, &conn->invalid);
+    }
+    if (buffer != NULL) {
+        pcc_pool_put(&buffer_pool, buffer);
+    }
+    counter_add(&own_block->count_ns, now_ns() - count_start);
+    counter_add(&own_block->bytes_counted, raw_length);
+
+    conn->frame_io = 0;
+    conn->remaining -= raw_length;
+    if (conn->remaining == 0) {
+        conn->state = CONN_WRITE_COUNT;
+        conn->io = 0;
+    }
+    return cur_received;
+}
+
+/**
+ * Tracks content bytes read off the socket, and sizes the receive buffer
+ * once enough of the transfer has been seen to estimate its bandwidth.
+ *
+ * @param conn The connection in state CONN_READ_DATA.
+ * @param bytes Bytes just read.
+ */
+void note_received(connection *conn, size_t bytes) {
+    conn->received += bytes;
+    if (!conn->autosized && conn->received >= PCC_AUTOSIZE_AFTER) {
+        pcc_autosize_buffer(conn->fd, SO_RCVBUF, conn->received, now_ns() - conn->accepted_ns);
+        conn->autosized = 1;
     }
 }
 
 /**
- * Prints and exits with the full printable character histogram.
+ * @return Capacity of a connection's token bucket: one quantum, or a tenth
+ *         of a second's worth of tokens if the rate limit makes that smaller.
+ */
+uint64_t bucket_size(void) {
+    if (config.rate_limit == 0 || config.rate_limit / 10 >= config.quantum) {
+        return config.quantum;
+    }
+    return config.rate_limit >= 10 ? config.rate_limit / 10 : 1;
+}
+
+/**
+ * Computes how many content bytes a connection may read this round:
+ * one quantum, or fewer if its token bucket holds less. Tokens refill at
+ * the configured rate up to the bucket size, so a throttled client cannot
+ * save up a burst.
+ *
+ * @param conn The connection in state CONN_READ_DATA.
+ * @param now The current time in nanoseconds.
+ * @return The read budget in bytes, 0 if the connection must wait for tokens.
+ */
+uint64_t read_budget(connection *conn, uint64_t now) {
+    if (config.rate_limit == 0) {
+        return config.quantum;
+    }
+
+    uint64_t refill = (uint64_t)((double)(now - conn->refill_ns) * config.rate_limit / NS_PER_SEC);
+    if (refill > 0) {
+        conn->tokens = conn->tokens + refill < bucket_size() ? conn->tokens + refill : bucket_size();
+        conn->refill_ns = now;
+    }
+    return conn->tokens;
+}
+
+/**
+ * Parks a connection that has run out of tokens: it is removed from the
+ * epoll interest set until its bucket has been refilled. Every connection is parked
+ * with an empty bucket, so wake times follow parking order and the
+ * throttle list stays sorted. A connection already parked is left as it is.
+ *
+ * @param epoll_fd The epoll instance of the server loop.
+ * @param conn The connection to park.
+ * @param now The current time in nanoseconds.
+ */
+void throttle_connection(int epoll_fd, connection *conn, uint64_t now) {
+    struct epoll_event event = {
+        .events = 0,
+        .data.ptr = conn
+    };
+
+    if (conn->throttled) {
+        return;
+    }
+    conn->wake_ns = now + (uint64_t)((double)bucket_size() * NS_PER_SEC / config.rate_limit);
+    conn->throttled = 1;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    list_append(&throttle_list, conn);
+}
+
+/**
+ * Resumes every throttled connection whose wake time has passed.
+ * Waiting for tokens counts as progress, so it never trips the idle deadline.
+ *
+ * @param epoll_fd The epoll instance of the server loop.
+ * @param now The current time in nanoseconds.
+ * @return Milliseconds until the next wake time, or -1 if nothing is throttled.
+ */
+int release_throttled(int epoll_fd, uint64_t now) {
+    while (throttle_list.head != NULL && throttle_list.head->wake_ns <= now) {
+        connection *conn = throttle_list.head;
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = conn
+        };
+
+        list_remove(&throttle_list, conn);
+        conn->throttled = 0;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->active_ns = now;
+        list_remove(&idle_list, conn);
+        list_append(&idle_list, conn);
+    }
+
+    if (throttle_list.head == NULL) {
+        return -1;
+    }
+    return (int)((throttle_list.head->wake_ns - now + NS_PER_MS - 1) / NS_PER_MS);
+}
+
+/**
+ * Encodes the reply: a 4-byte printable count for a legacy request, or an
+ * 8-byte count plus the mode's byte or class counts for an extended one.
+ *
+ * @param conn The connection whose content has been received.
+ */
+void build_reply(connection *conn) {
+    uint64_t printable_count = pcc_printable_count(conn->histogram);
+    uint64_t classes[PCC_UTF8_CLASSES];
+    uint64_t *values = NULL;
+    int num_values = 0;
+
+    if (!conn->extended) {
+        uint32_t net_count = htonl((uint32_t)printable_count);
+        memcpy(conn->reply, &net_count, sizeof(net_count));
+        conn->reply_length = sizeof(net_count);
+        return;
+    }
+
+    if (conn->mode == PCC_MODE_BYTES) {
+        values = conn->histogram;
+        num_values = 256;
+    } else if (conn->mode == PCC_MODE_UTF8) {
+        pcc_utf8_finish(&conn->utf8, &conn->invalid);
+        pcc_utf8_classes(conn->histogram, conn->multibyte, conn->invalid, classes);
+        values = classes;
+        num_values = PCC_UTF8_CLASSES;
+    }
+
+    uint64_t net_value = htobe64(printable_count);
+    memcpy(conn->reply, &net_value, sizeof(net_value));
+    for (int i = 0; i < num_values; i++) {
+        net_value = htobe64(values[i]);
+        memcpy(conn->reply + sizeof(net_value) * (i + 1), &net_value, sizeof(net_value));
+    }
+    conn->reply_length = PCC_REPLY_SIZE(conn->mode);
+}
+
+/**
+ * Sends (the rest of) the reply back to the client.
+ *
+ * @param conn The connection in state CONN_WRITE_COUNT.
+ * @return Bytes sent, 0 if the socket buffer was full, -1 if the connection failed.
+ */
+int send_reply(connection *conn) {
+    ssize_t cur_sent = send(conn->fd, conn->reply + conn->io, conn->reply_length - conn->io, MSG_NOSIGNAL);
+    if (cur_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (cur_sent <= 0) {
+        perror("Error sending printable count");
+        return -1;
+    }
+    conn->io += cur_sent;
+    return cur_sent;
+}
+
+/**
+ * Adds the counts and request latency of a fully served client to this
+ * process's counter block.
+ *
+ * @param conn The connection whose reply has been sent.
+ */
+void commit_counts(connection *conn) {
+    uint64_t latency_ns = now_ns() - conn->accepted_ns;
+
+    for (int i = 0; i < 95; i++) {
+        counter_add(&own_block->pcc_total[i], conn->histogram[i + 32]);
+    }
+
+    record_log2_us(own_block->latency, latency_ns);
+    counter_add(&own_block->latency_sum_ns, latency_ns);
+    counter_add(&own_block->completed, 1);
+    window_record(conn);
+}
+
+/**
+ * Adds one to the log2 microsecond bucket of a duration.
+ *
+ * @param buckets LATENCY_BUCKETS counters, bucket i holding durations under 2^i us.
+ * @param ns The duration in nanoseconds.
+ */
+void record_log2_us(atomic_uint_least64_t *buckets, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    while (bucket < LATENCY_BUCKETS - 1 && us >= (1ULL << bucket)) {
+        bucket++;
+    }
+    counter_add(&buckets[bucket], 1);
+}
+
+/**
+ * Closes a connection, unlinks it from the deadline lists and frees it.
+ * Closing the socket also removes it from the epoll set.
+ *
+ * @param conn The connection to close.
+ */
+void close_connection(connection *conn) {
+    list_remove(&idle_list, conn);
+    list_remove(&age_list, conn);
+    if (conn->throttled) {
+        list_remove(&throttle_list, conn);
+    }
+    close(conn->fd);
+    free(conn->frame);
+    free(conn);
+    active_connections--;
+    counter_add(&own_block->closed, 1);
+}
+
+/**
+ * Drops every connection whose idle or total deadline has passed.
+ *
+ * @param now The current time in nanoseconds.
+ * @return Milliseconds until the next deadline, or -1 if there is none.
+ */
+int expire_connections(uint64_t now) {
+    uint64_t idle_ns = config.idle_timeout_ms * NS_PER_MS;
+    uint64_t total_ns = config.total_timeout_ms * NS_PER_MS;
+    uint64_t next = UINT64_MAX;
+
+    if (idle_ns > 0) {
+        while (idle_list.head != NULL && now - idle_list.head->active_ns >= idle_ns) {
+            fprintf(stderr, "Client idle for more than %" PRIu64 " ms, dropping it\n", config.idle_timeout_ms);
+            counter_add(&own_block->timed_out, 1);
+            close_connection(idle_list.head);
+        }
+        if (idle_list.head != NULL) {
+            next = idle_list.head->active_ns + idle_ns;
+        }
+    }
+
+    if (total_ns > 0) {
+        while (age_list.head != NULL && now - age_list.head->accepted_ns >= total_ns) {
+            fprintf(stderr, "Client transfer exceeded %" PRIu64 " ms, dropping it\n", config.total_timeout_ms);
+            counter_add(&own_block->timed_out, 1);
+            close_connection(age_list.head);
+        }
+        if (age_list.head != NULL && age_list.head->accepted_ns + total_ns < next) {
+            next = age_list.head->accepted_ns + total_ns;
+        }
+    }
+
+    if (next == UINT64_MAX) {
+        return -1;
+    }
+    return (int)((next - now + NS_PER_MS - 1) / NS_PER_MS);
+}
+
+/**
+ * Appends a connection to the tail of a list.
+ *
+ * @param list The list to append to.
+ * @param conn The connection, which must not already be on the list.
+ */
+void list_append(conn_list *list, connection *conn) {
+    conn->links[list->link].prev = list->tail;
+    conn->links[list->link].next = NULL;
+    if (list->tail != NULL) {
+        list->tail->links[list->link].next = conn;
+    } else {
+        list->head = conn;
+    }
+    list->tail = conn;
+}
+
+/**
+ * Unlinks a connection from a list.
+ *
+ * @param list The list to remove from.
+ * @param conn The connection, which must be on the list.
+ */
+void list_remove(conn_list *list, connection *conn) {
+    connection *prev = conn->links[list->link].prev;
+    connection *next = conn->links[list->link].next;
+
+    if (prev != NULL) {
+        prev->links[list->link].next = next;
+    } else {
+        list->head = next;
+    }
+    if (next != NULL) {
+        next->links[list->link].prev = prev;
+    } else {
+        list->tail = prev;
+    }
+    conn->links[list->link].prev = conn->links[list->link].next = NULL;
+}
+
+/**
+ * @return The current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Prints and exits with the full printable character histogram,
+ * summed over the counter blocks of all serving processes.
+ * A final checkpoint is written first when checkpointing is enabled.
  */
 void display_statistics() {
+    if (checkpoint_slots != NULL) {
+        write_checkpoint();
+    }
     for (int i = 0; i < 95; i++) {
-        printf("char '%c' : %u times\n", (char)(i + 32), pcc_total[i]);
+        uint64_t total = 0;
+        for (int b = 0; b < num_counter_blocks; b++) {
+            total += atomic_load_explicit(&counter_blocks[b].pcc_total[i], memory_order_relaxed);
+        }
+        printf("char '%c' : %" PRIu64 " times\n", (char)(i + 32), total);
     }
     exit(0);
 }
@@ -5,44 +5,397 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <err.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <threads.h>
 #include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "os.h"
+#include "vma.h"
 
 /* 2^20 pages ought to be enough for anybody */
 #define NPAGES	(1024*1024)
 
 static char* pages[NPAGES];
+static _Atomic uint64_t nalloc;
 
-uint64_t alloc_page_frame(void)
+/*
+ * With OS_FRAME_FILE=<path> in the environment, physical memory is a
+ * sparse file instead: frame n lives at offset n << 13, and the file is
+ * mapped a window at a time on demand. Only the NWINDOWS most recently
+ * used windows stay mapped, so a simulation can populate far more frames
+ * than fit in RAM and leave the paging to the page cache. A pointer from
+ * phys_to_virt stays valid until NWINDOWS - 1 other windows have been
+ * touched, which is plenty for a table walk.
+ */
+#define FILE_NPAGES	(1ULL << 32)	/* 32 TiB of sparse file */
+#define WINDOW_SHIFT	7		/* 128 frames (1 MiB) per window */
+#define WINDOW_FRAMES	(1ULL << WINDOW_SHIFT)
+#define WINDOW_BYTES	(WINDOW_FRAMES << 13)
+#define NWINDOWS	32
+
+static int frame_fd = -1;
+static uint64_t file_frames;	/* frames the file has been extended to */
+static uint16_t* window_slot;	/* window number -> windows[] index + 1, or 0 if unmapped */
+
+/* Mapped windows, kept in a doubly linked list from most to least recently used */
+static struct {
+	uint64_t window;
+	char* va;
+	int prev, next;
+} windows[NWINDOWS];
+static int nwindows, lru_head = -1, lru_tail = -1;
+
+/* Freed file-backed frames, reused last in first out */
+static uint64_t* file_free;
+static size_t nfile_free, file_free_cap;
+
+/*
+ * Anonymous frames come from a reserve of frames that are already faulted
+ * in and zeroed, so page_table_update never takes a page fault or clears
+ * a table itself. A background thread keeps the reserve topped up: fresh
+ * frames are mapped in batches with MAP_POPULATE, and freed frames are
+ * cleared with non-temporal stores that do not evict the simulation's
+ * working set from the cache. The reserve is a single-producer,
+ * single-consumer ring, so taking a frame is two atomic loads and a store.
+ * Frames are allocated by one thread only, as before.
+ */
+#define POOL_SIZE	1024	/* frames the reserve holds, a power of two */
+#define POOL_LOW	256	/* the zeroing thread is woken below this many */
+#define POOL_BATCH	64	/* frames zeroed or mapped per refill step */
+
+static struct {
+	uint64_t ready[POOL_SIZE];
+	_Atomic uint64_t head;		/* next frame to take, advanced by alloc_page_frame */
+	_Atomic uint64_t tail;		/* next free slot, advanced by the zeroing thread */
+	_Atomic int sleeping;		/* the zeroing thread is (about to be) waiting on wake */
+	mtx_t lock;			/* guards dirty and the zeroing thread's sleep */
+	cnd_t wake;
+	uint64_t* dirty;		/* freed frames waiting to be zeroed */
+	size_t ndirty, dirty_cap;
+} pool;
+
+static int zeroer_main(void* arg);
+
+static void frame_backend_init(void)
 {
-	static uint64_t nalloc;
-	uint64_t ppn;
-	void* va;
+	static int initialized;
+	const char* path;
+	thrd_t zeroer;
 
-	if (nalloc == NPAGES)
-		errx(1, "out of physical memory");
+	if (initialized)
+		return;
+	initialized = 1;
+
+	path = getenv("OS_FRAME_FILE");
+	if (path == NULL) {
+		if (mtx_init(&pool.lock, mtx_plain) != thrd_success || cnd_init(&pool.wake) != thrd_success ||
+		    thrd_create(&zeroer, zeroer_main, NULL) != thrd_success)
+			errx(1, "cannot start frame zeroing thread");
+		thrd_detach(zeroer);
+		return;
+	}
+
+	frame_fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (frame_fd < 0)
+		err(1, "cannot open frame file %s", path);
+
+	/* Untouched pages of the lookup table are never faulted in */
+	window_slot = calloc(FILE_NPAGES / WINDOW_FRAMES, sizeof(*window_slot));
+	if (window_slot == NULL)
+		err(1, "cannot allocate window table");
+}
+
+static void lru_unlink(int slot)
+{
+	if (windows[slot].prev >= 0)
+		windows[windows[slot].prev].next = windows[slot].next;
+	else
+		lru_head = windows[slot].next;
+	if (windows[slot].next >= 0)
+		windows[windows[slot].next].prev = windows[slot].prev;
+	else
+		lru_tail = windows[slot].prev;
+}
+
+static void lru_push_front(int slot)
+{
+	windows[slot].prev = -1;
+	windows[slot].next = lru_head;
+	if (lru_head >= 0)
+		windows[lru_head].prev = slot;
+	lru_head = slot;
+	if (lru_tail < 0)
+		lru_tail = slot;
+}
+
+/* Returns the mapping of a window, mapping it (and evicting the LRU window) if needed */
+static char* map_window(uint64_t window)
+{
+	int slot = window_slot[window] - 1;
+
+	if (slot >= 0) {
+		if (slot != lru_head) {
+			lru_unlink(slot);
+			lru_push_front(slot);
+		}
+		return windows[slot].va;
+	}
+
+	if (nwindows < NWINDOWS) {
+		slot = nwindows++;
+	} else {
+		slot = lru_tail;
+		lru_unlink(slot);
+		munmap(windows[slot].va, WINDOW_BYTES);
+		window_slot[windows[slot].window] = 0;
+	}
+
+	windows[slot].va = mmap(NULL, WINDOW_BYTES, PROT_READ|PROT_WRITE, MAP_SHARED, frame_fd,
+				window * WINDOW_BYTES);
+	if (windows[slot].va == MAP_FAILED)
+		err(1, "mmap of frame window failed");
+	windows[slot].window = window;
+	window_slot[window] = slot + 1;
+	lru_push_front(slot);
+	return windows[slot].va;
+}
+
+/* Maps count new anonymous frames, faulted in if populate is set; returns the first, or NO_MAPPING */
+static uint64_t map_anon_frames(uint64_t count, int populate)
+{
+	uint64_t first = atomic_load(&nalloc);
+	char* va;
 
 	/* OS memory management isn't really this simple */
-	ppn = nalloc;
-	nalloc++;
+	do {
+		if (first + count > NPAGES)
+			return NO_MAPPING;
+	} while (!atomic_compare_exchange_weak(&nalloc, &first, first + count));
 
-	va = mmap(NULL, 1 << 13, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	va = mmap(NULL, count << 13, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE|MAP_ANONYMOUS|(populate ? MAP_POPULATE : 0), -1, 0);
 	if (va == MAP_FAILED)
 		err(1, "mmap failed");
 
-	pages[ppn] = va;
+	for (uint64_t i = 0; i < count; i++)
+		pages[first + i] = va + (i << 13);
+	return first;
+}
+
+/* Clears a frame without pulling it into the cache */
+static void zero_frame(char* va)
+{
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+
+	for (char* p = va; p < va + (1 << 13); p += 64) {
+		_mm_stream_si128((__m128i*)p, zero);
+		_mm_stream_si128((__m128i*)(p + 16), zero);
+		_mm_stream_si128((__m128i*)(p + 32), zero);
+		_mm_stream_si128((__m128i*)(p + 48), zero);
+	}
+#else
+	memset(va, 0, 1 << 13);
+#endif
+}
+
+/* Whether the zeroing thread has anything to do; called with pool.lock held */
+static int pool_needs_refill(int refilling)
+{
+	uint64_t depth = atomic_load(&pool.tail) - atomic_load(&pool.head);
+
+	if (depth == POOL_SIZE)
+		return 0;
+	if (pool.ndirty > 0)
+		return 1;
+	return (refilling || depth < POOL_LOW) && atomic_load(&nalloc) < NPAGES;
+}
+
+/*
+ * Zeroing thread: once woken it refills the reserve all the way, recycling
+ * freed frames first, then sleeps until it drops below POOL_LOW again.
+ */
+static int zeroer_main(void* arg)
+{
+	uint64_t batch[POOL_BATCH];
+	int refilling = 1;
+
+	(void)arg;
+	for (;;) {
+		size_t n = 0;
+
+		mtx_lock(&pool.lock);
+		atomic_store(&pool.sleeping, 1);
+		while (!pool_needs_refill(refilling)) {
+			refilling = 1;
+			cnd_wait(&pool.wake, &pool.lock);
+		}
+		atomic_store(&pool.sleeping, 0);
+
+		uint64_t room = POOL_SIZE - (atomic_load(&pool.tail) - atomic_load(&pool.head));
+		if (room > POOL_BATCH)
+			room = POOL_BATCH;
+		while (n < room && pool.ndirty > 0)
+			batch[n++] = pool.dirty[--pool.ndirty];
+		mtx_unlock(&pool.lock);
+
+		for (size_t i = 0; i < n; i++)
+			zero_frame(pages[batch[i]]);
+#ifdef __SSE2__
+		_mm_sfence();
+#endif
+
+		if (n < room) {
+			uint64_t count = room - n;
+			uint64_t first = map_anon_frames(count, 1);
+
+			if (first == NO_MAPPING) {
+				refilling = 0;	/* out of frames until some are freed */
+			} else {
+				for (uint64_t i = 0; i < count; i++)
+					batch[n++] = first + i;
+			}
+		}
+
+		uint64_t tail = atomic_load_explicit(&pool.tail, memory_order_relaxed);
+		for (size_t i = 0; i < n; i++)
+			pool.ready[(tail + i) % POOL_SIZE] = batch[i];
+		atomic_store_explicit(&pool.tail, tail + n, memory_order_release);
+	}
+	return 0;
+}
+
+static void pool_wake(void)
+{
+	if (atomic_load(&pool.sleeping)) {
+		mtx_lock(&pool.lock);
+		cnd_signal(&pool.wake);
+		mtx_unlock(&pool.lock);
+	}
+}
+
+/* Takes a zeroed, faulted-in frame from the reserve; returns NO_MAPPING if it is empty */
+static uint64_t pool_take(void)
+{
+	uint64_t head = atomic_load_explicit(&pool.head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&pool.tail, memory_order_acquire);
+	uint64_t ppn = NO_MAPPING;
+
+	if (head != tail) {
+		ppn = pool.ready[head % POOL_SIZE];
+		atomic_store(&pool.head, ++head);
+	}
+	if (tail - head < POOL_LOW)
+		pool_wake();
+	return ppn;
+}
+
+uint64_t alloc_page_frame(void)
+{
+	uint64_t ppn;
+
+	frame_backend_init();
+
+	if (frame_fd >= 0) {
+		if (nfile_free > 0)
+			return file_free[--nfile_free] + 0xbaaaaaad;
+		if (nalloc == FILE_NPAGES)
+			errx(1, "out of physical memory");
+		ppn = nalloc++;
+		/* The file grows a window at a time; holes read back as zeroed frames */
+		if (ppn == file_frames) {
+			file_frames += WINDOW_FRAMES;
+			if (ftruncate(frame_fd, file_frames << 13) < 0)
+				err(1, "cannot extend frame file");
+		}
+		return ppn + 0xbaaaaaad;
+	}
+
+	ppn = pool_take();
+	if (ppn == NO_MAPPING) {
+		/* The reserve ran dry: fall back to a fresh frame, faulted in on first touch */
+		ppn = map_anon_frames(1, 0);
+		if (ppn == NO_MAPPING)
+			errx(1, "out of physical memory");
+	}
 	return ppn + 0xbaaaaaad;
 }
 
+/* Allocates count frames with consecutive numbers, zeroed; they can be freed one at a time */
+uint64_t alloc_page_frames(uint64_t count)
+{
+	uint64_t ppn;
+
+	frame_backend_init();
+
+	if (frame_fd >= 0) {
+		if (FILE_NPAGES - nalloc < count)
+			errx(1, "out of physical memory");
+		ppn = nalloc;
+		nalloc += count;
+		if (nalloc > file_frames) {
+			file_frames = (nalloc + WINDOW_FRAMES - 1) & ~(WINDOW_FRAMES - 1);
+			if (ftruncate(frame_fd, file_frames << 13) < 0)
+				err(1, "cannot extend frame file");
+		}
+		return ppn + 0xbaaaaaad;
+	}
+
+	/* One mapping, so the frames are adjacent in memory too; each is faulted in on first touch */
+	ppn = map_anon_frames(count, 0);
+	if (ppn == NO_MAPPING)
+		errx(1, "out of physical memory");
+	return ppn + 0xbaaaaaad;
+}
+
+/* Appends to a growable array of frame numbers */
+static void push_frame(uint64_t** frames, size_t* n, size_t* cap, uint64_t ppn)
+{
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 1024;
+		*frames = realloc(*frames, *cap * sizeof(**frames));
+		if (*frames == NULL)
+			err(1, "cannot grow free frame list");
+	}
+	(*frames)[(*n)++] = ppn;
+}
+
+void free_page_frame(uint64_t frame)
+{
+	uint64_t ppn = frame - 0xbaaaaaad;
+
+	if (frame_fd >= 0) {
+		/* Punching a hole both zeroes the frame and returns its blocks to the file system */
+		if (fallocate(frame_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, ppn << 13, 1 << 13) < 0)
+			err(1, "cannot clear frame");
+		push_frame(&file_free, &nfile_free, &file_free_cap, ppn);
+		return;
+	}
+
+	mtx_lock(&pool.lock);
+	push_frame(&pool.dirty, &pool.ndirty, &pool.dirty_cap, ppn);
+	cnd_signal(&pool.wake);
+	mtx_unlock(&pool.lock);
+}
+
 void* phys_to_virt(uint64_t phys_addr)
 {
 	uint64_t ppn = (phys_addr >> 13) - 0xbaaaaaad;
 	uint64_t off = phys_addr & 0x1fff;
 	char* va = NULL;
 
-	if (ppn < NPAGES)
+	if (frame_fd >= 0) {
+		if (ppn < nalloc)
+			va = map_window(ppn >> WINDOW_SHIFT) + ((ppn & (WINDOW_FRAMES - 1)) << 13) + off;
+	} else if (ppn < NPAGES) {
 		va = pages[ppn] + off;
+	}
 
 	return va;
 }
@@ -144,6 +497,139 @@ int main(int argc, char **argv)
     page_table_update(pt, 0xF0F0F0, NO_MAPPING);
     assert(page_table_query(pt, 0xF0F0F0) == NO_MAPPING);
 
+    // Many tables spread over frames: with OS_FRAME_FILE set, more windows than stay mapped
+    for (uint64_t i = 0; i < 3000; ++i) {
+        page_table_update(pt, i << 20, 0x3000 + i);
+    }
+    for (uint64_t i = 0; i < 3000; ++i) {
+        assert(page_table_query(pt, i << 20) == 0x3000 + i);
+    }
+
+    // Permissions: checked queries honor them, unchecked ones ignore them
+    pt = alloc_page_frame();
+    page_table_update_perms(pt, 0x4242, 0x10, PERM_READ | PERM_USER);
+    assert(page_table_query_perms(pt, 0x4242, PERM_READ | PERM_USER) == 0x10);
+    assert(page_table_query_perms(pt, 0x4242, PERM_WRITE) == NO_MAPPING);
+    assert(page_table_query(pt, 0x4242) == 0x10);
+    page_table_update(pt, 0x4243, 0x11);
+    assert(page_table_query_perms(pt, 0x4243, PERM_ALL) == 0x11);
+
+    // Range protection within and across leaf tables
+    for (uint64_t i = 0; i < 3000; ++i) {
+        page_table_update(pt, 0x100000 + i, 0x5000 + i);
+    }
+    page_table_protect_range(pt, 0x100000 + 10, 2500, PERM_READ);
+    assert(page_table_query_perms(pt, 0x100000 + 9, PERM_WRITE) == 0x5000 + 9);
+    assert(page_table_query_perms(pt, 0x100000 + 10, PERM_WRITE) == NO_MAPPING);
+    assert(page_table_query_perms(pt, 0x100000 + 10, PERM_READ) == 0x5000 + 10);
+    assert(page_table_query_perms(pt, 0x100000 + 2509, PERM_WRITE) == NO_MAPPING);
+    assert(page_table_query_perms(pt, 0x100000 + 2510, PERM_WRITE) == 0x5000 + 2510);
+
+    // Whole subtrees are protected lazily and pushed down by later changes inside them
+    uint64_t region = 5ULL << 20;
+    page_table_update(pt, region, 0x6000);
+    page_table_update(pt, region + 1, 0x6001);
+    page_table_update(pt, region + 5000, 0x6002);
+    page_table_update(pt, region + (1 << 20) - 1, 0x6003);
+    page_table_protect_range(pt, region, 1 << 20, PERM_EXEC);
+    assert(page_table_query_perms(pt, region + 1, PERM_EXEC) == 0x6001);
+    assert(page_table_query_perms(pt, region + 1, PERM_READ) == NO_MAPPING);
+    page_table_protect_range(pt, region + 5000, 1, PERM_READ);
+    assert(page_table_query_perms(pt, region + 5000, PERM_READ) == 0x6002);
+    assert(page_table_query_perms(pt, region + 5000, PERM_EXEC) == NO_MAPPING);
+    assert(page_table_query_perms(pt, region, PERM_EXEC) == 0x6000);
+    assert(page_table_query_perms(pt, region + (1 << 20) - 1, PERM_EXEC) == 0x6003);
+    page_table_update(pt, region + 2, 0x6004);
+    assert(page_table_query_perms(pt, region + 2, PERM_ALL) == 0x6004);
+    assert(page_table_query_perms(pt, region + 1, PERM_READ) == NO_MAPPING);
+    assert(page_table_query(pt, region + 3) == NO_MAPPING);
+
+    // Protecting the whole address space
+    page_table_protect_range(pt, 0, 1ULL << 50, PERM_READ | PERM_WRITE);
+    assert(page_table_query_perms(pt, 0x4242, PERM_WRITE) == 0x10);
+    assert(page_table_query_perms(pt, region + 5000, PERM_EXEC) == NO_MAPPING);
+    page_table_protect_range(pt, region, 1, PERM_USER);
+    assert(page_table_query_perms(pt, region, PERM_USER) == 0x6000);
+    assert(page_table_query_perms(pt, region + 1, PERM_WRITE) == 0x6001);
+    assert(page_table_query_perms(pt, 0x100000 + 10, PERM_WRITE) == 0x5000 + 10);
+
+    // Compaction, with the page table in use between steps
+    for (uint64_t i = 0; i < 64; ++i) {
+        alloc_page_frame();
+        page_table_update_perms(pt, (0x5ULL << 40) | (i << 21) | i, 0x9000 + i, PERM_READ);
+    }
+    page_table_compactor compactor;
+    int steps = 0;
+    page_table_compact_begin(&compactor, pt, 0x5ULL << 40, 1);
+    while (page_table_compact_step(&compactor, 5)) {
+        assert(page_table_query_perms(pt, (0x5ULL << 40) | (7ULL << 21) | 7, PERM_READ) == 0x9007);
+        assert(page_table_query_perms(pt, (0x5ULL << 40) | (7ULL << 21) | 7, PERM_WRITE) == NO_MAPPING);
+        if (++steps == 30) {
+            page_table_update(pt, (0x5ULL << 40) | (3ULL << 21) | 9, 0x8888);
+        }
+    }
+    assert(compactor.moved == compactor.ntables && compactor.ntables == 1 + 1 + 64 + 64);
+    for (uint64_t i = 0; i < 64; ++i) {
+        assert(page_table_query_perms(pt, (0x5ULL << 40) | (i << 21) | i, PERM_READ) == 0x9000 + i);
+    }
+    assert(page_table_query(pt, (0x5ULL << 40) | (3ULL << 21) | 9) == 0x8888);
+    page_table_compact_begin(&compactor, pt, 0, 0);
+    while (page_table_compact_step(&compactor, 100))
+        ;
+    assert(page_table_query(pt, 0x4242) == 0x10);
+    assert(page_table_query_perms(pt, region + 1, PERM_WRITE) == 0x6001);
+    assert(page_table_query(pt, (0x5ULL << 40) | (63ULL << 21) | 63) == 0x9000 + 63);
+    page_table_compact_begin(&compactor, pt, 0x2ffULL << 40, 2);
+    assert(!page_table_compact_step(&compactor, 1));
+
+    // Address space areas
+    vma_space space;
+    uint64_t low = 0x200000000ULL;
+    vma_space_init(&space, pt, low, low + 4096);
+    uint64_t a = vma_mmap(&space, 0, 100, 0x7000, PERM_READ | PERM_WRITE);
+    uint64_t b = vma_mmap(&space, 0, 50, NO_MAPPING, PERM_READ);
+    uint64_t c = vma_mmap(&space, low + 1000, 10, 0x8000, PERM_READ);
+    assert(a == low && b == low + 100 && c == low + 1000);
+    assert(page_table_query_perms(pt, a + 99, PERM_WRITE) == 0x7000 + 99);
+    assert(page_table_query(pt, b) == NO_MAPPING && vma_find(&space, b + 49) != NULL);
+    assert(vma_find(&space, b + 50) == NULL);
+    assert(vma_mmap(&space, low + 1005, 200, 0x9000, PERM_READ) == low + 1010);
+    assert(vma_mmap(&space, low + 4000, 200, NO_MAPPING, PERM_READ) == low + 150);
+    vma_munmap(&space, a + 10, 20);
+    assert(page_table_query(pt, a + 9) == 0x7000 + 9);
+    assert(page_table_query(pt, a + 10) == NO_MAPPING && vma_find(&space, a + 29) == NULL);
+    assert(vma_find(&space, a + 30)->ppn == 0x7000 + 30);
+    assert(vma_find_free(&space, 20, 0) == a + 10);
+    assert(vma_find_free(&space, 21, 0) == low + 350);
+    vma_munmap(&space, low, 4096);
+    assert(space.count == 0 && page_table_query(pt, c) == NO_MAPPING);
+    assert(vma_find_free(&space, 4096, low + 7) == low);
+    for (int i = 0; i < 1000; ++i) {
+        assert(vma_mmap(&space, 0, 4, NO_MAPPING, PERM_READ) == low + 4 * i);
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        vma_munmap(&space, low + 4 * i, 4);
+    }
+    assert(vma_find_free(&space, 5, 0) == low + 4000);
+    assert(vma_find_free(&space, 4, low + 2001) == low + 2008);
+    vma_space_destroy(&space);
+
+    // Freed frames come back zeroed
+    uint64_t frames[64];
+    for (int i = 0; i < 64; ++i) {
+        frames[i] = alloc_page_frame();
+        memset(phys_to_virt(frames[i] << 13), 0xff, 1 << 13);
+    }
+    for (int i = 0; i < 64; ++i) {
+        free_page_frame(frames[i]);
+    }
+    for (int i = 0; i < 4096; ++i) {
+        const uint64_t *va = phys_to_virt(alloc_page_frame() << 13);
+        for (int j = 0; j < (1 << 13) / 8; ++j) {
+            assert(va[j] == 0);
+        }
+    }
+
     printf("All tests passed!\n");
     return 0;
 }
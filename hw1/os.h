@@ -1,10 +1,46 @@
+#ifndef OS_H
+#define OS_H
 
 #include <stdint.h>
 
 #define NO_MAPPING	(~0ULL)
 
 uint64_t alloc_page_frame(void);
+uint64_t alloc_page_frames(uint64_t count);
+void free_page_frame(uint64_t ppn);
 void* phys_to_virt(uint64_t phys_addr);
 
+/* Page permissions */
+#define PERM_READ	0x1
+#define PERM_WRITE	0x2
+#define PERM_EXEC	0x4
+#define PERM_USER	0x8
+#define PERM_ALL	0xf
+
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
 uint64_t page_table_query(uint64_t pt, uint64_t vpn);
+void page_table_update_perms(uint64_t pt, uint64_t vpn, uint64_t ppn, int perms);
+void page_table_update_range(uint64_t pt, uint64_t vpn, uint64_t count, uint64_t ppn, int perms);
+uint64_t page_table_query_perms(uint64_t pt, uint64_t vpn, int access);
+void page_table_protect_range(uint64_t pt, uint64_t vpn, uint64_t count, int perms);
+
+/* State of an incremental page table compaction, see page_table_compact_step */
+typedef struct {
+	uint64_t ntables;	/* tables found by the counting pass */
+	uint64_t dest;		/* first of the consecutive frames they move to */
+	uint64_t moved;		/* tables moved so far */
+	int moving;		/* 0 while counting, 1 while moving */
+	int depth;		/* index of the top of stack, -1 once a pass is over */
+	int start_level;	/* level of the table at the bottom of stack */
+	uint64_t start_table, start_index, start_end;
+	struct page_table_scan {
+		uint64_t table;	/* the table being scanned, at its current frame */
+		uint64_t index;	/* next entry to look at */
+		uint64_t end;	/* entry to stop at */
+	} stack[4];		/* one per level above the leaves */
+} page_table_compactor;
+
+void page_table_compact_begin(page_table_compactor *c, uint64_t pt, uint64_t vpn, int level);
+int page_table_compact_step(page_table_compactor *c, uint64_t budget);
+
+#endif
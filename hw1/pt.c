@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include "os.h"
 
 // Constants defining page table architecture
@@ -8,9 +9,24 @@
 #define ENTRIES_PER_LEVEL   1024    // (1UL << BITS_PER_LEVEL)
 #define LEVEL_MASK          0x3ff   // (ENTRIES_PER_LEVEL - 1)
 #define PTE_VALID_BIT       0
-#define PTE_UNUSED_BITS     12
+#define PTE_PERM_SHIFT      1       // PERM_* bits live in PTE bits 1-4
+#define PTE_PERM_MASK       (PERM_ALL << PTE_PERM_SHIFT)
+#define PTE_PENDING         (1ULL << 5)
+#define PTE_UNUSED_BITS     7
 #define PTE_FRAME_SHIFT     13      // PAGE_SIZE_BITS
 
+/*
+ * Leaf PTEs carry the permissions of their page. An upper-level PTE with
+ * PTE_PENDING set carries a range protection that has not been pushed down
+ * yet: every valid leaf below it has the permissions in its PTE_PERM_MASK
+ * bits, whatever the leaves themselves say. Walks honor the topmost
+ * pending entry, and page_table_update or a partial range protection
+ * pushes it one level down before descending through it.
+ */
+
+// Lowest level whose fully covered entries are protected lazily; below it, leaf tables are rewritten
+#define LAZY_LEVELS         (PAGE_TABLE_LEVELS - 2)
+
 /**
  * Splits a virtual page number (VPN) into its level indices for a multi-level page table.
  *
@@ -24,15 +40,90 @@ static void split_vpn(uint64_t vpn, uint64_t indices[PAGE_TABLE_LEVELS]) {
     }
 }
 
+/**
+ * @param frame The physical page number of a page table.
+ * @return The table, mapped.
+ */
+static uint64_t *table_of(uint64_t frame) {
+    return (uint64_t *) phys_to_virt(frame << PAGE_SIZE_BITS);
+}
+
+/**
+ * Sets the permissions of the valid entries in a range of a leaf table.
+ * The loop has no branch, so the compiler turns it into vector stores.
+ *
+ * @param table The leaf table.
+ * @param first First index to update.
+ * @param last Last index to update.
+ * @param perm_bits The new permissions, already shifted into PTE position.
+ */
+static void protect_leaves(uint64_t *table, uint64_t first, uint64_t last, uint64_t perm_bits) {
+    for (uint64_t i = first; i <= last; ++i) {
+        uint64_t valid = -(table[i] & 1);
+        table[i] = (table[i] & ~(PTE_PERM_MASK & valid)) | (perm_bits & valid);
+    }
+}
+
+/**
+ * Pushes a pending protection one level down: the children of the entry
+ * take over its permissions (leaves directly, upper-level children as
+ * their own pending protection) and the entry stops overriding them.
+ *
+ * @param entry The upper-level PTE, with PTE_PENDING set.
+ * @param level Level of the table holding the entry.
+ */
+static void push_down(uint64_t *entry, int level) {
+    uint64_t *child = table_of(*entry >> PTE_FRAME_SHIFT);
+    uint64_t perm_bits = *entry & PTE_PERM_MASK;
+
+    if (level + 1 == PAGE_TABLE_LEVELS - 1) {
+        protect_leaves(child, 0, ENTRIES_PER_LEVEL - 1, perm_bits);
+    } else {
+        for (uint64_t i = 0; i < ENTRIES_PER_LEVEL; ++i) {
+            uint64_t valid = -(child[i] & 1);
+            child[i] = (child[i] & ~((PTE_PERM_MASK | PTE_PENDING) & valid)) |
+                       ((perm_bits | PTE_PENDING) & valid);
+        }
+    }
+    *entry &= ~(PTE_PERM_MASK | PTE_PENDING);
+}
+
 /**
  * Updates a page table by either inserting or removing a mapping from a virtual page number (VPN)
- * to a physical page number (PPN).
+ * to a physical page number (PPN). A new mapping gets every permission.
  *
  * @param pt The physical page number of the root of the page table.
  * @param vpn The virtual page number whose mapping is to be updated.
  * @param ppn The physical page number to map to. If equal to NO_MAPPING, the mapping is removed.
  */
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn) {
+    page_table_update_perms(pt, vpn, ppn, PERM_ALL);
+}
+
+/**
+ * Updates a page table by either inserting or removing a mapping, like
+ * page_table_update, with the given permissions.
+ *
+ * @param pt The physical page number of the root of the page table.
+ * @param vpn The virtual page number whose mapping is to be updated.
+ * @param ppn The physical page number to map to. If equal to NO_MAPPING, the mapping is removed.
+ * @param perms The permissions of the mapping (PERM_* bits).
+ */
+void page_table_update_perms(uint64_t pt, uint64_t vpn, uint64_t ppn, int perms) {
+    page_table_update_range(pt, vpn, 1, ppn, perms);
+}
+
+/**
+ * Walks to the leaf table covering a VPN, pushing pending protections
+ * down along the way.
+ *
+ * @param pt The physical page number of the root of the page table.
+ * @param vpn The virtual page number.
+ * @param create Whether to allocate missing tables.
+ * @param missing_level Output: if the walk stops early, the level of the missing entry.
+ * @return The leaf table, or NULL if it does not exist and create is not set.
+ */
+static uint64_t *walk_to_leaf(uint64_t pt, uint64_t vpn, int create, int *missing_level) {
     uint64_t indices[PAGE_TABLE_LEVELS];
     split_vpn(vpn, indices);
 
@@ -40,22 +131,62 @@ void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn) {
     for (int level = 0; level < PAGE_TABLE_LEVELS - 1; ++level) {
         uint64_t entry = table[indices[level]];
         if (!(entry & 1)) {
-            if (ppn == NO_MAPPING) {
-                return;
+            if (!create) {
+                *missing_level = level;
+                return NULL;
             }
             uint64_t new_pt = alloc_page_frame();
             table[indices[level]] = (new_pt << PTE_FRAME_SHIFT) | 1;
             table = (uint64_t *) phys_to_virt(new_pt << PAGE_SIZE_BITS);
         } else {
+            if (entry & PTE_PENDING) {
+                push_down(&table[indices[level]], level);
+            }
             uint64_t next_pt = entry >> PTE_FRAME_SHIFT;
             table = (uint64_t *) phys_to_virt(next_pt << PAGE_SIZE_BITS);
         }
     }
+    return table;
+}
 
-    if (ppn == NO_MAPPING) {
-        table[indices[PAGE_TABLE_LEVELS - 1]] = 0;
-    } else {
-        table[indices[PAGE_TABLE_LEVELS - 1]] = (ppn << PTE_FRAME_SHIFT) | 1;
+/**
+ * Maps count consecutive VPNs to consecutive PPNs, or unmaps them. The
+ * tables are walked once per leaf table rather than once per page, so
+ * mapping a large region costs little more than writing its PTEs.
+ *
+ * @param pt The physical page number of the root of the page table.
+ * @param vpn First virtual page number of the range.
+ * @param count Number of pages in the range.
+ * @param ppn The physical page number to map vpn to, the following pages
+ *            following it. If equal to NO_MAPPING, the range is unmapped.
+ * @param perms The permissions of the mappings (PERM_* bits).
+ */
+void page_table_update_range(uint64_t pt, uint64_t vpn, uint64_t count, uint64_t ppn, int perms) {
+    uint64_t perm_bits = ((uint64_t)(perms & PERM_ALL) << PTE_PERM_SHIFT) | 1;
+
+    while (count > 0) {
+        int missing_level = PAGE_TABLE_LEVELS - 1;
+        uint64_t first = vpn & LEVEL_MASK;
+        uint64_t n = ENTRIES_PER_LEVEL - first < count ? ENTRIES_PER_LEVEL - first : count;
+        uint64_t *table = walk_to_leaf(pt, vpn, ppn != NO_MAPPING, &missing_level);
+
+        if (table == NULL) {
+            // Nothing is mapped up to the end of the missing entry's range
+            uint64_t span = 1ULL << (BITS_PER_LEVEL * (PAGE_TABLE_LEVELS - 1 - missing_level));
+            n = span - (vpn & (span - 1));
+            n = n < count ? n : count;
+        } else if (ppn == NO_MAPPING) {
+            for (uint64_t i = 0; i < n; ++i) {
+                table[first + i] = 0;
+            }
+        } else {
+            for (uint64_t i = 0; i < n; ++i) {
+                table[first + i] = ((ppn + i) << PTE_FRAME_SHIFT) | perm_bits;
+            }
+            ppn += n;
+        }
+        vpn += n;
+        count -= n;
     }
 }
 
@@ -67,7 +198,23 @@ void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn) {
  * @return The physical page number mapped to the VPN, or NO_MAPPING if no mapping exists.
  */
 uint64_t page_table_query(uint64_t pt, uint64_t vpn) {
+    return page_table_query_perms(pt, vpn, 0);
+}
+
+/**
+ * Queries a page table like page_table_query, but only succeeds if the
+ * mapping allows every requested access. A pending protection higher up
+ * takes precedence over the permissions stored in the leaf.
+ *
+ * @param pt The physical page number of the root of the page table.
+ * @param vpn The virtual page number to query.
+ * @param access The required permissions (PERM_* bits).
+ * @return The physical page number mapped to the VPN, or NO_MAPPING if no mapping exists
+ *         or it lacks a requested permission.
+ */
+uint64_t page_table_query_perms(uint64_t pt, uint64_t vpn, int access) {
     uint64_t indices[PAGE_TABLE_LEVELS];
+    uint64_t override = 0;
     split_vpn(vpn, indices);
 
     uint64_t *table = (uint64_t *) phys_to_virt(pt << PAGE_SIZE_BITS);
@@ -76,6 +223,9 @@ uint64_t page_table_query(uint64_t pt, uint64_t vpn) {
         if (!(entry & 1)) {
             return NO_MAPPING;
         }
+        if ((entry & PTE_PENDING) && !override) {
+            override = entry;
+        }
         uint64_t next_pt = entry >> PTE_FRAME_SHIFT;
         table = (uint64_t *) phys_to_virt(next_pt << PAGE_SIZE_BITS);
     }
@@ -84,5 +234,203 @@ uint64_t page_table_query(uint64_t pt, uint64_t vpn) {
     if (!(final_entry & 1)) {
         return NO_MAPPING;
     }
+    uint64_t perms = ((override ? override : final_entry) & PTE_PERM_MASK) >> PTE_PERM_SHIFT;
+    if ((perms & access) != (uint64_t)access) {
+        return NO_MAPPING;
+    }
     return final_entry >> PTE_FRAME_SHIFT;
 }
+
+/**
+ * Protects the part of a table's range that overlaps [first, last].
+ *
+ * @param table The table.
+ * @param level Level of the table.
+ * @param base First VPN the table covers.
+ * @param first First VPN to protect.
+ * @param last Last VPN to protect.
+ * @param perm_bits The new permissions, already shifted into PTE position.
+ */
+static void protect_table(uint64_t *table, int level, uint64_t base, uint64_t first, uint64_t last,
+                          uint64_t perm_bits) {
+    int shift = BITS_PER_LEVEL * (PAGE_TABLE_LEVELS - 1 - level);
+    uint64_t span_last = base + ((uint64_t)ENTRIES_PER_LEVEL << shift) - 1;
+    uint64_t first_index = first > base ? (first - base) >> shift : 0;
+    uint64_t last_index = last < span_last ? (last - base) >> shift : ENTRIES_PER_LEVEL - 1;
+
+    if (level == PAGE_TABLE_LEVELS - 1) {
+        protect_leaves(table, first_index, last_index, perm_bits);
+        return;
+    }
+
+    for (uint64_t i = first_index; i <= last_index; ++i) {
+        uint64_t entry = table[i];
+        uint64_t entry_first = base + (i << shift);
+        uint64_t entry_last = entry_first + (1ULL << shift) - 1;
+        if (!(entry & 1)) {
+            continue;
+        }
+        if (level < LAZY_LEVELS && first <= entry_first && entry_last <= last) {
+            table[i] = (entry & ~PTE_PERM_MASK) | perm_bits | PTE_PENDING;
+            continue;
+        }
+        if (entry & PTE_PENDING) {
+            push_down(&table[i], level);
+        }
+        protect_table(table_of(entry >> PTE_FRAME_SHIFT), level + 1, entry_first, first, last, perm_bits);
+    }
+}
+
+/**
+ * Sets the permissions of every existing mapping in a range of VPNs, like
+ * mprotect. Subtrees the range covers entirely at the upper levels are
+ * protected in their parent entry alone and pushed down lazily; leaf
+ * tables are rewritten a whole table at a time with vector stores.
+ * Unmapped VPNs in the range stay unmapped.
+ *
+ * @param pt The physical page number of the root of the page table.
+ * @param vpn First virtual page number of the range.
+ * @param count Number of pages in the range.
+ * @param perms The new permissions (PERM_* bits).
+ */
+void page_table_protect_range(uint64_t pt, uint64_t vpn, uint64_t count, int perms) {
+    uint64_t last = vpn + count - 1;
+    uint64_t max_vpn = (1ULL << VPN_BITS_USED) - 1;
+
+    if (count == 0 || vpn > max_vpn) {
+        return;
+    }
+    if (last > max_vpn || last < vpn) {
+        last = max_vpn;
+    }
+    protect_table(table_of(pt), 0, 0, vpn, last, (uint64_t)(perms & PERM_ALL) << PTE_PERM_SHIFT);
+}
+
+// ========== Compaction ==========
+
+/**
+ * Starts a pass of a compaction over the tables below its starting entries.
+ *
+ * @param c The compaction.
+ */
+static void compact_restart(page_table_compactor *c) {
+    c->depth = 0;
+    c->stack[0].table = c->start_table;
+    c->stack[0].index = c->start_index;
+    c->stack[0].end = c->start_end;
+}
+
+/**
+ * Prepares to compact a subtree of a page table: the table at the given
+ * level covering a VPN and every table below it are moved, in depth-first
+ * order, into frames with consecutive numbers, so that walks through
+ * neighboring VPNs touch neighboring memory. At level 0 the subtree is
+ * the whole page table, whose root stays where it is. Nothing is done
+ * until page_table_compact_step is called.
+ *
+ * @param c The compaction to set up.
+ * @param pt The physical page number of the root of the page table.
+ * @param vpn A virtual page number the subtree covers.
+ * @param level Level of the subtree's top table, 0 to PAGE_TABLE_LEVELS - 1.
+ */
+void page_table_compact_begin(page_table_compactor *c, uint64_t pt, uint64_t vpn, int level) {
+    uint64_t indices[PAGE_TABLE_LEVELS];
+    split_vpn(vpn, indices);
+
+    c->ntables = 0;
+    c->dest = NO_MAPPING;
+    c->moved = 0;
+    c->moving = 0;
+    c->start_level = level > 0 ? level - 1 : 0;
+    c->start_table = pt;
+    c->start_index = level > 0 ? indices[level - 1] : 0;
+    c->start_end = level > 0 ? c->start_index + 1 : ENTRIES_PER_LEVEL;
+
+    // Find the parent of the subtree's top table; its entry is the one to start from
+    for (int i = 0; i < c->start_level; ++i) {
+        uint64_t entry = table_of(c->start_table)[indices[i]];
+        if (!(entry & 1)) {
+            c->depth = -1;
+            c->moving = 1;
+            return;
+        }
+        c->start_table = entry >> PTE_FRAME_SHIFT;
+    }
+    compact_restart(c);
+}
+
+/**
+ * Does a bounded amount of a compaction, so that it can be spread over
+ * many short pauses. A first pass counts the tables; the frames for them
+ * are then allocated in one piece, and a second pass copies each table
+ * into the next frame, points its parent entry at the copy and frees the
+ * old frame. The parent has always been moved already, so the tables
+ * scanned are the copies. The page table stays consistent between steps
+ * and may be queried and updated freely; a table created behind the scan
+ * is simply left where it is, as are tables beyond the frames counted.
+ * Only one compaction may run on a page table at a time.
+ *
+ * @param c The compaction.
+ * @param budget Maximum number of tables to count or move in this step.
+ * @return 1 if there is more to do, 0 once the compaction is done.
+ */
+int page_table_compact_step(page_table_compactor *c, uint64_t budget) {
+    while (budget > 0 && c->depth >= 0) {
+        struct page_table_scan *frame = &c->stack[c->depth];
+        if (frame->index == frame->end) {
+            c->depth--;
+            continue;
+        }
+
+        uint64_t index = frame->index++;
+        uint64_t entry = table_of(frame->table)[index];
+        if (!(entry & 1)) {
+            continue;
+        }
+        uint64_t child = entry >> PTE_FRAME_SHIFT;
+        if (!c->moving) {
+            c->ntables++;
+        } else if (c->moved < c->ntables) {
+            uint64_t new_table = c->dest + c->moved++;
+            uint64_t *old_va = table_of(child);
+            uint64_t *new_va = table_of(new_table);
+            for (uint64_t i = 0; i < ENTRIES_PER_LEVEL; ++i) {
+                new_va[i] = old_va[i];
+            }
+            // Mapping the two tables may have moved the parent, so look it up again
+            table_of(frame->table)[index] = (new_table << PTE_FRAME_SHIFT) |
+                                            (entry & ((1ULL << PTE_FRAME_SHIFT) - 1));
+            free_page_frame(child);
+            child = new_table;
+        } else {
+            c->depth = -1;
+            break;
+        }
+        budget--;
+
+        if (c->start_level + c->depth + 1 < PAGE_TABLE_LEVELS - 1) {
+            c->depth++;
+            c->stack[c->depth].table = child;
+            c->stack[c->depth].index = 0;
+            c->stack[c->depth].end = ENTRIES_PER_LEVEL;
+        }
+    }
+
+    if (c->depth >= 0) {
+        return 1;
+    }
+    if (!c->moving) {
+        c->moving = 1;
+        if (c->ntables > 0) {
+            c->dest = alloc_page_frames(c->ntables);
+            compact_restart(c);
+            return 1;
+        }
+        return 0;
+    }
+    // Frames counted for tables that went away since are not needed
+    while (c->dest != NO_MAPPING && c->moved < c->ntables) {
+        free_page_frame(c->dest + c->moved++);
+    }
+    return 0;
+}
@@ -0,0 +1,415 @@
+#include <stdlib.h>
+#include <err.h>
+#include "os.h"
+#include "vma.h"
+
+// ========== AVL Tree ==========
+
+static int height(const vma *node) {
+    return node != NULL ? node->height : 0;
+}
+
+static uint64_t max_gap(const vma *node) {
+    return node != NULL ? node->max_gap : 0;
+}
+
+/**
+ * Recomputes the height and max_gap of a node from its children.
+ *
+ * @param node The node.
+ */
+static void update(vma *node) {
+    int left = height(node->left), right = height(node->right);
+    uint64_t gap = node->gap;
+
+    node->height = (left > right ? left : right) + 1;
+    gap = max_gap(node->left) > gap ? max_gap(node->left) : gap;
+    gap = max_gap(node->right) > gap ? max_gap(node->right) : gap;
+    node->max_gap = gap;
+}
+
+static vma *rotate_right(vma *node) {
+    vma *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    update(node);
+    update(left);
+    return left;
+}
+
+static vma *rotate_left(vma *node) {
+    vma *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    update(node);
+    update(right);
+    return right;
+}
+
+/**
+ * Restores the AVL balance of a node whose subtrees differ in height by
+ * at most two, and refreshes its augmented fields.
+ *
+ * @param node The node.
+ * @return The new root of the subtree.
+ */
+static vma *rebalance(vma *node) {
+    int balance = height(node->left) - height(node->right);
+
+    if (balance > 1) {
+        if (height(node->left->left) < height(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    }
+    if (balance < -1) {
+        if (height(node->right->right) < height(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+    update(node);
+    return node;
+}
+
+/**
+ * Inserts an area. Every node whose gap changed must be on the insertion
+ * path, which holds for the new area's successor since the new area
+ * becomes a leaf below it.
+ *
+ * @param node Root of the subtree.
+ * @param area The area to insert.
+ * @return The new root of the subtree.
+ */
+static vma *insert(vma *node, vma *area) {
+    if (node == NULL) {
+        update(area);
+        return area;
+    }
+    if (area->start < node->start) {
+        node->left = insert(node->left, area);
+    } else {
+        node->right = insert(node->right, area);
+    }
+    return rebalance(node);
+}
+
+/**
+ * Detaches the leftmost node of a subtree.
+ *
+ * @param node Root of the subtree.
+ * @param min Output: the detached node.
+ * @return The new root of the subtree.
+ */
+static vma *detach_min(vma *node, vma **min) {
+    if (node->left == NULL) {
+        *min = node;
+        return node->right;
+    }
+    node->left = detach_min(node->left, min);
+    return rebalance(node);
+}
+
+/**
+ * Removes an area, which must be in the tree. Like insert, every node
+ * whose gap changed (the area's successor) is on the removal path.
+ *
+ * @param node Root of the subtree.
+ * @param area The area to remove.
+ * @return The new root of the subtree.
+ */
+static vma *remove_node(vma *node, vma *area) {
+    if (area->start < node->start) {
+        node->left = remove_node(node->left, area);
+        return rebalance(node);
+    }
+    if (area->start > node->start) {
+        node->right = remove_node(node->right, area);
+        return rebalance(node);
+    }
+    if (node->right == NULL) {
+        return node->left;
+    }
+
+    vma *successor;
+    vma *right = detach_min(node->right, &successor);
+    successor->left = node->left;
+    successor->right = right;
+    return rebalance(successor);
+}
+
+// ========== Lookups ==========
+
+/**
+ * @param space The address space.
+ * @param vpn A virtual page number.
+ * @return The last area starting at or below vpn, or NULL if there is none.
+ */
+static vma *floor_area(const vma_space *space, uint64_t vpn) {
+    vma *node = space->root, *found = NULL;
+
+    while (node != NULL) {
+        if (node->start <= vpn) {
+            found = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return found;
+}
+
+/**
+ * @param space The address space.
+ * @param vpn A virtual page number.
+ * @return The first area starting above vpn, or NULL if there is none.
+ */
+static vma *next_area(const vma_space *space, uint64_t vpn) {
+    vma *node = space->root, *found = NULL;
+
+    while (node != NULL) {
+        if (node->start > vpn) {
+            found = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+/**
+ * Finds the area containing a VPN.
+ *
+ * @param space The address space.
+ * @param vpn The virtual page number.
+ * @return The area, or NULL if vpn is free.
+ */
+const vma *vma_find(const vma_space *space, uint64_t vpn) {
+    vma *area = floor_area(space, vpn);
+    return area != NULL && vpn < area->end ? area : NULL;
+}
+
+/**
+ * Finds the lowest area whose gap holds pages free pages at or above hint.
+ * Subtrees whose largest gap is too small are skipped, as are left
+ * subtrees lying wholly below hint, so only O(log n) nodes are visited.
+ *
+ * @param node Root of the subtree.
+ * @param pages Size of the range.
+ * @param hint Lowest acceptable VPN.
+ * @return The area, or NULL.
+ */
+static const vma *find_gap(const vma *node, uint64_t pages, uint64_t hint) {
+    while (node != NULL && node->max_gap >= pages) {
+        if (node->start > hint) {
+            const vma *found = find_gap(node->left, pages, hint);
+            if (found != NULL) {
+                return found;
+            }
+        }
+        uint64_t gap_start = node->start - node->gap;
+        uint64_t from = gap_start > hint ? gap_start : hint;
+        if (node->start > from && node->start - from >= pages) {
+            return node;
+        }
+        node = node->right;
+    }
+    return NULL;
+}
+
+/**
+ * @param space The address space.
+ * @return The VPN just past the highest area, or base if there is none.
+ */
+static uint64_t top_of_areas(const vma_space *space) {
+    const vma *node = space->root;
+
+    if (node == NULL) {
+        return space->base;
+    }
+    while (node->right != NULL) {
+        node = node->right;
+    }
+    return node->end;
+}
+
+/**
+ * Finds a free range: the lowest one at or above hint, or failing that
+ * the lowest one in the whole space.
+ *
+ * @param space The address space.
+ * @param pages Size of the range.
+ * @param hint Preferred lowest VPN.
+ * @return First VPN of the range, or NO_MAPPING if no gap is large enough.
+ */
+uint64_t vma_find_free(const vma_space *space, uint64_t pages, uint64_t hint) {
+    if (pages == 0 || pages > space->limit - space->base) {
+        return NO_MAPPING;
+    }
+    hint = hint < space->base ? space->base : hint;
+
+    for (int pass = 0; pass < 2; pass++) {
+        const vma *area = find_gap(space->root, pages, hint);
+        if (area != NULL) {
+            uint64_t gap_start = area->start - area->gap;
+            return gap_start > hint ? gap_start : hint;
+        }
+
+        uint64_t top = top_of_areas(space);
+        uint64_t from = top > hint ? top : hint;
+        if (from < space->limit && space->limit - from >= pages) {
+            return from;
+        }
+        hint = space->base;
+    }
+    return NO_MAPPING;
+}
+
+// ========== Address Space ==========
+
+/**
+ * Initializes an empty address space.
+ *
+ * @param space The address space.
+ * @param pt The physical page number of the root of its page table.
+ * @param base Lowest VPN areas may use.
+ * @param limit VPN just past the highest one areas may use.
+ */
+void vma_space_init(vma_space *space, uint64_t pt, uint64_t base, uint64_t limit) {
+    space->pt = pt;
+    space->base = base;
+    space->limit = limit;
+    space->root = NULL;
+    space->count = 0;
+}
+
+static void free_tree(vma *node) {
+    if (node != NULL) {
+        free_tree(node->left);
+        free_tree(node->right);
+        free(node);
+    }
+}
+
+/**
+ * Frees the areas of an address space; its page table is left as it is.
+ *
+ * @param space The address space.
+ */
+void vma_space_destroy(vma_space *space) {
+    free_tree(space->root);
+    space->root = NULL;
+    space->count = 0;
+}
+
+/**
+ * Adds an area to the tree, setting its own gap and its successor's.
+ *
+ * @param space The address space.
+ * @param start First VPN of the area.
+ * @param end VPN just past the area.
+ * @param ppn PPN start is mapped to, or NO_MAPPING.
+ * @param perms Permissions of the area.
+ */
+static void add_area(vma_space *space, uint64_t start, uint64_t end, uint64_t ppn, int perms) {
+    vma *area = calloc(1, sizeof(vma));
+    vma *prev = floor_area(space, start);
+    vma *next = next_area(space, start);
+
+    if (area == NULL) {
+        err(1, "cannot allocate area");
+    }
+    area->start = start;
+    area->end = end;
+    area->ppn = ppn;
+    area->perms = perms;
+    area->gap = start - (prev != NULL ? prev->end : space->base);
+    if (next != NULL) {
+        next->gap = next->start - end;
+    }
+    space->root = insert(space->root, area);
+    space->count++;
+}
+
+/**
+ * Removes an area from the tree and frees it, widening its successor's gap.
+ *
+ * @param space The address space.
+ * @param area The area.
+ */
+static void remove_area(vma_space *space, vma *area) {
+    vma *prev = area->start > space->base ? floor_area(space, area->start - 1) : NULL;
+    vma *next = next_area(space, area->start);
+
+    if (next != NULL) {
+        next->gap = next->start - (prev != NULL ? prev->end : space->base);
+    }
+    space->root = remove_node(space->root, area);
+    space->count--;
+    free(area);
+}
+
+/**
+ * Allocates a range of pages, like mmap: the lowest free range at or
+ * above hint becomes a new area, and unless ppn is NO_MAPPING its pages
+ * are mapped to consecutive PPNs from ppn in one bulk page table update.
+ *
+ * @param space The address space.
+ * @param hint Preferred lowest VPN.
+ * @param pages Number of pages.
+ * @param ppn PPN to map the first page to, or NO_MAPPING to only reserve the range.
+ * @param perms Permissions of the mappings (PERM_* bits).
+ * @return First VPN of the area, or NO_MAPPING if the space has no large enough gap.
+ */
+uint64_t vma_mmap(vma_space *space, uint64_t hint, uint64_t pages, uint64_t ppn, int perms) {
+    uint64_t vpn = vma_find_free(space, pages, hint);
+
+    if (vpn == NO_MAPPING) {
+        return NO_MAPPING;
+    }
+    add_area(space, vpn, vpn + pages, ppn, perms);
+    if (ppn != NO_MAPPING) {
+        page_table_update_range(space->pt, vpn, pages, ppn, perms);
+    }
+    return vpn;
+}
+
+/**
+ * Frees a range of pages, like munmap: its mappings are removed, areas
+ * inside it are dropped, and areas straddling its ends are trimmed (or
+ * split in two) to what lies outside it.
+ *
+ * @param space The address space.
+ * @param vpn First VPN of the range.
+ * @param pages Number of pages.
+ */
+void vma_munmap(vma_space *space, uint64_t vpn, uint64_t pages) {
+    uint64_t end = vpn + pages;
+    vma *area = floor_area(space, vpn);
+
+    if (area == NULL || area->end <= vpn) {
+        area = next_area(space, vpn);
+    }
+    while (area != NULL && area->start < end) {
+        uint64_t start = area->start, area_end = area->end, ppn = area->ppn;
+        int perms = area->perms;
+        uint64_t from = start > vpn ? start : vpn;
+        uint64_t to = area_end < end ? area_end : end;
+
+        if (ppn != NO_MAPPING) {
+            page_table_update_range(space->pt, from, to - from, NO_MAPPING, 0);
+        }
+        remove_area(space, area);
+        if (start < from) {
+            add_area(space, start, from, ppn, perms);
+        }
+        if (to < area_end) {
+            add_area(space, to, area_end, ppn != NO_MAPPING ? ppn + (to - start) : NO_MAPPING, perms);
+        }
+        area = next_area(space, start);
+        if (area != NULL && area->start < to) {
+            area = next_area(space, to - 1);
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A virtual memory area: a run of allocated VPNs, kept in an AVL tree
+ * ordered by start. Each node also records the free gap in front of it
+ * and the largest such gap in its subtree, so a free range can be found
+ * without visiting every area.
+ *
+ * @param start First VPN of the area.
+ * @param end VPN just past the area.
+ * @param ppn PPN that start is mapped to, or NO_MAPPING if the area is only reserved.
+ * @param perms Permissions of the area (PERM_* bits).
+ * @param left Areas below this one.
+ * @param right Areas above this one.
+ * @param height Height of the subtree rooted here.
+ * @param gap Free pages between the previous area (or the space's base) and start.
+ * @param max_gap Largest gap in the subtree rooted here.
+ */
+typedef struct vma {
+    uint64_t start;
+    uint64_t end;
+    uint64_t ppn;
+    int perms;
+    struct vma *left;
+    struct vma *right;
+    int height;
+    uint64_t gap;
+    uint64_t max_gap;
+} vma;
+
+/**
+ * An address space: the areas allocated in [base, limit) of a page table.
+ *
+ * @param pt The physical page number of the root of the page table.
+ * @param base Lowest VPN areas may use.
+ * @param limit VPN just past the highest one areas may use.
+ * @param root Root of the area tree.
+ * @param count Number of areas.
+ */
+typedef struct {
+    uint64_t pt;
+    uint64_t base;
+    uint64_t limit;
+    vma *root;
+    size_t count;
+} vma_space;
+
+void       vma_space_init(vma_space *space, uint64_t pt, uint64_t base, uint64_t limit);
+void       vma_space_destroy(vma_space *space);
+const vma *vma_find(const vma_space *space, uint64_t vpn);
+uint64_t   vma_find_free(const vma_space *space, uint64_t pages, uint64_t hint);
+uint64_t   vma_mmap(vma_space *space, uint64_t hint, uint64_t pages, uint64_t ppn, int perms);
+void       vma_munmap(vma_space *space, uint64_t vpn, uint64_t pages);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,18 +7,37 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define MAX_CMDS 10
 #define PERMISSIONS 0600
 
+/// Deepest nesting of if, while and for
+#define MAX_NESTING 32
+
+/// Most bytes a cat may read inside the shell, which ignores SIGINT
+#define IN_SHELL_CAT_MAX (1 << 20)
+
 /// Signal handler to reap zombie background processes
 static void sigchld_handler(int sig);
 
+/// Exit status of the last foreground command, for $? and conditions
+static int last_status;
+
+/// SIGCHLD alone, blocked while a foreground child is waited for
+static sigset_t sigchld_mask;
+
 /**
  * Perform any setup needed before shell starts
  * @return 0 on success, non-zero on failure
  */
 int prepare(void) {
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+
     struct sigaction sa;
     sa.sa_handler = sigchld_handler;
     sigemptyset(&sa.sa_mask);
@@ -33,6 +53,12 @@ int prepare(void) {
         return 1;
     }
 
+    // Builtins write to pipes from the shell itself; a closed pipe must not kill it
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror("signal");
+        return 1;
+    }
+
     return 0;
 }
 
@@ -44,6 +70,41 @@ int finalize(void) {
     return 0;
 }
 
+/**
+ * Block or unblock SIGCHLD. It is blocked from fork until a foreground
+ * child has been waited for, so that the handler cannot reap the child
+ * first and lose its exit status.
+ * @param hold 1 to block, 0 to unblock
+ */
+static void hold_sigchld(int hold) {
+    sigprocmask(hold ? SIG_BLOCK : SIG_UNBLOCK, &sigchld_mask, NULL);
+}
+
+/**
+ * Restore default signal handling in a freshly forked child
+ * @param background 1 if the child runs in the background
+ */
+static void child_signals(int background) {
+    signal(SIGINT, background ? SIG_IGN : SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    hold_sigchld(0);
+}
+
+/**
+ * Wait for a foreground child and record its exit status in last_status
+ * @param pid the child
+ */
+static void wait_foreground(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR && errno != ECHILD) {
+            perror("waitpid");
+        }
+        return;
+    }
+    last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
 /**
  * Check if arglist contains a special symbol
  * @param arglist argument list
@@ -74,6 +135,544 @@ int remove_background_ampersand(char** arglist, int* count) {
     return 0;
 }
 
+/*
+ * Builtins: echo, printf, true, false, test and [, basename and cat run
+ * inside the shell instead of being forked and executed. A builtin reads
+ * from and writes to the descriptors it is given, so redirections are
+ * opened for it rather than dup'ed over the shell's own, and a builtin
+ * pipeline stage runs on a thread between the stage's pipe ends.
+ * The shell ignores SIGINT, so only builtins bound to finish soon run
+ * inside it; a cat of anything but small regular files is forked.
+ */
+
+/// A builtin: reads in, writes out, and returns its exit status
+typedef int (*builtin_fn)(int argc, char** argv, int in, int out);
+
+/// Buffered output of a builtin
+typedef struct {
+    int fd;
+    int failed;
+    size_t len;
+    char buf[4096];
+} writer;
+
+/**
+ * Write straight to a builtin's descriptor, noting failure
+ * @param w the writer
+ * @param data the bytes
+ * @param len number of bytes
+ */
+static void out_raw(writer* w, const char* data, size_t len) {
+    while (!w->failed && len > 0) {
+        ssize_t n = write(w->fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // EPIPE included: SIGPIPE is ignored so that a builtin cannot kill the shell
+            w->failed = 1;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void out_flush(writer* w) {
+    out_raw(w, w->buf, w->len);
+    w->len = 0;
+}
+
+static void out_write(writer* w, const char* data, size_t len) {
+    if (len > sizeof(w->buf) - w->len) {
+        out_flush(w);
+        if (len > sizeof(w->buf)) {
+            out_raw(w, data, len);
+            return;
+        }
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void out_str(writer* w, const char* text) {
+    out_write(w, text, strlen(text));
+}
+
+/**
+ * Finish a builtin's output
+ * @param w the writer
+ * @param status the builtin's status
+ * @return status, or 1 if the output could not be written
+ */
+static int out_finish(writer* w, int status) {
+    out_flush(w);
+    return w->failed ? 1 : status;
+}
+
+static int builtin_true(int argc, char** argv, int in, int out) {
+    return 0;
+}
+
+static int builtin_false(int argc, char** argv, int in, int out) {
+    return 1;
+}
+
+/**
+ * echo [-n] [args...]
+ */
+static int builtin_echo(int argc, char** argv, int in, int out) {
+    writer w = {out, 0, 0, {0}};
+    int newline = 1, i = 1;
+    if (argc > 1 && strcmp(argv[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (; i < argc; i++) {
+        out_str(&w, argv[i]);
+        if (i + 1 < argc) {
+            out_write(&w, " ", 1);
+        }
+    }
+    if (newline) {
+        out_write(&w, "\n", 1);
+    }
+    return out_finish(&w, 0);
+}
+
+/**
+ * Write the character a backslash escape stands for
+ * @param w the writer
+ * @param text the text just after the backslash
+ * @return number of characters of text the escape used
+ */
+static int out_escape(writer* w, const char* text) {
+    static const char from[] = "\\abfnrtv", to[] = "\\\a\b\f\n\r\t\v";
+    const char* found = *text != '\0' ? strchr(from, *text) : NULL;
+    if (found != NULL) {
+        out_write(w, &to[found - from], 1);
+        return 1;
+    }
+    if (*text >= '0' && *text <= '7') {
+        int value = 0, n = 0;
+        while (n < 3 && text[n] >= '0' && text[n] <= '7') {
+            value = value * 8 + text[n++] - '0';
+        }
+        char c = (char)value;
+        out_write(w, &c, 1);
+        return n;
+    }
+    out_write(w, "\\", 1);
+    return 0;
+}
+
+/**
+ * printf FORMAT [args...]: backslash escapes, and %s, %b, %c, %d, %i,
+ * %u, %o, %x, %X, %e, %f, %g and %% with flags, width and precision.
+ * The format is reused while arguments remain.
+ */
+static int builtin_printf(int argc, char** argv, int in, int out) {
+    writer w = {out, 0, 0, {0}};
+    int status = 0, arg = 2;
+
+    if (argc < 2) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    do {
+        const char* f = argv[1];
+        while (*f != '\0') {
+            if (*f == '\\') {
+                f += 1 + out_escape(&w, f + 1);
+                continue;
+            }
+            if (*f != '%') {
+                out_write(&w, f++, 1);
+                continue;
+            }
+            if (f[1] == '%') {
+                out_write(&w, "%", 1);
+                f += 2;
+                continue;
+            }
+
+            // Copy the conversion, which snprintf then does for us
+            char spec[32], piece[512];
+            size_t n = 0;
+            spec[n++] = *f++;
+            while (*f != '\0' && strchr("-+ #0123456789.", *f) != NULL && n < sizeof(spec) - 4) {
+                spec[n++] = *f++;
+            }
+            char conv = *f != '\0' ? *f++ : 's';
+            const char* value = arg < argc ? argv[arg++] : NULL;
+            int len = 0;
+
+            if (conv == 's' || conv == 'b' || conv == 'c') {
+                const char* text = value != NULL ? value : "";
+                if (conv == 'b') {
+                    while (*text != '\0') {
+                        if (*text == '\\') {
+                            text += 1 + out_escape(&w, text + 1);
+                        } else {
+                            out_write(&w, text++, 1);
+                        }
+                    }
+                    continue;
+                }
+                spec[n++] = conv;
+                spec[n] = '\0';
+                len = conv == 'c' ? (*text != '\0' ? snprintf(piece, sizeof(piece), spec, *text) : 0)
+                                  : snprintf(piece, sizeof(piece), spec, text);
+            } else if (strchr("diouxX", conv) != NULL) {
+                char* end = "";
+                long long number = value != NULL ? strtoll(value, &end, 0) : 0;
+                if (*end != '\0') {
+                    fprintf(stderr, "printf: %s: invalid number\n", value);
+                    status = 1;
+                }
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conv;
+                spec[n] = '\0';
+                len = snprintf(piece, sizeof(piece), spec, number);
+            } else if (strchr("eEfFgG", conv) != NULL) {
+                char* end = "";
+                double number = value != NULL ? strtod(value, &end) : 0;
+                if (*end != '\0') {
+                    fprintf(stderr, "printf: %s: invalid number\n", value);
+                    status = 1;
+                }
+                spec[n++] = conv;
+                spec[n] = '\0';
+                len = snprintf(piece, sizeof(piece), spec, number);
+            } else {
+                fprintf(stderr, "printf: %%%c: invalid conversion\n", conv);
+                return out_finish(&w, 1);
+            }
+            out_write(&w, piece, len < (int)sizeof(piece) ? (size_t)len : sizeof(piece) - 1);
+        }
+    } while (arg < argc && arg > 2);
+
+    return out_finish(&w, status);
+}
+
+/// Parser state of a test expression
+typedef struct {
+    char** args;
+    int count;
+    int pos;
+    int error;
+} test_parser;
+
+static int test_or(test_parser* t);
+
+static int test_integer(test_parser* t, const char* text, long long* value) {
+    char* end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || errno != 0) {
+        fprintf(stderr, "test: %s: integer expression expected\n", text);
+        t->error = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int is_binary_op(const char* op) {
+    static const char* ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL};
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+static int is_unary_op(const char* op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefhLnprsSwxz", op[1]) != NULL;
+}
+
+static int test_unary(char op, const char* arg) {
+    struct stat st;
+    if (op == 'z') return *arg == '\0';
+    if (op == 'n') return *arg != '\0';
+    if (op == 'r') return access(arg, R_OK) == 0;
+    if (op == 'w') return access(arg, W_OK) == 0;
+    if (op == 'x') return access(arg, X_OK) == 0;
+    if (op == 'h' || op == 'L') return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    if (stat(arg, &st) == -1) return 0;
+    switch (op) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'f': return S_ISREG(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    default:  return 1;  // -e
+    }
+}
+
+static int test_binary(test_parser* t, const char* left, const char* op, const char* right) {
+    long long a, b;
+    if (op[0] != '-') {
+        return (strcmp(left, right) == 0) == (op[0] != '!');
+    }
+    if (!test_integer(t, left, &a) || !test_integer(t, right, &b)) {
+        return 0;
+    }
+    if (strcmp(op, "-eq") == 0) return a == b;
+    if (strcmp(op, "-ne") == 0) return a != b;
+    if (strcmp(op, "-lt") == 0) return a < b;
+    if (strcmp(op, "-le") == 0) return a <= b;
+    if (strcmp(op, "-gt") == 0) return a > b;
+    return a >= b;
+}
+
+/**
+ * primary: ( expr ) | unary-op arg | arg binary-op arg | arg
+ */
+static int test_primary(test_parser* t) {
+    int left = t->count - t->pos;
+    char** a = t->args + t->pos;
+
+    if (left <= 0) {
+        t->error = 1;
+        return 0;
+    }
+    if (left >= 3 && is_binary_op(a[1])) {
+        t->pos += 3;
+        return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (strcmp(a[0], "(") == 0 && left >= 2) {
+        t->pos++;
+        int value = test_or(t);
+        if (t->pos >= t->count || strcmp(t->args[t->pos], ")") != 0) {
+            t->error = 1;
+            return 0;
+        }
+        t->pos++;
+        return value;
+    }
+    if (left >= 2 && is_unary_op(a[0])) {
+        t->pos += 2;
+        return test_unary(a[0][1], a[1]);
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+static int test_not(test_parser* t) {
+    if (t->pos < t->count - 1 && strcmp(t->args[t->pos], "!") == 0) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(test_parser* t) {
+    int value = test_not(t);
+    while (t->pos < t->count && strcmp(t->args[t->pos], "-a") == 0) {
+        t->pos++;
+        value = test_not(t) && value;
+    }
+    return value;
+}
+
+static int test_or(test_parser* t) {
+    int value = test_and(t);
+    while (t->pos < t->count && strcmp(t->args[t->pos], "-o") == 0) {
+        t->pos++;
+        value = test_and(t) || value;
+    }
+    return value;
+}
+
+/**
+ * test EXPR and [ EXPR ]: file tests, string and integer comparisons, !, -a, -o and parentheses
+ */
+static int builtin_test(int argc, char** argv, int in, int out) {
+    test_parser t = {argv + 1, argc - 1, 0, 0};
+    if (strcmp(argv[0], "[") == 0) {
+        if (argc < 2 || strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        t.count--;
+    }
+    if (t.count == 0) {
+        return 1;
+    }
+    int value = test_or(&t);
+    if (!t.error && t.pos != t.count) {
+        fprintf(stderr, "%s: %s: unexpected argument\n", argv[0], t.args[t.pos]);
+        return 2;
+    }
+    return t.error ? 2 : !value;
+}
+
+/**
+ * basename PATH [SUFFIX]
+ */
+static int builtin_basename(int argc, char** argv, int in, int out) {
+    writer w = {out, 0, 0, {0}};
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "basename: usage: basename path [suffix]\n");
+        return 1;
+    }
+
+    const char* path = argv[1];
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/') {
+        end--;
+    }
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    if (end == 1 && path[0] == '/') {
+        start = 0;
+    } else if (argc == 3) {
+        size_t suffix = strlen(argv[2]);
+        if (suffix < end - start && memcmp(path + end - suffix, argv[2], suffix) == 0) {
+            end -= suffix;
+        }
+    }
+    out_write(&w, path + start, end - start);
+    out_write(&w, "\n", 1);
+    return out_finish(&w, 0);
+}
+
+/**
+ * cat [FILE...]; "-" or no file reads the input
+ */
+static int builtin_cat(int argc, char** argv, int in, int out) {
+    writer w = {out, 0, 0, {0}};
+    char buf[65536];
+    int status = 0;
+
+    for (int i = 1; i < argc || i == 1; i++) {
+        int from_input = argc == 1 || strcmp(argv[i], "-") == 0;
+        int fd = from_input ? in : open(argv[i], O_RDONLY);
+        ssize_t n;
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        while ((n = read(fd, buf, sizeof(buf))) != 0 && !w.failed) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                fprintf(stderr, "cat: %s: %s\n", from_input ? "-" : argv[i], strerror(errno));
+                status = 1;
+                break;
+            }
+            out_write(&w, buf, n);
+        }
+        if (!from_input) {
+            close(fd);
+        }
+    }
+    return out_finish(&w, status);
+}
+
+static const struct {
+    const char* name;
+    builtin_fn fn;
+} builtins[] = {
+    {"echo", builtin_echo},
+    {"printf", builtin_printf},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"test", builtin_test},
+    {"[", builtin_test},
+    {"basename", builtin_basename},
+    {"cat", builtin_cat},
+};
+
+/**
+ * @param name a command name
+ * @return the builtin of that name, or NULL
+ */
+static builtin_fn find_builtin(const char* name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return builtins[i].fn;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Decide whether a builtin may run inside the shell. Only cat can take
+ * long: it must read nothing but regular files, IN_SHELL_CAT_MAX bytes
+ * at most, or a pipe or an endless file could hang the shell past Ctrl-C
+ * @param fn the builtin
+ * @param arglist its arguments, NULL terminated
+ * @param in descriptor it would read from
+ * @return 1 if it may run in the shell, 0 if it must be forked
+ */
+static int runs_in_shell(builtin_fn fn, char** arglist, int in) {
+    static char* input_only[] = {"-", NULL};
+    char** files = arglist[1] != NULL ? arglist + 1 : input_only;
+    struct stat st;
+    off_t total = 0;
+
+    if (fn != builtin_cat) {
+        return 1;
+    }
+    for (; *files != NULL; files++) {
+        int from_input = strcmp(*files, "-") == 0;
+        if ((from_input ? fstat(in, &st) : stat(*files, &st)) == -1 || !S_ISREG(st.st_mode)) {
+            return 0;
+        }
+        total += st.st_size;
+        if (total > IN_SHELL_CAT_MAX) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Run a builtin
+ * @param fn the builtin
+ * @param arglist its arguments, NULL terminated
+ * @param in descriptor to read from
+ * @param out descriptor to write to
+ * @return its exit status
+ */
+static int run_builtin(builtin_fn fn, char** arglist, int in, int out) {
+    int argc = 0;
+    while (arglist[argc] != NULL) {
+        argc++;
+    }
+    return fn(argc, arglist, in, out);
+}
+
+/// A builtin pipeline stage, run on a thread of its own
+typedef struct {
+    builtin_fn fn;
+    char** arglist;
+    int in;
+    int out;
+    int status;
+    pthread_t thread;
+} builtin_stage;
+
+/**
+ * Thread body of a builtin pipeline stage; closes its pipe ends when done
+ * so that the neighboring stages see end of file
+ */
+static void* builtin_stage_main(void* arg) {
+    builtin_stage* stage = arg;
+    stage->status = run_builtin(stage->fn, stage->arglist, stage->in, stage->out);
+    if (stage->in != STDIN_FILENO) close(stage->in);
+    if (stage->out != STDOUT_FILENO) close(stage->out);
+    return NULL;
+}
+
 /**
  * Execute a single command (no pipes or redirection)
  * @param arglist the argument list
@@ -81,25 +680,33 @@ int remove_background_ampersand(char** arglist, int* count) {
  * @return 1 on success, 0 on error
  */
 int execute_command(char** arglist, int background) {
+    builtin_fn builtin = find_builtin(arglist[0]);
+    if (builtin != NULL && !background && runs_in_shell(builtin, arglist, STDIN_FILENO)) {
+        last_status = run_builtin(builtin, arglist, STDIN_FILENO, STDOUT_FILENO);
+        return 1;
+    }
+
+    hold_sigchld(1);
     pid_t pid = fork();
     if (pid == -1) {
         perror("fork");
+        hold_sigchld(0);
         return 0;
     } else if (pid == 0) {
         // child process
-        if (!background) signal(SIGINT, SIG_DFL);
-        else signal(SIGINT, SIG_IGN);
+        child_signals(background);
+        if (builtin != NULL) _exit(run_builtin(builtin, arglist, STDIN_FILENO, STDOUT_FILENO));
         execvp(arglist[0], arglist);
         perror("execvp");
         exit(1);
     }
 
     if (!background) {
-        int status;
-        if (waitpid(pid, &status, 0) == -1 && errno != EINTR && errno != ECHILD) {
-            perror("waitpid");
-        }
+        wait_foreground(pid);
+    } else {
+        last_status = 0;
     }
+    hold_sigchld(0);
 
     return 1;
 }
@@ -114,12 +721,27 @@ int execute_output_redirect(char** arglist, int symbol_index) {
     arglist[symbol_index] = NULL;
     const char* filename = arglist[symbol_index + 1];
 
+    builtin_fn builtin = find_builtin(arglist[0]);
+    if (builtin != NULL && runs_in_shell(builtin, arglist, STDIN_FILENO)) {
+        int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, PERMISSIONS);
+        if (fd < 0) {
+            perror("open");
+            last_status = 1;
+            return 1;
+        }
+        last_status = run_builtin(builtin, arglist, STDIN_FILENO, fd);
+        close(fd);
+        return 1;
+    }
+
+    hold_sigchld(1);
     pid_t pid = fork();
     if (pid == -1) {
         perror("fork");
+        hold_sigchld(0);
         return 0;
     } else if (pid == 0) {
-        signal(SIGINT, SIG_DFL);
+        child_signals(0);
         int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, PERMISSIONS);
         if (fd < 0) {
             perror("open");
@@ -132,10 +754,8 @@ int execute_output_redirect(char** arglist, int symbol_index) {
         exit(1);
     }
 
-    int status;
-    if (waitpid(pid, &status, 0) == -1 && errno != EINTR && errno != ECHILD) {
-        perror("waitpid");
-    }
+    wait_foreground(pid);
+    hold_sigchld(0);
     return 1;
 }
 
@@ -149,12 +769,30 @@ int execute_input_redirect(char** arglist, int symbol_index) {
     arglist[symbol_index] = NULL;
     const char* filename = arglist[symbol_index + 1];
 
+    builtin_fn builtin = find_builtin(arglist[0]);
+    if (builtin != NULL) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            perror("open");
+            last_status = 1;
+            return 1;
+        }
+        if (runs_in_shell(builtin, arglist, fd)) {
+            last_status = run_builtin(builtin, arglist, fd, STDOUT_FILENO);
+            close(fd);
+            return 1;
+        }
+        close(fd);
+    }
+
+    hold_sigchld(1);
     pid_t pid = fork();
     if (pid == -1) {
         perror("fork");
+        hold_sigchld(0);
         return 0;
     } else if (pid == 0) {
-        signal(SIGINT, SIG_DFL);
+        child_signals(0);
         int fd = open(filename, O_RDONLY);
         if (fd < 0) {
             perror("open");
@@ -167,10 +805,8 @@ int execute_input_redirect(char** arglist, int symbol_index) {
         exit(1);
     }
 
-    int status;
-    if (waitpid(pid, &status, 0) == -1 && errno != EINTR && errno != ECHILD) {
-        perror("waitpid");
-    }
+    wait_foreground(pid);
+    hold_sigchld(0);
     return 1;
 }
 
@@ -204,13 +840,34 @@ int execute_pipeline(char** arglist, int count) {
         }
     }
 
+    pid_t pids[cmd_count];
+    builtin_stage stages[cmd_count];
+    int owned[2 * cmd_count];  // pipe ends closed by a builtin stage's thread
+    for (int j = 0; j < 2 * (cmd_count - 1); j++) owned[j] = 0;
+
+    hold_sigchld(1);
     for (int i = 0; i < cmd_count; i++) {
+        stages[i].fn = find_builtin(commands[i][0]);
+        stages[i].in = i != 0 ? pipefds[(i - 1) * 2] : STDIN_FILENO;
+        if (stages[i].fn != NULL && !runs_in_shell(stages[i].fn, commands[i], stages[i].in)) {
+            stages[i].fn = NULL;
+        }
+        if (stages[i].fn != NULL) {
+            stages[i].arglist = commands[i];
+            stages[i].out = i != cmd_count - 1 ? pipefds[i * 2 + 1] : STDOUT_FILENO;
+            if (i != 0) owned[(i - 1) * 2] = 1;
+            if (i != cmd_count - 1) owned[i * 2 + 1] = 1;
+            pids[i] = -1;
+            continue;
+        }
+
         pid_t pid = fork();
         if (pid == -1) {
             perror("fork");
+            hold_sigchld(0);
             return 0;
         } else if (pid == 0) {
-            signal(SIGINT, SIG_DFL);
+            child_signals(0);
 
             if (i != 0) dup2(pipefds[(i - 1) * 2], STDIN_FILENO);
             if (i != cmd_count - 1) dup2(pipefds[i * 2 + 1], STDOUT_FILENO);
@@ -221,21 +878,46 @@ int execute_pipeline(char** arglist, int count) {
             perror("execvp");
             exit(1);
         }
+        pids[i] = pid;
     }
 
-    for (int j = 0; j < 2 * (cmd_count - 1); j++) close(pipefds[j]);
-    for (int i = 0; i < cmd_count; i++) wait(NULL);
+    // Builtins start once every child has forked, so no child is forked from a busy thread
+    for (int j = 0; j < 2 * (cmd_count - 1); j++) {
+        if (!owned[j]) close(pipefds[j]);
+    }
+    for (int i = 0; i < cmd_count; i++) {
+        if (stages[i].fn != NULL && pthread_create(&stages[i].thread, NULL, builtin_stage_main, &stages[i]) != 0) {
+            perror("pthread_create");
+            stages[i].fn = NULL;
+            stages[i].status = 1;
+            if (i != 0) close(stages[i].in);
+            if (i != cmd_count - 1) close(stages[i].out);
+        }
+    }
+
+    // The pipeline's status is that of its last command
+    for (int i = 0; i < cmd_count; i++) {
+        if (pids[i] != -1) {
+            wait_foreground(pids[i]);
+        } else if (stages[i].fn != NULL) {
+            pthread_join(stages[i].thread, NULL);
+            last_status = stages[i].status;
+        } else {
+            last_status = stages[i].status;
+        }
+    }
+    hold_sigchld(0);
 
     return 1;
 }
 
 /**
- * Main command handler, dispatches to appropriate execution method
+ * Dispatch a single command line to the appropriate execution method
  * @param count number of arguments
- * @param arglist array of argument strings
+ * @param arglist array of argument strings, NULL terminated
  * @return 1 to continue shell, 0 to exit
  */
-int process_arglist(int count, char** arglist) {
+int execute_arglist(int count, char** arglist) {
     int background = remove_background_ampersand(arglist, &count);
 
     int pipe_index = find_symbol(arglist, "|");
@@ -248,6 +930,1094 @@ int process_arglist(int count, char** arglist) {
     else return execute_command(arglist, background);
 }
 
+/*
+ * Scripts: variables, parameter expansion, if, while and for.
+ *
+ * Words are split on whitespace only, so ";" and the keywords must stand
+ * alone. Supported are NAME=value, $NAME, ${NAME}, ${NAME:-word}, $? and,
+ * in a script, $0 to $9 and $#; an unset variable falls back to the
+ * environment, and a word that expands to nothing is dropped. Control flow follows sh:
+ *
+ *     if cmd ; then ... elif cmd ; then ... else ... fi
+ *     while cmd ; do ... done
+ *     for NAME in words ; do ... done
+ *     break [n], continue [n]
+ *
+ * Lines are compiled into a flat program as they arrive: expansions are
+ * split into segments once, and control flow becomes jumps. The program
+ * runs when its outermost construct is complete, so loop bodies are
+ * re-executed without being parsed again.
+ */
+
+/// Segment kinds of a word
+enum { SEG_TEXT, SEG_VAR, SEG_DEFAULT, SEG_STATUS, SEG_ARG, SEG_ARG_COUNT, NUM_SEG_KINDS };
+
+/// A piece of a word: literal text or a parameter expansion
+typedef struct {
+    int kind;
+    int str;   // SEG_TEXT: the text; SEG_VAR, SEG_DEFAULT: the name (string pool offsets)
+    int word;  // SEG_DEFAULT: the word to use if the variable is unset or empty; SEG_ARG: the argument number
+} segment;
+
+/// A word: consecutive segments, concatenated after expansion
+typedef struct {
+    int first;
+    int count;
+} word;
+
+/// Opcodes of a compiled program
+enum {
+    OP_RUN,           // run words [a, a + b) as a command
+    OP_ASSIGN,        // set the variable named a (string pool offset) to word b
+    OP_JUMP,          // leave b for loops, then go to a
+    OP_JUMP_FALSE,    // go to a if the last command failed, taking the status from status slot b if b != 0
+    OP_FOR_INIT,      // start a for loop over words [a, a + b)
+    OP_FOR_NEXT,      // set the variable named a to the next item, or go to b when done
+    OP_FOR_END,       // end the innermost for loop
+    OP_CLEAR_STATUS,  // set the last status to 0
+    OP_SAVE_STATUS,   // copy the last status to status slot a
+    NUM_OPS
+};
+
+typedef struct {
+    int op;
+    int a;
+    int b;
+} instr;
+
+/// A compiled program; every reference is an index, so it holds no pointers into itself
+typedef struct {
+    instr* code;
+    size_t ncode, code_cap;
+    word* words;
+    size_t nwords, words_cap;
+    segment* segs;
+    size_t nsegs, segs_cap;
+    char* strings;
+    size_t nstrings, strings_cap;
+} program;
+
+/// Kinds and states of the constructs being compiled
+enum { BLOCK_IF, BLOCK_WHILE, BLOCK_FOR };
+enum { STATE_COND, STATE_BODY, STATE_ELSE };
+
+/// A construct still open while compiling
+typedef struct {
+    int kind;
+    int state;
+    int pending;  // the OP_JUMP_FALSE or OP_FOR_NEXT to point past the body, or -1
+    int top;      // loops: where continue goes
+    int* exits;   // jumps to point at the end of the construct
+    size_t nexits, exits_cap;
+} block;
+
+/// A for loop being run
+typedef struct {
+    char** items;
+    int count;
+    int next;
+} iterator;
+
+/// A shell variable
+typedef struct {
+    char* name;
+    char* value;
+} variable;
+
+/// Growable string
+typedef struct {
+    char* data;
+    size_t len, cap;
+} buffer;
+
+static program pending;
+static block blocks[MAX_NESTING];
+static int depth;
+
+static variable* variables;
+static size_t nvariables, variables_cap;
+
+/// Arguments of the script being run, its path first
+static char** script_argv;
+static int script_argc;
+
+/**
+ * Make room in a growable array
+ * @param array the array
+ * @param cap its capacity in elements, updated
+ * @param need number of elements needed
+ * @param size size of an element
+ * @return the array, possibly moved
+ */
+static void* grow(void* array, size_t* cap, size_t need, size_t size) {
+    if (need <= *cap) {
+        return array;
+    }
+    size_t new_cap = *cap ? *cap : 16;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    array = realloc(array, new_cap * size);
+    if (array == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    *cap = new_cap;
+    return array;
+}
+
+static void buffer_append(buffer* buf, const char* text, size_t len) {
+    buf->data = grow(buf->data, &buf->cap, buf->len + len + 1, 1);
+    memcpy(buf->data + buf->len, text, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+static char* copy_string(const char* text) {
+    char* copy = strdup(text);
+    if (copy == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    return copy;
+}
+
+/**
+ * Look up a variable, falling back to the environment
+ * @param name the variable name
+ * @return its value, or NULL if unset
+ */
+static const char* get_variable(const char* name) {
+    for (size_t i = 0; i < nvariables; i++) {
+        if (strcmp(variables[i].name, name) == 0) {
+            return variables[i].value;
+        }
+    }
+    return getenv(name);
+}
+
+static void set_variable(const char* name, const char* value) {
+    for (size_t i = 0; i < nvariables; i++) {
+        if (strcmp(variables[i].name, name) == 0) {
+            free(variables[i].value);
+            variables[i].value = copy_string(value);
+            return;
+        }
+    }
+    variables = grow(variables, &variables_cap, nvariables + 1, sizeof(variable));
+    variables[nvariables].name = copy_string(name);
+    variables[nvariables].value = copy_string(value);
+    nvariables++;
+}
+
+static int is_name_char(char c, int first) {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (!first && c >= '0' && c <= '9');
+}
+
+/**
+ * @param text the text
+ * @param len its length
+ * @return length of the variable name at the start of text, 0 if there is none
+ */
+static size_t name_length(const char* text, size_t len) {
+    size_t n = 0;
+    while (n < len && is_name_char(text[n], n == 0)) {
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Add a string to the string pool of a program
+ * @param prog the program
+ * @param text the string
+ * @param len its length
+ * @return its offset in the pool, where it is NUL terminated
+ */
+static int add_string(program* prog, const char* text, size_t len) {
+    int offset = (int)prog->nstrings;
+    prog->strings = grow(prog->strings, &prog->strings_cap, prog->nstrings + len + 1, 1);
+    memcpy(prog->strings + offset, text, len);
+    prog->strings[offset + len] = '\0';
+    prog->nstrings += len + 1;
+    return offset;
+}
+
+static int emit(program* prog, int op, int a, int b) {
+    prog->code = grow(prog->code, &prog->code_cap, prog->ncode + 1, sizeof(instr));
+    prog->code[prog->ncode] = (instr){op, a, b};
+    return (int)prog->ncode++;
+}
+
+/**
+ * Reserve consecutive word slots, for the words of one instruction
+ * @param prog the program
+ * @param count number of words
+ * @return index of the first slot
+ */
+static int reserve_words(program* prog, int count) {
+    int first = (int)prog->nwords;
+    prog->words = grow(prog->words, &prog->words_cap, prog->nwords + count, sizeof(word));
+    prog->nwords += count;
+    return first;
+}
+
+/**
+ * Compile a word into segments, splitting out its parameter expansions.
+ * A "$" that does not start a well-formed expansion is literal. Default
+ * words of ${NAME:-word} take slots of their own after the reserved ones.
+ * @param prog the program
+ * @param text the word
+ * @param len its length
+ * @param index slot to store the word in, from reserve_words
+ */
+static void compile_word(program* prog, const char* text, size_t len, int index) {
+    segment* local = malloc((len + 1) * sizeof(segment));
+    size_t n = 0, literal = 0, i = 0;
+    if (local == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    while (i < len) {
+        size_t start = i;
+        segment seg = {SEG_STATUS, 0, 0};
+        if (text[i] != '$' || i + 1 == len) {
+            i++;
+            continue;
+        }
+
+        if (text[i + 1] == '?') {
+            i += 2;
+        } else if (text[i + 1] == '#') {
+            seg.kind = SEG_ARG_COUNT;
+            i += 2;
+        } else if (text[i + 1] >= '0' && text[i + 1] <= '9') {
+            seg = (segment){SEG_ARG, 0, text[i + 1] - '0'};
+            i += 2;
+        } else if (text[i + 1] == '{') {
+            size_t name_len = name_length(text + i + 2, len - i - 2);
+            size_t after = i + 2 + name_len;
+            if (name_len > 0 && after < len && text[after] == '}') {
+                seg = (segment){SEG_VAR, add_string(prog, text + i + 2, name_len), 0};
+                i = after + 1;
+            } else if (name_len > 0 && after + 1 < len && text[after] == ':' && text[after + 1] == '-') {
+                // Find the matching brace, skipping nested ${...}
+                size_t j = after + 2;
+                int open = 1;
+                for (; j < len; j++) {
+                    if (text[j] == '$' && j + 1 < len && text[j + 1] == '{') {
+                        open++;
+                        j++;
+                    } else if (text[j] == '}' && --open == 0) {
+                        break;
+                    }
+                }
+                if (j == len) {
+                    i++;
+                    continue;
+                }
+                int fallback = reserve_words(prog, 1);
+                compile_word(prog, text + after + 2, j - after - 2, fallback);
+                seg = (segment){SEG_DEFAULT, add_string(prog, text + i + 2, name_len), fallback};
+                i = j + 1;
+            } else {
+                i++;
+                continue;
+            }
+        } else {
+            size_t name_len = name_length(text + i + 1, len - i - 1);
+            if (name_len == 0) {
+                i++;
+                continue;
+            }
+            seg = (segment){SEG_VAR, add_string(prog, text + i + 1, name_len), 0};
+            i += 1 + name_len;
+        }
+
+        if (start > literal) {
+            local[n++] = (segment){SEG_TEXT, add_string(prog, text + literal, start - literal), 0};
+        }
+        local[n++] = seg;
+        literal = i;
+    }
+    if (len > literal) {
+        local[n++] = (segment){SEG_TEXT, add_string(prog, text + literal, len - literal), 0};
+    }
+
+    prog->segs = grow(prog->segs, &prog->segs_cap, prog->nsegs + n, sizeof(segment));
+    memcpy(prog->segs + prog->nsegs, local, n * sizeof(segment));
+    free(local);
+
+    prog->words[index] = (word){(int)prog->nsegs, (int)n};
+    prog->nsegs += n;
+}
+
+/**
+ * Expand a compiled word
+ * @param prog the program
+ * @param w index of the word
+ * @param out the expansion is appended here
+ */
+static void expand_word(const program* prog, int w, buffer* out) {
+    const word* wd = &prog->words[w];
+    for (int i = 0; i < wd->count; i++) {
+        const segment* seg = &prog->segs[wd->first + i];
+        const char* str = prog->strings + seg->str;
+        const char* value;
+        char number[16];
+
+        switch (seg->kind) {
+        case SEG_TEXT:
+            buffer_append(out, str, strlen(str));
+            break;
+        case SEG_VAR:
+            value = get_variable(str);
+            if (value != NULL) {
+                buffer_append(out, value, strlen(value));
+            }
+            break;
+        case SEG_DEFAULT:
+            value = get_variable(str);
+            if (value != NULL && *value != '\0') {
+                buffer_append(out, value, strlen(value));
+            } else {
+                expand_word(prog, seg->word, out);
+            }
+            break;
+        case SEG_STATUS:
+            snprintf(number, sizeof(number), "%d", last_status);
+            buffer_append(out, number, strlen(number));
+            break;
+        case SEG_ARG:
+            if (seg->word < script_argc) {
+                buffer_append(out, script_argv[seg->word], strlen(script_argv[seg->word]));
+            }
+            break;
+        case SEG_ARG_COUNT:
+            snprintf(number, sizeof(number), "%d", script_argc > 0 ? script_argc - 1 : 0);
+            buffer_append(out, number, strlen(number));
+            break;
+        }
+    }
+}
+
+/**
+ * Expand consecutive words into a NULL terminated list, dropping words that expand to nothing
+ * @param prog the program
+ * @param first index of the first word
+ * @param count number of words
+ * @param out_count number of strings in the list, set
+ * @return the list; free it with free_words
+ */
+static char** expand_words(const program* prog, int first, int count, int* out_count) {
+    char** list = malloc((count + 1) * sizeof(char*));
+    int n = 0;
+    if (list == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        buffer buf = {NULL, 0, 0};
+        expand_word(prog, first + i, &buf);
+        if (buf.len > 0) {
+            list[n++] = buf.data;
+        } else {
+            free(buf.data);
+        }
+    }
+    list[n] = NULL;
+    *out_count = n;
+    return list;
+}
+
+/**
+ * Free a list from expand_words
+ * @param list the list
+ * @param count number of strings expand_words put in it
+ */
+static void free_words(char** list, int count) {
+    for (int i = 0; i < count; i++) {
+        free(list[i]);
+    }
+    free(list);
+}
+
+/**
+ * Run a compiled program
+ * @param prog the program
+ * @return 1 to continue shell, 0 to exit
+ */
+static int run_program(const program* prog) {
+    iterator* loops = NULL;
+    size_t nloops = 0, loops_cap = 0;
+    size_t pc = 0;
+    int keep_going = 1;
+    // While loops keep the status of their last body command in the slot of their depth; slot 0 is unused
+    int statuses[MAX_NESTING + 1] = {0};
+
+    while (keep_going && pc < prog->ncode) {
+        const instr* in = &prog->code[pc++];
+        char** list;
+        int count;
+        buffer buf = {NULL, 0, 0};
+
+        // Only a damaged cached program could leave more loops than it entered
+        size_t needs = in->op == OP_JUMP ? (size_t)in->b : in->op == OP_FOR_NEXT || in->op == OP_FOR_END;
+        if (needs > nloops) {
+            fprintf(stderr, "myshell: corrupt program\n");
+            last_status = 2;
+            break;
+        }
+
+        switch (in->op) {
+        case OP_RUN:
+            list = expand_words(prog, in->a, in->b, &count);
+            if (count > 0) {
+                // The execute_* functions cut the list short with NULLs, so hand them a copy
+                char* args[count + 1];
+                memcpy(args, list, (count + 1) * sizeof(char*));
+                keep_going = execute_arglist(count, args);
+            } else {
+                last_status = 0;
+            }
+            free_words(list, count);
+            break;
+        case OP_ASSIGN:
+            buffer_append(&buf, "", 0);
+            expand_word(prog, in->b, &buf);
+            set_variable(prog->strings + in->a, buf.data);
+            free(buf.data);
+            last_status = 0;
+            break;
+        case OP_JUMP:
+            for (int i = 0; i < in->b; i++) {
+                nloops--;
+                free_words(loops[nloops].items, loops[nloops].count);
+            }
+            pc = in->a;
+            break;
+        case OP_JUMP_FALSE:
+            if (last_status != 0) {
+                last_status = in->b != 0 ? statuses[in->b] : last_status;
+                pc = in->a;
+            }
+            break;
+        case OP_FOR_INIT:
+            loops = grow(loops, &loops_cap, nloops + 1, sizeof(iterator));
+            loops[nloops].items = expand_words(prog, in->a, in->b, &loops[nloops].count);
+            loops[nloops].next = 0;
+            nloops++;
+            // A loop whose body never runs succeeds
+            last_status = 0;
+            break;
+        case OP_FOR_NEXT:
+            if (loops[nloops - 1].next == loops[nloops - 1].count) {
+                pc = in->b;
+            } else {
+                set_variable(prog->strings + in->a, loops[nloops - 1].items[loops[nloops - 1].next++]);
+            }
+            break;
+        case OP_FOR_END:
+            nloops--;
+            free_words(loops[nloops].items, loops[nloops].count);
+            break;
+        case OP_CLEAR_STATUS:
+            last_status = 0;
+            break;
+        case OP_SAVE_STATUS:
+            statuses[in->a] = last_status;
+            break;
+        }
+    }
+
+    while (nloops > 0) {
+        nloops--;
+        free_words(loops[nloops].items, loops[nloops].count);
+    }
+    free(loops);
+    return keep_going;
+}
+
+/**
+ * Discard a program's code, keeping its memory for the next one
+ * @param prog the program
+ */
+static void program_clear(program* prog) {
+    prog->ncode = prog->nwords = prog->nsegs = prog->nstrings = 0;
+}
+
+/**
+ * Discard the program being compiled and every open construct
+ */
+static void discard_pending(void) {
+    while (depth > 0) {
+        free(blocks[--depth].exits);
+    }
+    program_clear(&pending);
+}
+
+static void add_exit(block* blk, int jump) {
+    blk->exits = grow(blk->exits, &blk->exits_cap, blk->nexits + 1, sizeof(int));
+    blk->exits[blk->nexits++] = jump;
+}
+
+/**
+ * Close the innermost construct, pointing its pending jump and its exits at the current end of the program
+ * @param prog the program
+ */
+static void close_block(program* prog) {
+    block* blk = &blocks[--depth];
+    if (blk->pending >= 0 && prog->code[blk->pending].op == OP_FOR_NEXT) {
+        prog->code[blk->pending].b = (int)prog->ncode;
+    } else if (blk->pending >= 0) {
+        prog->code[blk->pending].a = (int)prog->ncode;
+    }
+    for (size_t i = 0; i < blk->nexits; i++) {
+        prog->code[blk->exits[i]].a = (int)prog->ncode;
+    }
+    free(blk->exits);
+}
+
+static block* open_block(int kind, int state) {
+    if (depth == MAX_NESTING) {
+        return NULL;
+    }
+    blocks[depth] = (block){kind, state, -1, -1, NULL, 0, 0};
+    return &blocks[depth++];
+}
+
+static int is_assignment(const char* text) {
+    size_t name_len = name_length(text, strlen(text));
+    return name_len > 0 && text[name_len] == '=';
+}
+
+/**
+ * Compile break or continue
+ * @param prog the program
+ * @param args the command's words
+ * @param count number of words
+ * @return 1 on success, 0 on a syntax error
+ */
+static int compile_loop_jump(program* prog, char** args, int count) {
+    int is_break = strcmp(args[0], "break") == 0;
+    long levels = 1;
+    int pops = 0, target = -1;
+
+    if (count > 2) {
+        return 0;
+    }
+    if (count == 2) {
+        char* end;
+        levels = strtol(args[1], &end, 10);
+        if (*end != '\0' || levels < 1) {
+            return 0;
+        }
+    }
+
+    // Find the levels-th enclosing loop (or the outermost); inner for loops must be ended on the way out
+    for (int i = depth - 1; i >= 0 && levels > 0; i--) {
+        if (blocks[i].kind == BLOCK_IF) {
+            continue;
+        }
+        if (target >= 0 && blocks[target].kind == BLOCK_FOR) {
+            pops++;
+        }
+        target = i;
+        levels--;
+    }
+    if (target < 0) {
+        fprintf(stderr, "%s: only meaningful in a loop\n", args[0]);
+        return 1;
+    }
+
+    if (is_break) {
+        add_exit(&blocks[target], emit(prog, OP_JUMP, -1, pops));
+    } else {
+        emit(prog, OP_JUMP, blocks[target].top, pops);
+    }
+    return 1;
+}
+
+/**
+ * Compile one command: a keyword and what follows it, a break or
+ * continue, assignments, or a command to run
+ * @param prog the program
+ * @param args the command's words
+ * @param count number of words
+ * @return 1 on success, 0 on a syntax error
+ */
+static int compile_command(program* prog, char** args, int count) {
+    block* top = depth > 0 ? &blocks[depth - 1] : NULL;
+    const char* keyword = count > 0 ? args[0] : "";
+
+    if (count == 0) {
+        return 1;
+    }
+
+    if (strcmp(keyword, "if") == 0) {
+        if (open_block(BLOCK_IF, STATE_COND) == NULL) return 0;
+    } else if (strcmp(keyword, "then") == 0) {
+        if (top == NULL || top->kind != BLOCK_IF || top->state != STATE_COND) return 0;
+        top->pending = emit(prog, OP_JUMP_FALSE, -1, 0);
+        top->state = STATE_BODY;
+    } else if (strcmp(keyword, "elif") == 0 || strcmp(keyword, "else") == 0) {
+        if (top == NULL || top->kind != BLOCK_IF || top->state != STATE_BODY) return 0;
+        add_exit(top, emit(prog, OP_JUMP, -1, 0));
+        prog->code[top->pending].a = (int)prog->ncode;
+        top->pending = -1;
+        top->state = keyword[2] == 'i' ? STATE_COND : STATE_ELSE;
+    } else if (strcmp(keyword, "fi") == 0) {
+        if (top == NULL || top->kind != BLOCK_IF || top->state == STATE_COND || count > 1) return 0;
+        if (top->state == STATE_BODY) {
+            // No else: the last condition's failure skips to a status reset, which the bodies jump over
+            add_exit(top, emit(prog, OP_JUMP, -1, 0));
+            prog->code[top->pending].a = (int)prog->ncode;
+            top->pending = -1;
+            emit(prog, OP_CLEAR_STATUS, 0, 0);
+        }
+        close_block(prog);
+        return 1;
+    } else if (strcmp(keyword, "while") == 0) {
+        block* blk = open_block(BLOCK_WHILE, STATE_COND);
+        if (blk == NULL) return 0;
+        // Each pass saves the previous body's status, which the loop exits with once the condition fails
+        emit(prog, OP_CLEAR_STATUS, 0, 0);
+        blk->top = (int)prog->ncode;
+        emit(prog, OP_SAVE_STATUS, depth, 0);
+    } else if (strcmp(keyword, "for") == 0) {
+        if (count < 3 || strcmp(args[2], "in") != 0 || name_length(args[1], strlen(args[1])) != strlen(args[1])) {
+            return 0;
+        }
+        block* blk = open_block(BLOCK_FOR, STATE_COND);
+        if (blk == NULL) return 0;
+        int first = reserve_words(prog, count - 3);
+        for (int i = 3; i < count; i++) {
+            compile_word(prog, args[i], strlen(args[i]), first + i - 3);
+        }
+        emit(prog, OP_FOR_INIT, first, count - 3);
+        blk->top = (int)prog->ncode;
+        blk->pending = emit(prog, OP_FOR_NEXT, add_string(prog, args[1], strlen(args[1])), -1);
+        return 1;
+    } else if (strcmp(keyword, "do") == 0) {
+        if (top == NULL || top->kind == BLOCK_IF || top->state != STATE_COND) return 0;
+        if (top->kind == BLOCK_WHILE) {
+            top->pending = emit(prog, OP_JUMP_FALSE, -1, depth);
+        }
+        top->state = STATE_BODY;
+    } else if (strcmp(keyword, "done") == 0) {
+        if (top == NULL || top->kind == BLOCK_IF || top->state != STATE_BODY || count > 1) return 0;
+        emit(prog, OP_JUMP, top->top, 0);
+        if (top->kind == BLOCK_FOR) {
+            // for: exits and the exhausted OP_FOR_NEXT land on the OP_FOR_END
+            close_block(prog);
+            emit(prog, OP_FOR_END, 0, 0);
+        } else {
+            close_block(prog);
+        }
+        return 1;
+    } else if (strcmp(keyword, "break") == 0 || strcmp(keyword, "continue") == 0) {
+        return compile_loop_jump(prog, args, count);
+    } else {
+        int assignments = 0;
+        while (assignments < count && is_assignment(args[assignments])) {
+            assignments++;
+        }
+        if (assignments == count) {
+            for (int i = 0; i < count; i++) {
+                size_t name_len = strchr(args[i], '=') - args[i];
+                int value = reserve_words(prog, 1);
+                compile_word(prog, args[i] + name_len + 1, strlen(args[i] + name_len + 1), value);
+                emit(prog, OP_ASSIGN, add_string(prog, args[i], name_len), value);
+            }
+        } else {
+            int first = reserve_words(prog, count);
+            for (int i = 0; i < count; i++) {
+                compile_word(prog, args[i], strlen(args[i]), first + i);
+            }
+            emit(prog, OP_RUN, first, count);
+        }
+        return 1;
+    }
+
+    // A keyword may be followed by a command on the same line
+    return compile_command(prog, args + 1, count - 1);
+}
+
+/**
+ * Compile a line of commands separated by ";"
+ * @param prog the program
+ * @param count number of words
+ * @param arglist the words
+ * @return NULL on success, or the word a syntax error is near
+ */
+static const char* compile_line(program* prog, int count, char** arglist) {
+    int start = 0;
+    for (int i = 0; i <= count; i++) {
+        if (i == count || strcmp(arglist[i], ";") == 0) {
+            if (!compile_command(prog, arglist + start, i - start)) {
+                return i > start ? arglist[start] : ";";
+            }
+            start = i + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Main command handler: compiles the line, and runs what has been
+ * compiled once no if, while or for is left open
+ * @param count number of arguments
+ * @param arglist array of argument strings
+ * @return 1 to continue shell, 0 to exit
+ */
+int process_arglist(int count, char** arglist) {
+    const char* error = compile_line(&pending, count, arglist);
+    if (error != NULL) {
+        fprintf(stderr, "myshell: syntax error near '%s'\n", error);
+        discard_pending();
+        last_status = 2;
+        return 1;
+    }
+    if (depth > 0) {
+        return 1;
+    }
+
+    int keep_going = run_program(&pending);
+    program_clear(&pending);
+    return keep_going;
+}
+
+/*
+ * Script files. A script is compiled as a whole before it runs, and the
+ * compiled program is cached in .NAME.mshc next to it, keyed by the
+ * script's real path, size and modification time. Every reference in a
+ * program is an index, so the cache is the program's arrays written out
+ * as they are; later runs map it and execute it in place, without
+ * reading or parsing the script at all. Caching is best effort: a
+ * script in a read-only directory is simply compiled every time.
+ */
+
+#define CACHE_MAGIC   0x4348534dU  // "MSHC"
+#define CACHE_VERSION 3
+
+/// Header of a cache file; the key path and the program's arrays follow it, each padded to 8 bytes
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t script_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t path_len;
+    uint64_t ncode, nwords, nsegs, nstrings;
+} cache_header;
+
+static size_t padded(size_t len) {
+    return (len + 7) & ~(size_t)7;
+}
+
+/**
+ * @param path path of a script
+ * @return path of its cache file, malloc'd
+ */
+static char* cache_path_of(const char* path) {
+    const char* slash = strrchr(path, '/');
+    size_t dir_len = slash != NULL ? (size_t)(slash - path + 1) : 0;
+    char* cache = malloc(strlen(path) + sizeof(".") + sizeof(".mshc"));
+    if (cache == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sprintf(cache, "%.*s.%s.mshc", (int)dir_len, path, path + dir_len);
+    return cache;
+}
+
+/**
+ * Check that every index in a program is in range, so that a damaged
+ * cache cannot make run_program read out of bounds or recurse forever
+ * @param prog the program
+ * @return 1 if it is sound, 0 otherwise
+ */
+static int program_valid(const program* prog) {
+    if (prog->nstrings > INT32_MAX || prog->nwords > INT32_MAX || prog->nsegs > INT32_MAX ||
+        (prog->nstrings > 0 && prog->strings[prog->nstrings - 1] != '\0')) {
+        return 0;
+    }
+    for (size_t i = 0; i < prog->ncode; i++) {
+        const instr* in = &prog->code[i];
+        int ok;
+        switch (in->op) {
+        case OP_RUN:
+        case OP_FOR_INIT:
+            ok = in->a >= 0 && in->b >= 0 && (size_t)in->a + in->b <= prog->nwords;
+            break;
+        case OP_ASSIGN:
+            ok = in->a >= 0 && (size_t)in->a < prog->nstrings && in->b >= 0 && (size_t)in->b < prog->nwords;
+            break;
+        case OP_JUMP:
+            ok = in->a >= 0 && (size_t)in->a <= prog->ncode && in->b >= 0;
+            break;
+        case OP_JUMP_FALSE:
+            ok = in->a >= 0 && (size_t)in->a <= prog->ncode && in->b >= 0 && in->b <= MAX_NESTING;
+            break;
+        case OP_SAVE_STATUS:
+            ok = in->a >= 1 && in->a <= MAX_NESTING;
+            break;
+        case OP_FOR_NEXT:
+            ok = in->a >= 0 && (size_t)in->a < prog->nstrings && in->b >= 0 && (size_t)in->b <= prog->ncode;
+            break;
+        default:
+            ok = in->op == OP_FOR_END || in->op == OP_CLEAR_STATUS;
+        }
+        if (!ok) {
+            return 0;
+        }
+    }
+    for (size_t w = 0; w < prog->nwords; w++) {
+        const word* wd = &prog->words[w];
+        if (wd->first < 0 || wd->count < 0 || (size_t)wd->first + wd->count > prog->nsegs) {
+            return 0;
+        }
+        for (int i = 0; i < wd->count; i++) {
+            const segment* seg = &prog->segs[wd->first + i];
+            // Default words always come after the word using them, which rules out cycles
+            int named = seg->kind == SEG_TEXT || seg->kind == SEG_VAR || seg->kind == SEG_DEFAULT;
+            if (seg->kind < 0 || seg->kind >= NUM_SEG_KINDS ||
+                (named && (seg->str < 0 || (size_t)seg->str >= prog->nstrings)) ||
+                (seg->kind == SEG_DEFAULT && (seg->word <= (int)w || (size_t)seg->word >= prog->nwords)) ||
+                (seg->kind == SEG_ARG && (seg->word < 0 || seg->word > 9))) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Map a script's cached program, if there is an up to date one. Everything
+ * the header checks is public, so the cache is only trusted if it belongs
+ * to us or to the script's owner and nobody else can write to it
+ * @param cache_path path of the cache file
+ * @param key real path of the script
+ * @param st the script's status
+ * @param prog set to the program, pointing into the mapping
+ * @param map_len set to the length of the mapping
+ * @return the mapping, or NULL if there is no usable cache
+ */
+static void* load_cache(const char* cache_path, const char* key, const struct stat* st, program* prog,
+                        size_t* map_len) {
+    struct stat cache_st;
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &cache_st) == -1 || !S_ISREG(cache_st.st_mode) ||
+        (cache_st.st_uid != geteuid() && cache_st.st_uid != st->st_uid) ||
+        (cache_st.st_mode & (S_IWGRP | S_IWOTH)) || (size_t)cache_st.st_size < sizeof(cache_header)) {
+        close(fd);
+        return NULL;
+    }
+    *map_len = cache_st.st_size;
+    char* map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const cache_header* hdr = (const cache_header*)map;
+    size_t key_len = strlen(key);
+    size_t offset = sizeof(cache_header) + padded(key_len);
+    if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION ||
+        hdr->script_size != (uint64_t)st->st_size || hdr->mtime_sec != st->st_mtim.tv_sec ||
+        hdr->mtime_nsec != st->st_mtim.tv_nsec || hdr->path_len != key_len ||
+        offset > *map_len || memcmp(map + sizeof(cache_header), key, key_len) != 0 ||
+        hdr->ncode > *map_len / sizeof(instr) || hdr->nwords > *map_len / sizeof(word) ||
+        hdr->nsegs > *map_len / sizeof(segment) || hdr->nstrings > *map_len) {
+        munmap(map, *map_len);
+        return NULL;
+    }
+
+    size_t sizes[4] = {
+        hdr->ncode * sizeof(instr), hdr->nwords * sizeof(word), hdr->nsegs * sizeof(segment), hdr->nstrings
+    };
+    void* arrays[4];
+    for (int i = 0; i < 4; i++) {
+        if (padded(sizes[i]) > *map_len - offset) {
+            munmap(map, *map_len);
+            return NULL;
+        }
+        arrays[i] = map + offset;
+        offset += padded(sizes[i]);
+    }
+
+    program mapped = {
+        .code = arrays[0], .ncode = hdr->ncode, .words = arrays[1], .nwords = hdr->nwords,
+        .segs = arrays[2], .nsegs = hdr->nsegs, .strings = arrays[3], .nstrings = hdr->nstrings
+    };
+    if (!program_valid(&mapped)) {
+        munmap(map, *map_len);
+        return NULL;
+    }
+    *prog = mapped;
+    return map;
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+    static const char zeros[8];
+    size_t pad = padded(len) - len;
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data = (const char*)data + n;
+        len -= n;
+    }
+    return pad == 0 || write(fd, zeros, pad) == (ssize_t)pad;
+}
+
+/**
+ * Write a script's compiled program to its cache file. The file is
+ * written under a temporary name and renamed into place, so a concurrent
+ * run never maps a partial cache.
+ * @param cache_path path of the cache file
+ * @param key real path of the script
+ * @param st the script's status
+ * @param prog the program
+ */
+static void write_cache(const char* cache_path, const char* key, const struct stat* st, const program* prog) {
+    cache_header hdr = {
+        CACHE_MAGIC, CACHE_VERSION, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec, strlen(key),
+        prog->ncode, prog->nwords, prog->nsegs, prog->nstrings
+    };
+    char* tmp = malloc(strlen(cache_path) + sizeof(".XXXXXX"));
+    if (tmp == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sprintf(tmp, "%s.XXXXXX", cache_path);
+
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        free(tmp);
+        return;
+    }
+    int ok = write_all(fd, &hdr, sizeof(hdr)) && write_all(fd, key, hdr.path_len) &&
+             write_all(fd, prog->code, prog->ncode * sizeof(instr)) &&
+             write_all(fd, prog->words, prog->nwords * sizeof(word)) &&
+             write_all(fd, prog->segs, prog->nsegs * sizeof(segment)) &&
+             write_all(fd, prog->strings, prog->nstrings);
+    if (close(fd) == -1 || !ok || rename(tmp, cache_path) == -1) {
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+/**
+ * Compile a script file, split into words the same way shell.c splits its input
+ * @param file the open script
+ * @param path its path, for messages
+ * @param prog the program to compile into
+ * @return 1 on success, 0 on a syntax error
+ */
+static int compile_script(FILE* file, const char* path, program* prog) {
+    char* line = NULL;
+    size_t size = 0;
+    char** words = NULL;
+    size_t words_cap = 0;
+    int line_no = 0;
+    const char* error = NULL;
+
+    while (error == NULL && getline(&line, &size, file) != -1) {
+        int count = 0;
+        line_no++;
+        for (char* tok = strtok(line, " \t\n"); tok != NULL; tok = strtok(NULL, " \t\n")) {
+            words = grow(words, &words_cap, count + 2, sizeof(char*));
+            words[count++] = tok;
+        }
+        if (count > 0) {
+            words[count] = NULL;
+            error = compile_line(prog, count, words);
+        }
+    }
+
+    if (error != NULL) {
+        fprintf(stderr, "myshell: %s: line %d: syntax error near '%s'\n", path, line_no, error);
+    } else if (depth > 0) {
+        fprintf(stderr, "myshell: %s: unexpected end of file\n", path);
+    }
+    free(words);
+    free(line);
+    return error == NULL && depth == 0;
+}
+
+static void program_free(program* prog) {
+    free(prog->code);
+    free(prog->words);
+    free(prog->segs);
+    free(prog->strings);
+}
+
+/**
+ * Run a script file, from its cached compiled form when that is up to date
+ * @param argc number of arguments, the script's path included
+ * @param argv the script's path, then its arguments ($1 onwards)
+ * @return exit status for the shell
+ */
+int process_script(int argc, char** argv) {
+    const char* path = argv[0];
+    struct stat st;
+    program prog = {0};
+    size_t map_len = 0;
+    void* map = NULL;
+
+    if (stat(path, &st) == -1) {
+        perror(path);
+        return 127;
+    }
+    char* key = realpath(path, NULL);
+    char* cache_path = cache_path_of(path);
+    if (key != NULL) {
+        map = load_cache(cache_path, key, &st, &prog, &map_len);
+    }
+
+    if (map == NULL) {
+        FILE* file = fopen(path, "r");
+        int compiled = file != NULL && compile_script(file, path, &prog);
+        if (file == NULL) {
+            perror(path);
+        } else {
+            fclose(file);
+        }
+        if (!compiled) {
+            discard_pending();
+            program_free(&prog);
+            free(key);
+            free(cache_path);
+            return file == NULL ? 127 : 2;
+        }
+        if (key != NULL) {
+            write_cache(cache_path, key, &st, &prog);
+        }
+    }
+    free(key);
+    free(cache_path);
+
+    script_argc = argc;
+    script_argv = argv;
+    run_program(&prog);
+
+    if (map != NULL) {
+        munmap(map, map_len);
+    } else {
+        program_free(&prog);
+    }
+    return last_status;
+}
+
 /**
  * Signal handler for SIGCHLD to reap background processes
  * @param sig signal number
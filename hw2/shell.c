@@ -13,10 +13,22 @@ int process_arglist(int count, char** arglist);
 int prepare(void);
 int finalize(void);
 
-int main(void)
+// argv - the path of a script file followed by its arguments, argc items in all
+// RETURNS - the exit status of the script
+int process_script(int argc, char** argv);
+
+int main(int argc, char** argv)
 {
 	if (prepare() != 0)
 		exit(1);
+
+	// myshell SCRIPT [ARGS...] runs a script instead of reading commands from stdin
+	if (argc > 1) {
+		int status = process_script(argc - 1, argv + 1);
+		if (finalize() != 0)
+			exit(1);
+		return status;
+	}
 	
 	while (1)
 	{
@@ -1,41 +1,55 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <time.h>
 #include "message_slot.h"
 
 /**
  * Reads a message from a message slot device on a specific channel.
+ * With header_mode 1 the message's sequence number and its age since the
+ * write are printed to stderr.
  * @usage:
- *   ./message_reader <device_file> <channel_id>
+ *   ./message_reader <device_file> <channel_id> [header_mode]
  * @example:
- *   ./message_reader /dev/slot0 42
- * @param argc Argument count (should be 3).
+ *   ./message_reader /dev/slot0 42 1
+ * @param argc Argument count (should be 3 or 4).
  * @param argv Argument values.
  * @return 0 on success, 1 on error.
  */
 int main(int argc, char **argv) {
     int fd, ret;
-    unsigned int channel_id;
+    unsigned int channel_id, header_mode = 0;
     const char *device_path;
     char buffer[MAX_MESSAGE_LEN];
+    struct msg_slot_header header;
+    struct iovec iov[2];
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <device_file> <channel_id>\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <device_file> <channel_id> [header_mode]\n", argv[0]);
         exit(1);
     }
 
     device_path = argv[1];
     channel_id = (unsigned int)atoi(argv[2]);
+    if (argc == 4)
+        header_mode = (unsigned int)atoi(argv[3]);
 
     if (channel_id == 0) {
         fprintf(stderr, "Invalid channel ID.\n");
         exit(1);
     }
 
+    if (header_mode != 0 && header_mode != 1) {
+        fprintf(stderr, "Invalid header mode (must be 0 or 1).\n");
+        exit(1);
+    }
+
     fd = open(device_path, O_RDONLY);
     if (fd < 0) {
         perror("open");
@@ -49,13 +63,37 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    ret = read(fd, buffer, MAX_MESSAGE_LEN);
+    if (header_mode) {
+        ret = ioctl(fd, MSG_SLOT_SET_HEADER, &header_mode);
+        if (ret < 0) {
+            perror("ioctl - set header");
+            close(fd);
+            exit(1);
+        }
+    }
+
+    // The header, when asked for, lands in its own buffer
+    iov[0].iov_base = &header;
+    iov[0].iov_len = header_mode ? sizeof(header) : 0;
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = MAX_MESSAGE_LEN;
+    ret = readv(fd, iov, 2);
     if (ret < 0) {
         perror("read");
         close(fd);
         exit(1);
     }
 
+    if (header_mode) {
+        struct timespec now;
+        long long age;
+
+        ret -= sizeof(header);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        age = (long long)now.tv_sec * 1000000000LL + now.tv_nsec - (long long)header.timestamp_ns;
+        fprintf(stderr, "seq %llu, written %lld ns ago\n", (unsigned long long)header.seq, age);
+    }
+
     // Write only the message content to stdout
     if (write(STDOUT_FILENO, buffer, ret) != ret) {
         perror("write to stdout");
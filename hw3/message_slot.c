@@ -5,6 +5,14 @@
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#include <linux/io_uring/cmd.h>
+#define HAVE_URING_CMD
+#endif
 #include "message_slot.h"
 
 MODULE_LICENSE("GPL");
@@ -12,13 +20,22 @@ MODULE_LICENSE("GPL");
 #define MAX_CHANNELS 1048576 // 2**20
 #define MAX_SLOTS 256
 
+// Splicing from a read_iter-only file got its own helper in 6.5
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+#define copy_splice_read generic_file_splice_read
+#endif
+
 /**
  * Represents a stored message in a channel.
  * @param length Length of the message in bytes.
+ * @param seq Sequence number of the message in its channel, counting writes from 1.
+ * @param timestamp ktime_get_ns() at the time of the write.
  * @param content Buffer containing the message content.
  */
 typedef struct message {
     size_t length;
+    u64 seq;
+    u64 timestamp;
     char content[MAX_MESSAGE_LEN];
 } message;
 
@@ -50,14 +67,19 @@ typedef struct slot {
  * Stores context for an open file descriptor.
  * @param channel_id ID of the currently selected channel (0 means not set).
  * @param censorship Censorship flag: 0 for off, 1 for on.
+ * @param header Header flag: 1 to prefix reads with a struct msg_slot_header.
  */
 typedef struct {
     unsigned int channel_id;
     int censorship;
+    int header;
 } file_context;
 
 static slot *slots = NULL;
 
+// Guards slots, channels and messages; io_uring workers make concurrent access routine
+static DEFINE_MUTEX(slots_lock);
+
 // ========== Helper Functions ========================================
 
 /**
@@ -137,6 +159,7 @@ static int device_open(struct inode *inode, struct file *file) {
     if (!ctx) return -ENOMEM;
     ctx->channel_id = 0;
     ctx->censorship = 0;
+    ctx->header = 0;
     file->private_data = ctx;
     return 0;
 }
@@ -153,9 +176,9 @@ static int device_release(struct inode *inode, struct file *file) {
 }
 
 /**
- * Handles ioctl operations (channel selection and censorship).
+ * Handles ioctl operations (channel selection, censorship and read headers).
  * @param file Pointer to the file structure.
- * @param cmd ioctl command (MSG_SLOT_CHANNEL or MSG_SLOT_SET_CEN).
+ * @param cmd ioctl command (MSG_SLOT_CHANNEL, MSG_SLOT_SET_CEN or MSG_SLOT_SET_HEADER).
  * @param arg Pointer to the unsigned int parameter from user space.
  * @return 0 on success, or -EINVAL/-EFAULT on error.
  */
@@ -163,7 +186,7 @@ static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
     file_context *ctx = (file_context *)file->private_data;
     unsigned int val;
 
-    if (cmd != MSG_SLOT_CHANNEL && cmd != MSG_SLOT_SET_CEN)
+    if (cmd != MSG_SLOT_CHANNEL && cmd != MSG_SLOT_SET_CEN && cmd != MSG_SLOT_SET_HEADER)
         return -EINVAL;
 
     if (copy_from_user(&val, (unsigned int __user *)arg, sizeof(unsigned int)))
@@ -177,107 +200,197 @@ static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
         if (val != 0 && val != 1)
             return -EINVAL;
         ctx->censorship = val;
+    } else if (cmd == MSG_SLOT_SET_HEADER) {
+        if (val != 0 && val != 1)
+            return -EINVAL;
+        ctx->header = val;
     }
 
     return 0;
 }
 
 /**
- * Writes a message to the selected channel.
- * @param file Pointer to the file structure.
- * @param buffer Pointer to user-provided message buffer.
- * @param length Length of the message in bytes.
- * @param offset Not used.
+ * Stores a message in a channel, replacing the previous one.
+ * @param file The device file; its censorship setting applies.
+ * @param channel_id The channel, non-zero.
+ * @param from Iterator over the message.
+ * @param nowait If set, fail with -EAGAIN rather than wait for the lock.
  * @return Number of bytes written on success, negative error code on failure.
  */
-static ssize_t device_write(struct file *file, const char __user *buffer, size_t length, loff_t *offset) {
-    char *msg_buf;
-    int minor;
+static ssize_t store_message(struct file *file, unsigned int channel_id, struct iov_iter *from, bool nowait) {
+    char msg_buf[MAX_MESSAGE_LEN];
     channel *ch;
     slot *s;
 
     file_context *ctx = (file_context *)file->private_data;
-    if (ctx->channel_id == 0) return -EINVAL;
+    size_t length = iov_iter_count(from);
     if (length == 0 || length > MAX_MESSAGE_LEN) return -EMSGSIZE;
 
-    msg_buf = kmalloc(length, GFP_KERNEL);
-    if (!msg_buf) return -ENOMEM;
-
-    if (copy_from_user(msg_buf, buffer, length)) {
-        kfree(msg_buf);
+    // Copy in before taking the lock, so a page fault never holds it
+    if (!copy_from_iter_full(msg_buf, length, from))
         return -EFAULT;
-    }
-
-    minor = iminor(file_inode(file));
-    s = get_slot(minor);
-    if (!s) {
-        kfree(msg_buf);
-        return -ENOMEM;
-    }
-
-    ch = get_channel(s, ctx->channel_id);
-    if (!ch) {
-        kfree(msg_buf);
-        return -ENOMEM;
-    }
 
-    if (!ch->msg)
-        ch->msg = kmalloc(sizeof(message), GFP_KERNEL);
-    if (!ch->msg) {
-        kfree(msg_buf);
+    if (!nowait)
+        mutex_lock(&slots_lock);
+    else if (!mutex_trylock(&slots_lock))
+        return -EAGAIN;
+
+    s = get_slot(iminor(file_inode(file)));
+    ch = s ? get_channel(s, channel_id) : NULL;
+    if (ch && !ch->msg)
+        ch->msg = kzalloc(sizeof(message), GFP_KERNEL);
+    if (!ch || !ch->msg) {
+        mutex_unlock(&slots_lock);
         return -ENOMEM;
     }
 
     ch->msg->length = length;
+    ch->msg->seq++;
+    ch->msg->timestamp = ktime_get_ns();
     if (ctx->censorship)
         censor_message(ch->msg->content, msg_buf, length);
     else
         memcpy(ch->msg->content, msg_buf, length);
 
-    kfree(msg_buf);
+    mutex_unlock(&slots_lock);
     return length;
 }
 
 /**
- * Reads the last written message from the selected channel.
- * @param file Pointer to the file structure.
- * @param buffer Destination user-space buffer.
- * @param length Maximum number of bytes to copy.
- * @param offset Not used.
+ * Copies out the last message stored in a channel, after a struct
+ * msg_slot_header if the file has asked for one.
+ * @param file The device file.
+ * @param channel_id The channel, non-zero.
+ * @param to Iterator over the destination, at least as long as the header and message.
+ * @param nowait If set, fail with -EAGAIN rather than wait for the lock.
  * @return Number of bytes read on success, negative error code on failure.
  */
-static ssize_t device_read(struct file *file, char __user *buffer, size_t length, loff_t *offset) {
-    int minor;
+static ssize_t load_message(struct file *file, unsigned int channel_id, struct iov_iter *to, bool nowait) {
+    file_context *ctx = (file_context *)file->private_data;
+    char msg_buf[MAX_MESSAGE_LEN];
+    struct msg_slot_header hdr;
+    size_t hdr_len = ctx->header ? sizeof(hdr) : 0;
+    size_t length;
     channel *ch;
     slot *s;
 
-    file_context *ctx = (file_context *)file->private_data;
-    if (ctx->channel_id == 0) return -EINVAL;
-
-    minor = iminor(file_inode(file));
-    s = get_slot(minor);
-    if (!s) return -EWOULDBLOCK;
-
-    ch = get_channel(s, ctx->channel_id);
-    if (!ch || !ch->msg) return -EWOULDBLOCK;
+    if (!nowait)
+        mutex_lock(&slots_lock);
+    else if (!mutex_trylock(&slots_lock))
+        return -EAGAIN;
 
-    if (length < ch->msg->length)
+    s = get_slot(iminor(file_inode(file)));
+    ch = s ? get_channel(s, channel_id) : NULL;
+    if (!ch || !ch->msg) {
+        mutex_unlock(&slots_lock);
+        return -EWOULDBLOCK;
+    }
+    length = ch->msg->length;
+    hdr.seq = ch->msg->seq;
+    hdr.timestamp_ns = ch->msg->timestamp;
+    hdr.length = length;
+    hdr.reserved = 0;
+    memcpy(msg_buf, ch->msg->content, length);
+    mutex_unlock(&slots_lock);
+
+    if (iov_iter_count(to) < hdr_len + length)
         return -ENOSPC;
 
-    if (copy_to_user(buffer, ch->msg->content, ch->msg->length))
+    if (copy_to_iter(&hdr, hdr_len, to) != hdr_len || copy_to_iter(msg_buf, length, to) != length)
         return -EFAULT;
 
-    return ch->msg->length;
+    return hdr_len + length;
+}
+
+/**
+ * Writes a message to the selected channel. Serves both write(2) and
+ * splice(2) from a pipe, where the iterator walks the pipe's pages and
+ * no user-space buffer is involved; each call stores one message.
+ * @param iocb The I/O control block, iocb->ki_filp is the device file.
+ * @param from Iterator over the message.
+ * @return Number of bytes written on success, negative error code on failure.
+ */
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    file_context *ctx = (file_context *)iocb->ki_filp->private_data;
+    if (ctx->channel_id == 0) return -EINVAL;
+    return store_message(iocb->ki_filp, ctx->channel_id, from, iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/**
+ * Reads the last written message from the selected channel. Serves both
+ * read(2) and splice(2) to a pipe, where the message is copied straight
+ * into pipe pages. With MSG_SLOT_SET_HEADER the message follows a struct
+ * msg_slot_header, so readv(2) can put the two in separate buffers.
+ * @param iocb The I/O control block, iocb->ki_filp is the device file.
+ * @param to Iterator over the destination, at least as long as the header and message.
+ * @return Number of bytes read on success, negative error code on failure.
+ */
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    file_context *ctx = (file_context *)iocb->ki_filp->private_data;
+    if (ctx->channel_id == 0) return -EINVAL;
+    return load_message(iocb->ki_filp, ctx->channel_id, to, iocb->ki_flags & IOCB_NOWAIT);
 }
 
+#ifdef HAVE_URING_CMD
+/**
+ * Handles an IORING_OP_URING_CMD submission: a write to or read from the
+ * channel named in the command, with no separate ioctl and without
+ * touching the file's selected channel, so one ring can drive many
+ * channels through one file. Completes inline; when io_uring asks not to
+ * block and the lock is busy, -EAGAIN has it retry from a worker.
+ * The VFS open-mode checks of read(2) and write(2) do not apply here, so
+ * they are repeated: writing needs FMODE_WRITE and reading FMODE_READ.
+ * @param ioucmd The command; cmd_op is MSG_SLOT_URING_WRITE or MSG_SLOT_URING_READ
+ *               and the sqe's cmd area holds a struct msg_slot_uring_cmd.
+ * @param issue_flags IO_URING_F_* flags of this attempt.
+ * @return Number of bytes written or read on success, -EBADF if the file
+ *         was not opened for the operation, other negative error code on failure.
+ */
+static int device_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    const struct msg_slot_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+    // The sqe is shared with user space, read each field once
+    unsigned int channel_id = READ_ONCE(cmd->channel_id);
+    size_t length = READ_ONCE(cmd->length);
+    void __user *buffer = u64_to_user_ptr(READ_ONCE(cmd->buffer));
+    bool nowait = issue_flags & IO_URING_F_NONBLOCK;
+    struct iov_iter iter;
+    int ret;
+
+    if (channel_id == 0) return -EINVAL;
+
+    switch (ioucmd->cmd_op) {
+    case MSG_SLOT_URING_WRITE:
+        if (!(ioucmd->file->f_mode & FMODE_WRITE)) return -EBADF;
+        ret = import_ubuf(ITER_SOURCE, buffer, length, &iter);
+        return ret ? ret : store_message(ioucmd->file, channel_id, &iter, nowait);
+    case MSG_SLOT_URING_READ:
+        if (!(ioucmd->file->f_mode & FMODE_READ)) return -EBADF;
+        ret = import_ubuf(ITER_DEST, buffer, length, &iter);
+        return ret ? ret : load_message(ioucmd->file, channel_id, &iter, nowait);
+    default:
+        return -EINVAL;
+    }
+}
+#endif
+
 // ========== Module setup ========================================
 
+/*
+ * Splicing goes through the iterator-based read and write: to a pipe, the
+ * message is copied into freshly allocated pipe pages, and from a pipe,
+ * the pipe's pages are handed to device_write_iter as one message.
+ */
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = device_open,
-    .read = device_read,
-    .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
     .unlocked_ioctl = device_ioctl,
+#ifdef HAVE_URING_CMD
+    .uring_cmd = device_uring_cmd,
+#endif
     .release = device_release
 };
 
@@ -2,6 +2,7 @@
 #define MESSAGE_SLOT_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define MAJOR_NUM 235
 
@@ -14,4 +15,27 @@
 // ioctl command to set censorship
 #define MSG_SLOT_SET_CEN _IOW(MAJOR_NUM, 1, unsigned int)
 
+// ioctl command to prefix reads with a struct msg_slot_header (1) or not (0)
+#define MSG_SLOT_SET_HEADER _IOW(MAJOR_NUM, 2, unsigned int)
+
+// What a read returns before the message when MSG_SLOT_SET_HEADER is on
+struct msg_slot_header {
+    __u64 seq;           // sequence number of the message in its channel, counting writes from 1
+    __u64 timestamp_ns;  // CLOCK_MONOTONIC time of the write, in nanoseconds
+    __u32 length;        // length of the message that follows
+    __u32 reserved;
+};
+
+// io_uring command opcodes (sqe->cmd_op of an IORING_OP_URING_CMD on a slot device)
+#define MSG_SLOT_URING_WRITE 0
+#define MSG_SLOT_URING_READ  1
+
+// Payload of a message slot io_uring command, placed in the sqe's cmd area.
+// The channel is given per command; the file's selected channel is not used.
+struct msg_slot_uring_cmd {
+    __u32 channel_id;  // channel to write to or read from, non-zero
+    __u32 length;      // length of the buffer
+    __u64 buffer;      // user address of the message buffer
+};
+
 #endif
@@ -24,12 +24,14 @@ typedef struct Node {
  * @param head Pointer to the first node in the queue.
  * @param tail Pointer to the last node in the queue.
  * @param size Current number of elements in the queue.
+ * @param waiting_threads Number of threads currently inside dequeue.
  * @param visited_items Total number of dequeue completions.
  */
 typedef struct Queue {
     Node *head;
     Node *tail;
     size_t size;
+    size_t waiting_threads;
     size_t visited_items;
 } Queue;
 
@@ -72,7 +74,10 @@ void initQueue(void) {
     queue.head = NULL;
     queue.tail = NULL;
     queue.size = 0;
+    queue.waiting_threads = 0;
     queue.visited_items = 0;
+    condQueue.head = NULL;
+    condQueue.tail = NULL;
     mtx_init(&lock, mtx_plain);
 }
 
@@ -89,6 +94,7 @@ void destroyQueue(void) {
     queue.head = NULL;
     queue.tail = NULL;
     queue.size = 0;
+    queue.waiting_threads = 0;
     queue.visited_items = 0;
 
     while (condQueue.head != NULL) {
@@ -155,6 +161,7 @@ void *dequeue(void) {
     }
 
     queue.visited_items++;
+    queue.waiting_threads++;
 
     while (queue.size == 0 || new_node->id != condQueue.head->id) {
         cnd_wait(&new_node->cond, &lock);
@@ -176,6 +183,11 @@ void *dequeue(void) {
     } else {
         cnd_signal(&(condQueue.head->cond));
     }
+    queue.waiting_threads--;
+
+    // This thread's node has left the condition queue, release it
+    cnd_destroy(&new_node->cond);
+    free(new_node);
 
     mtx_unlock(&lock);
 
@@ -190,3 +202,27 @@ void *dequeue(void) {
 size_t visited(void) {
     return queue.visited_items;
 }
+
+/**
+ * Returns the number of items currently in the queue.
+ *
+ * @return The queue length.
+ */
+size_t size(void) {
+    mtx_lock(&lock);
+    size_t current = queue.size;
+    mtx_unlock(&lock);
+    return current;
+}
+
+/**
+ * Returns the number of threads currently waiting in dequeue.
+ *
+ * @return The number of waiting threads.
+ */
+size_t waiting(void) {
+    mtx_lock(&lock);
+    size_t current = queue.waiting_threads;
+    mtx_unlock(&lock);
+    return current;
+}
@@ -7,6 +7,8 @@ void   initQueue(void);
 void   destroyQueue(void);
 void   enqueue(void *item);
 void  *dequeue(void);
+size_t size(void);
+size_t waiting(void);
 size_t visited(void);
 
 #endif
\ No newline at end of file
@@ -160,6 +160,33 @@ void test_reinit_queue() {
     destroyQueue();
 }
 
+// Test 9: size() and waiting() track queued items and blocked consumers
+int waiting_consumer(void* arg) {
+    (void)arg;
+    results[0] = dequeue();
+    return 0;
+}
+
+void test_size_and_waiting() {
+    initQueue();
+    enqueue(test_data[0]);
+    enqueue(test_data[1]);
+    int passed = size() == 2 && waiting() == 0;
+    dequeue();
+    dequeue();
+    passed = passed && size() == 0;
+
+    thrd_t t;
+    thrd_create(&t, waiting_consumer, NULL);
+    thrd_sleep(&(struct timespec){.tv_sec = 1}, NULL);
+    passed = passed && waiting() == 1;
+    enqueue(test_data[2]);
+    thrd_join(t, NULL);
+    passed = passed && waiting() == 0 && size() == 0 && results[0] == test_data[2];
+
+    printf("Test 9: %s\n", passed ? "passed" : "failed");
+    destroyQueue();
+}
 
 int main() {
     test_single_thread();
@@ -169,5 +196,6 @@ int main() {
     test_sleep_fifo_order();
     test_dequeue_blocks_and_returns_correct_item();
     test_reinit_queue();
+    test_size_and_waiting();
     return 0;
 }
\ No newline at end of file